@@ -0,0 +1,109 @@
+/* This file is part of the libebb web server library
+ *
+ * Copyright (c) 2008 Ryan Dahl (ry@ndahl.us)
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Vectorized helper for header names. It looks at 32 (AVX2) or 16 (SSE2)
+ * bytes at a time and falls back to a plain loop for the tail and on
+ * machines with neither. Which one is used is decided at compile time by
+ * -mavx2 / -msse2 (SSE2 is always on for x86_64).
+ */
+#ifndef ebb_scan_h
+#define ebb_scan_h
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
+/* Copies a header name into dst the way CGI spells it: letters are upper
+ * cased, digits are kept and everything else becomes '_', so "User-Agent"
+ * turns into "USER_AGENT". Only NUL is kept as is, which field names (CTL
+ * free by the grammar) never contain.
+ */
+static inline void
+ebb_header_upcase(char *dst, const char *src, size_t len)
+{
+  size_t i = 0;
+#if defined(__AVX2__)
+  {
+    /* bytes >= 0x80 are negative as signed chars and fail every range */
+    const __m256i a1 = _mm256_set1_epi8('a' - 1), z1 = _mm256_set1_epi8('z' + 1);
+    const __m256i A1 = _mm256_set1_epi8('A' - 1), Z1 = _mm256_set1_epi8('Z' + 1);
+    const __m256i d1 = _mm256_set1_epi8('0' - 1), d9 = _mm256_set1_epi8('9' + 1);
+    const __m256i nul = _mm256_setzero_si256();
+    const __m256i under = _mm256_set1_epi8('_'), bit = _mm256_set1_epi8(0x20);
+    for(; len - i >= 32; i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+      __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(v, a1), _mm256_cmpgt_epi8(z1, v));
+      __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, A1), _mm256_cmpgt_epi8(Z1, v));
+      __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, d1), _mm256_cmpgt_epi8(d9, v));
+      __m256i keep = _mm256_or_si256(_mm256_or_si256(upper, digit), _mm256_cmpeq_epi8(v, nul));
+      __m256i up = _mm256_andnot_si256(_mm256_and_si256(lower, bit), v);
+      __m256i word = _mm256_or_si256(keep, lower);
+      __m256i out = _mm256_or_si256(_mm256_and_si256(word, up), _mm256_andnot_si256(word, under));
+      _mm256_storeu_si256((__m256i*)(dst + i), out);
+    }
+  }
+#endif
+#if defined(__SSE2__)
+  {
+    const __m128i a1 = _mm_set1_epi8('a' - 1), z1 = _mm_set1_epi8('z' + 1);
+    const __m128i A1 = _mm_set1_epi8('A' - 1), Z1 = _mm_set1_epi8('Z' + 1);
+    const __m128i d1 = _mm_set1_epi8('0' - 1), d9 = _mm_set1_epi8('9' + 1);
+    const __m128i nul = _mm_setzero_si128();
+    const __m128i under = _mm_set1_epi8('_'), bit = _mm_set1_epi8(0x20);
+    for(; len - i >= 16; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+      __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(v, a1), _mm_cmplt_epi8(v, z1));
+      __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, A1), _mm_cmplt_epi8(v, Z1));
+      __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, d1), _mm_cmplt_epi8(v, d9));
+      __m128i keep = _mm_or_si128(_mm_or_si128(upper, digit), _mm_cmpeq_epi8(v, nul));
+      __m128i up = _mm_andnot_si128(_mm_and_si128(lower, bit), v);
+      __m128i word = _mm_or_si128(keep, lower);
+      __m128i out = _mm_or_si128(_mm_and_si128(word, up), _mm_andnot_si128(word, under));
+      _mm_storeu_si128((__m128i*)(dst + i), out);
+    }
+  }
+#endif
+  for(; i < len; i++) {
+    char c = src[i];
+    if(c >= 'a' && c <= 'z')
+      dst[i] = c - ('a' - 'A');
+    else if((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '\0')
+      dst[i] = c;
+    else
+      dst[i] = '_';
+  }
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,119 @@
+/* Thread pool throughput: how many requests per second make the round
+ * trip through eio_submit, a worker and eio_poll, for pools of 1 to 64
+ * threads. The build makes it as eio_bench (bench with automake); by hand:
+ *
+ *   cc -O2 -D_GNU_SOURCE -I. bench.c eio.c -lpthread -o bench
+ *   ./bench [requests] [work]
+ *
+ * Each request is a custom request which spins for "work" iterations
+ * (default 0, i.e. pure pool overhead) in the worker.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/time.h>
+
+#include "eio.h"
+
+static int respipe [2];
+static unsigned long work;
+static volatile unsigned long sink;
+static unsigned long completed;
+
+static void
+want_poll (void)
+{
+  char dummy = 0;
+  write (respipe [1], &dummy, 1);
+}
+
+static void
+done_poll (void)
+{
+  char dummy;
+  read (respipe [0], &dummy, 1);
+}
+
+static int
+execute (eio_req *req)
+{
+  unsigned long i, x = 0;
+  for (i = 0; i < work; i++)
+    x += i * i;
+  sink = x;
+  return 0;
+}
+
+static int
+done (eio_req *req)
+{
+  completed++;
+  return 0;
+}
+
+static double
+now (void)
+{
+  struct timeval tv;
+  gettimeofday (&tv, 0);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static double
+run (int threads, unsigned long n)
+{
+  struct pollfd pfd;
+  unsigned long i;
+  double start;
+
+  eio_set_min_parallel (threads);
+  eio_set_max_parallel (threads);
+  eio_set_max_idle (threads);
+
+  completed = 0;
+  start = now ();
+
+  for (i = 0; i < n; i++)
+    eio_custom (execute, i % 3 - 1, done, 0);
+
+  pfd.fd     = respipe [0];
+  pfd.events = POLLIN;
+
+  while (eio_nreqs ())
+    {
+      poll (&pfd, 1, -1);
+      eio_poll ();
+    }
+
+  if (completed != n)
+    {
+      fprintf (stderr, "lost requests: %lu of %lu completed\n", completed, n);
+      exit (1);
+    }
+
+  return n / (now () - start);
+}
+
+int
+main (int argc, char *argv[])
+{
+  unsigned long n = argc > 1 ? strtoul (argv [1], 0, 10) : 200000;
+  int threads;
+
+  work = argc > 2 ? strtoul (argv [2], 0, 10) : 0;
+
+  if (pipe (respipe))
+    abort ();
+
+  if (eio_init (want_poll, done_poll))
+    abort ();
+
+  /* warm up, so that thread creation is not measured */
+  run (64, n / 10);
+
+  for (threads = 1; threads <= 64; threads *= 2)
+    printf ("%2d threads: %10.0f req/s\n", threads, run (threads, n));
+
+  return 0;
+}
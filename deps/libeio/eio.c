@@ -188,6 +188,42 @@ static volatile unsigned int nreqs;    /* reqlock */
 static volatile unsigned int nready;   /* reqlock */
 static volatile unsigned int npending; /* reqlock */
 static volatile unsigned int max_idle = 4;
+static volatile unsigned int idle_timeout = IDLE_TIMEOUT;
+
+static eio_type_stats type_stats [EIO_NUM_TYPES]; /* only touched by eio_poll */
+
+static eio_tstamp etp_now (void)
+{
+  struct timeval tv;
+  gettimeofday (&tv, 0);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void etp_record (ETP_REQ *req)
+{
+  eio_type_stats *stats;
+  eio_tstamp latency;
+  unsigned long usec;
+  int bucket = 0;
+
+  if (req->type < 0 || req->type >= EIO_NUM_TYPES)
+    return;
+
+  stats = &type_stats [req->type];
+  latency = etp_now () - req->submitted;
+
+  usec = latency > 0. ? (unsigned long)(latency * 1e6) : 0;
+  while (usec && bucket < EIO_HIST_BUCKETS - 1)
+    {
+      usec >>= 1;
+      ++bucket;
+    }
+
+  ++stats->count;
+  stats->latency += latency;
+  stats->service += req->service;
+  ++stats->hist [bucket];
+}
 
 static mutex_t wrklock = X_MUTEX_INIT;
 static mutex_t reslock = X_MUTEX_INIT;
@@ -502,7 +538,12 @@ static int etp_poll (void)
         }
       else
         {
-          int res = ETP_FINISH (req);
+          int res;
+
+          if (req->type != EIO_GROUP)
+            etp_record (req);
+
+          res = ETP_FINISH (req);
           if (expect_false (res))
             return res;
         }
@@ -539,6 +580,9 @@ static void etp_submit (ETP_REQ *req)
   if (expect_false (req->pri < ETP_PRI_MIN - ETP_PRI_MIN)) req->pri = ETP_PRI_MIN - ETP_PRI_MIN;
   if (expect_false (req->pri > ETP_PRI_MAX - ETP_PRI_MIN)) req->pri = ETP_PRI_MAX - ETP_PRI_MIN;
 
+  req->submitted = etp_now ();
+  req->service = 0.;
+
   if (expect_false (req->type == EIO_GROUP))
     {
       /* I hope this is worth it :/ */
@@ -571,7 +615,7 @@ static void etp_submit (ETP_REQ *req)
 static void etp_set_max_poll_time (double nseconds)
 {
   if (WORDACCESS_UNSAFE) X_LOCK   (reslock);
-  max_poll_time = nseconds;
+  max_poll_time = nseconds * EIO_TICKS;
   if (WORDACCESS_UNSAFE) X_UNLOCK (reslock);
 }
 
@@ -723,6 +767,19 @@ void eio_set_max_idle (unsigned int nthreads)
   etp_set_max_idle (nthreads);
 }
 
+void eio_set_idle_timeout (unsigned int seconds)
+{
+  idle_timeout = seconds;
+}
+
+const eio_type_stats *eio_stats (int type)
+{
+  if (type < 0 || type >= EIO_NUM_TYPES)
+    return 0;
+
+  return &type_stats [type];
+}
+
 void eio_set_min_parallel (unsigned int nthreads)
 {
   etp_set_min_parallel (nthreads);
@@ -1089,7 +1146,7 @@ X_THREAD_PROC (etp_proc)
 
           ++idle;
 
-          ts.tv_sec = time (0) + IDLE_TIMEOUT;
+          ts.tv_sec = time (0) + idle_timeout;
           if (X_COND_TIMEDWAIT (reqwait, reqlock, ts) == ETIMEDOUT)
             {
               if (idle > max_idle)
@@ -1117,7 +1174,11 @@ X_THREAD_PROC (etp_proc)
         goto quit;
 
       if (!EIO_CANCELLED (req))
-        ETP_EXECUTE (self, req);
+        {
+          eio_tstamp start = etp_now ();
+          ETP_EXECUTE (self, req);
+          req->service = etp_now () - start;
+        }
 
       X_LOCK (reslock);
 
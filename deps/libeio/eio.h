@@ -78,6 +78,8 @@ enum {
   EIO_BUSY
 };
 
+#define EIO_NUM_TYPES (EIO_BUSY + 1)
+
 /* eio_sync_file_range flags */
 
 enum {
@@ -119,6 +121,7 @@ struct eio_req
   EIO_REQ_MEMBERS
 
   eio_req *grp, *grp_prev, *grp_next, *grp_first; /* private */
+  eio_tstamp submitted, service; /* private, for eio_stats */
 };
 
 /* _private_ flags */
@@ -158,11 +161,33 @@ void eio_set_min_parallel (unsigned int nthreads);
 void eio_set_max_parallel (unsigned int nthreads);
 void eio_set_max_idle     (unsigned int nthreads);
 
+/* seconds an idle thread waits for work before it may exit (default 10) */
+void eio_set_idle_timeout (unsigned int seconds);
+
+/* these read counters without a lock where word access is atomic */
 unsigned int eio_nreqs    (void); /* number of requests in-flight */
 unsigned int eio_nready   (void); /* number of not-yet handled requests */
 unsigned int eio_npending (void); /* numbe rof finished but unhandled requests */
 unsigned int eio_nthreads (void); /* number of worker threads in use currently */
 
+/* Timings of the requests of one type which have been through eio_poll.
+ * latency is from submission until eio_poll picked the request up and
+ * service the part of that spent executing in a worker, both summed over
+ * all requests, in seconds. hist[i] counts requests whose latency was
+ * under 2^i microseconds; the last bucket also holds everything slower.
+ * Groups are not counted. Only use from the thread calling eio_poll. */
+#define EIO_HIST_BUCKETS 24
+
+typedef struct {
+  unsigned int count;
+  eio_tstamp latency;
+  eio_tstamp service;
+  unsigned int hist [EIO_HIST_BUCKETS];
+} eio_type_stats;
+
+/* returns 0 for an unknown type */
+const eio_type_stats *eio_stats (int type);
+
 /*****************************************************************************/
 /* convinience wrappers */
 
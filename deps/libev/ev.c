@@ -1311,6 +1311,29 @@ ev_loop_count (EV_P)
   return loop_count;
 }
 
+int
+ev_edge_triggered (EV_P)
+{
+#if EV_USE_EPOLL
+  return backend == EVBACKEND_EPOLL && epoll_edge;
+#else
+  return 0;
+#endif
+}
+
+void
+ev_epoll_stats (EV_P_ struct ev_epoll_stats *stats)
+{
+#if EV_USE_EPOLL
+  stats->ctl    = epoll_nctl;
+  stats->skip   = epoll_nskip;
+  stats->wait   = epoll_nwait;
+  stats->events = epoll_nevents;
+#else
+  memset (stats, 0, sizeof (*stats));
+#endif
+}
+
 void
 ev_set_io_collect_interval (EV_P_ ev_tstamp interval)
 {
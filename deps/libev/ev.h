@@ -391,6 +391,7 @@ union ev_any_watcher
 /* flag bits */
 #define EVFLAG_NOENV      0x01000000U /* do NOT consult environment */
 #define EVFLAG_FORKCHECK  0x02000000U /* check for a fork in each iteration */
+#define EVFLAG_EDGE       0x04000000U /* epoll: edge-triggered, see ev_epoll.c */
 /* method bits to be ored together */
 #define EVBACKEND_SELECT  0x00000001U /* about anywhere */
 #define EVBACKEND_POLL    0x00000002U /* !win */
@@ -493,6 +494,17 @@ void ev_default_fork (void);
 
 unsigned int ev_backend (EV_P);    /* backend in use by loop */
 unsigned int ev_loop_count (EV_P); /* number of loop iterations */
+int ev_edge_triggered (EV_P);      /* EVFLAG_EDGE is in effect */
+
+/* system calls made by the epoll backend, all 0 with other backends */
+struct ev_epoll_stats
+{
+  unsigned long ctl;    /* epoll_ctl calls */
+  unsigned long skip;   /* watcher changes which needed no epoll_ctl (EVFLAG_EDGE) */
+  unsigned long wait;   /* epoll_wait calls */
+  unsigned long events; /* events returned by epoll_wait */
+};
+void ev_epoll_stats (EV_P_ struct ev_epoll_stats *stats);
 #endif /* prototypes */
 
 #define EVLOOP_NONBLOCK	1 /* do not block/wait */
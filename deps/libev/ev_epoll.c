@@ -55,6 +55,13 @@
  * epoll_ctl syscalls for common usage patterns and handle the breakage
  * ensuing from receiving events for closed and otherwise long gone
  * file descriptors.
+ *
+ * with EVFLAG_EDGE an fd is added once, for both EPOLLIN and EPOLLOUT
+ * with EPOLLET, and never modified afterwards: starting and stopping
+ * watchers on it costs no syscall at all, only which events get passed
+ * on changes. the price is that an event comes once per edge. a watcher
+ * must read or write until EAGAIN, and one started without having seen
+ * EAGAIN first has to ev_feed_event itself, as the edge may be gone.
  */
 
 #include <sys/epoll.h>
@@ -76,6 +83,18 @@ epoll_modify (EV_P_ int fd, int oev, int nev)
   if (!nev)
     return;
 
+  if (epoll_edge)
+    {
+      /* already armed for everything */
+      if (oev)
+        {
+          ++epoll_nskip;
+          return;
+        }
+
+      nev = EV_READ | EV_WRITE;
+    }
+
   oldmask = anfds [fd].emask;
   anfds [fd].emask = nev;
 
@@ -83,8 +102,10 @@ epoll_modify (EV_P_ int fd, int oev, int nev)
   ev.data.u64 = (uint64_t)(uint32_t)fd
               | ((uint64_t)(uint32_t)++anfds [fd].egen << 32);
   ev.events   = (nev & EV_READ  ? EPOLLIN  : 0)
-              | (nev & EV_WRITE ? EPOLLOUT : 0);
+              | (nev & EV_WRITE ? EPOLLOUT : 0)
+              | (epoll_edge     ? EPOLLET  : 0);
 
+  ++epoll_nctl;
   if (expect_true (!epoll_ctl (backend_fd, oev ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev)))
     return;
 
@@ -94,6 +115,7 @@ epoll_modify (EV_P_ int fd, int oev, int nev)
       if (!nev)
         goto dec_egen;
 
+      ++epoll_nctl;
       if (!epoll_ctl (backend_fd, EPOLL_CTL_ADD, fd, &ev))
         return;
     }
@@ -104,6 +126,7 @@ epoll_modify (EV_P_ int fd, int oev, int nev)
       if (oldmask == nev)
         goto dec_egen;
 
+      ++epoll_nctl;
       if (!epoll_ctl (backend_fd, EPOLL_CTL_MOD, fd, &ev))
         return;
     }
@@ -121,6 +144,8 @@ epoll_poll (EV_P_ ev_tstamp timeout)
   int i;
   int eventcnt = epoll_wait (backend_fd, epoll_events, epoll_eventmax, (int)ceil (timeout * 1000.));
 
+  ++epoll_nwait;
+
   if (expect_false (eventcnt < 0))
     {
       if (errno != EINTR)
@@ -129,6 +154,8 @@ epoll_poll (EV_P_ ev_tstamp timeout)
       return;
     }
 
+  epoll_nevents += eventcnt;
+
   for (i = 0; i < eventcnt; ++i)
     {
       struct epoll_event *ev = epoll_events + i;
@@ -146,7 +173,8 @@ epoll_poll (EV_P_ ev_tstamp timeout)
           continue;
         }
 
-      if (expect_false (got & ~want))
+      /* edge-triggered fds stay armed for everything, unwanted events are dropped by fd_event */
+      if (expect_false (got & ~want) && !epoll_edge)
         {
           anfds [fd].emask = want;
 
@@ -155,6 +183,7 @@ epoll_poll (EV_P_ ev_tstamp timeout)
           ev->events = (want & EV_READ  ? EPOLLIN  : 0)
                      | (want & EV_WRITE ? EPOLLOUT : 0);
 
+          ++epoll_nctl;
           if (epoll_ctl (backend_fd, want ? EPOLL_CTL_MOD : EPOLL_CTL_DEL, fd, ev))
             {
               postfork = 1; /* an error occured, recreate kernel state */
@@ -186,6 +215,7 @@ epoll_init (EV_P_ int flags)
 
   backend_fudge  = 0.; /* kernel sources seem to indicate this to be zero */
   backend_modify = epoll_modify;
+  epoll_edge     = !!(flags & EVFLAG_EDGE);
   backend_poll   = epoll_poll;
 
   epoll_eventmax = 64; /* initial number of events receivable per poll */
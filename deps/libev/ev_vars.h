@@ -89,6 +89,11 @@ VARx(int, pollidxmax)
 #if EV_USE_EPOLL || EV_GENWRAP
 VARx(struct epoll_event *, epoll_events)
 VARx(int, epoll_eventmax)
+VARx(int, epoll_edge) /* EVFLAG_EDGE */
+VARx(unsigned long, epoll_nctl) /* epoll_ctl calls */
+VARx(unsigned long, epoll_nskip) /* changes which needed none, see ev_epoll.c */
+VARx(unsigned long, epoll_nwait) /* epoll_wait calls */
+VARx(unsigned long, epoll_nevents) /* events returned by epoll_wait */
 #endif
 
 #if EV_USE_KQUEUE || EV_GENWRAP
@@ -31,6 +31,11 @@
 #define pollidxmax ((loop)->pollidxmax)
 #define epoll_events ((loop)->epoll_events)
 #define epoll_eventmax ((loop)->epoll_eventmax)
+#define epoll_edge ((loop)->epoll_edge)
+#define epoll_nctl ((loop)->epoll_nctl)
+#define epoll_nskip ((loop)->epoll_nskip)
+#define epoll_nwait ((loop)->epoll_nwait)
+#define epoll_nevents ((loop)->epoll_nevents)
 #define kqueue_changes ((loop)->kqueue_changes)
 #define kqueue_changemax ((loop)->kqueue_changemax)
 #define kqueue_changecnt ((loop)->kqueue_changecnt)
@@ -105,6 +110,11 @@
 #undef pollidxmax
 #undef epoll_events
 #undef epoll_eventmax
+#undef epoll_edge
+#undef epoll_nctl
+#undef epoll_nskip
+#undef epoll_nwait
+#undef epoll_nevents
 #undef kqueue_changes
 #undef kqueue_changemax
 #undef kqueue_changecnt
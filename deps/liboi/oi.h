@@ -4,5 +4,6 @@
 #include <oi_socket.h>
 #include <oi_async.h>
 #include <oi_file.h>
+#include <oi_wheel.h>
 
 #endif
@@ -2,26 +2,23 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* Only for buffers made by oi_buf_new() and oi_buf_new2(). */
 void oi_buf_destroy 
   ( oi_buf *buf
   )
 {
-  free(buf->base);
   free(buf);
 }
 
+/* The oi_buf and its bytes are allocated together. */
 oi_buf * oi_buf_new2
   ( size_t len
   )
 {
-  oi_buf *buf = malloc(sizeof(oi_buf));
+  oi_buf *buf = malloc(sizeof(oi_buf) + len);
   if(!buf) 
     return NULL;
-  buf->base = malloc(len);
-  if(!buf->base) {
-    free(buf);
-    return NULL; 
-  }
+  buf->base = (char*)(buf + 1);
   buf->len = len;
   buf->release = oi_buf_destroy;
   return buf;
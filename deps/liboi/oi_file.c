@@ -80,7 +80,10 @@ oi_file_init (oi_file *file)
   file->fd = -1;
   file->loop = NULL;
   file->write_buf = NULL;
+  file->write_socket = NULL;
   file->read_buffer = NULL;
+  file->read_buffer_size = 0;
+  file->io_task.active = 0;
 
   file->on_open = NULL;
   file->on_read = NULL;
@@ -333,6 +336,11 @@ oi_file_close (oi_file *file)
 {
   assert(file->fd >= 0 && "file not open!");
   clear_write_queue(file);
+  /* left behind by a failed write */
+  if(file->write_buf) {
+    RELEASE_BUF(file->write_buf);
+    file->write_buf = NULL;
+  }
   oi_task_init_close ( &file->io_task
                      , after_close
                      , file->fd
@@ -1,11 +1,11 @@
 #include <oi.h>
 #include <ev.h>
-#ifdef __cplusplus
-extern "C" {
-#endif 
 
 #ifndef oi_file_h
 #define oi_file_h
+#ifdef __cplusplus
+extern "C" {
+#endif 
 
 typedef struct oi_file oi_file;
 
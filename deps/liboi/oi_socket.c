@@ -1,3 +1,6 @@
+#ifdef __linux__
+# define _GNU_SOURCE /* accept4() */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -5,6 +8,8 @@
 #include <fcntl.h>  /* fcntl() */
 #include <errno.h> /* for the default methods */
 #include <string.h> /* memset */
+#include <limits.h> /* IOV_MAX */
+#include <sys/uio.h> /* struct iovec */
 
 #include <netinet/tcp.h> /* TCP_NODELAY */
 
@@ -28,6 +33,17 @@
 #define AGAIN 1
 #define ERROR 2 
 
+/* Reads one socket may do per wakeup. A peer which keeps sending would
+ * otherwise keep the loop to itself. */
+#define OI_MAX_READS_PER_EVENT 16
+
+/* maximum number of buffers handed to the kernel in one send */
+#ifdef IOV_MAX
+# define OI_MAX_IOVEC IOV_MAX
+#else
+# define OI_MAX_IOVEC 16
+#endif
+
 #define RAISE_ERROR(s, _domain, _code) do { \
   if(s->on_error) { \
     struct oi_error __oi_error; \
@@ -71,28 +87,37 @@ half_close(oi_socket *socket)
   return OKAY;
 }
 
+/* Marks sent bytes as written. A single send may span several buffers;
+ * every buffer which has been completely written is released.
+ */
 static void
 update_write_buffer_after_send(oi_socket *socket, ssize_t sent)
 {
-  oi_queue *q = oi_queue_last(&socket->out_stream);
-  oi_buf *to_write = oi_queue_data(q, oi_buf, queue);
-  to_write->written += sent;
   socket->written += sent;
 
-  if(to_write->written == to_write->len) {
+  while(!oi_queue_empty(&socket->out_stream)) {
+    oi_queue *q = oi_queue_last(&socket->out_stream);
+    oi_buf *to_write = oi_queue_data(q, oi_buf, queue);
+    size_t left = to_write->len - to_write->written;
+
+    if((size_t)sent < left) {
+      to_write->written += sent;
+      return;
+    }
+
+    to_write->written += left;
+    sent -= left;
 
     oi_queue_remove(q);
 
     if(to_write->release) {
       to_write->release(to_write);
     }  
-
-    if(oi_queue_empty(&socket->out_stream)) {
-      ev_io_stop(socket->loop, &socket->write_watcher);
-      if(socket->on_drain)
-        socket->on_drain(socket);
-    }
   }
+
+  ev_io_stop(socket->loop, &socket->write_watcher);
+  if(socket->on_drain)
+    socket->on_drain(socket);
 }
 
 
@@ -341,8 +366,27 @@ socket_send(oi_socket *socket)
     return AGAIN;
   }
 
-  oi_queue *q = oi_queue_last(&socket->out_stream);
-  oi_buf *to_write = oi_queue_data(q, oi_buf, queue);
+  /* Gather as much of the out_stream as possible into a single call. The
+   * oldest buffer is at the tail of the queue. */
+  struct iovec iov[OI_MAX_IOVEC];
+  int iovcnt = 0;
+  oi_queue *q;
+
+  for( q = oi_queue_last(&socket->out_stream)
+     ; q != &socket->out_stream && iovcnt < OI_MAX_IOVEC
+     ; q = q->prev
+     ) 
+  {
+    oi_buf *to_write = oi_queue_data(q, oi_buf, queue);
+    iov[iovcnt].iov_base = to_write->base + to_write->written;
+    iov[iovcnt].iov_len = to_write->len - to_write->written;
+    iovcnt++;
+  }
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
   
   int flags = 0;
 #ifdef MSG_NOSIGNAL
@@ -352,19 +396,17 @@ socket_send(oi_socket *socket)
   flags |= MSG_DONTWAIT;
 #endif
 
-  /* TODO use writev() here */
-
-  sent = send( socket->fd
-             , to_write->base + to_write->written
-             , to_write->len - to_write->written
-             , flags
-             );
+  /* sendmsg() rather than writev() so that MSG_NOSIGNAL can be passed */
+  sent = sendmsg(socket->fd, &msg, flags);
 
   if(sent < 0) {
     switch(errno) {
       case EAGAIN:
         return AGAIN;
 
+      case EINTR:
+        return OKAY; /* try again */
+
       case ECONNREFUSED:
       case ECONNRESET:
         socket->write_action = NULL;
@@ -396,7 +438,8 @@ socket_send(oi_socket *socket)
 static int
 socket_recv(oi_socket *socket)
 {
-  char buf[TCP_MAXWIN];
+  char stack_buf[TCP_MAXWIN];
+  char *buf = stack_buf;
   size_t buf_size = TCP_MAXWIN;
   ssize_t recved;
 
@@ -408,14 +451,25 @@ socket_recv(oi_socket *socket)
     return OKAY;
   }
 
+  if(socket->read_buffer) {
+    size_t size = 0;
+    char *b = socket->read_buffer(socket, &size);
+    if(b && size > 0) {
+      buf = b;
+      buf_size = size;
+    }
+  }
+
   recved = recv(socket->fd, buf, buf_size, 0);
 
   if(recved < 0) {
     switch(errno) {
       case EAGAIN: 
-      case EINTR:  
         return AGAIN;
 
+      case EINTR:  
+        return OKAY; /* try again */
+
       /* A remote host refused to allow the network connection (typically
        * because it is not running the requested service). */
       case ECONNREFUSED:
@@ -492,39 +546,70 @@ on_connection(struct ev_loop *loop, ev_io *watcher, int revents)
     return;
   }
   
-  struct sockaddr address; /* connector's address information */
-  socklen_t addr_len = sizeof(address);
-  
-  /* TODO accept all possible connections? currently: just one */
-  int fd = accept(server->fd, (struct sockaddr*)&address, &addr_len);
-  if(fd < 0) {
-    perror("accept()");
-    return;
-  }
-
-  oi_socket *socket = NULL;
-  if(server->on_connection)
-    socket = server->on_connection(server, (struct sockaddr*)&address, addr_len);
+  /* Drain the accept queue, but at most accept_batch connections so that
+   * a connection storm cannot starve the rest of the loop. */
+  int i;
+  for(i = 0; i < server->accept_batch && server->listening; i++) {
+    struct sockaddr_storage address; /* connector's address information */
+    socklen_t addr_len = sizeof(address);
+
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+    int fd = accept4( server->fd
+                    , (struct sockaddr*)&address
+                    , &addr_len
+                    , SOCK_NONBLOCK | SOCK_CLOEXEC
+                    );
+#else
+    int fd = accept(server->fd, (struct sockaddr*)&address, &addr_len);
+#endif
+    if(fd < 0) {
+      switch(errno) {
+        case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
+          return;
+        case ECONNABORTED:
+        case EINTR:
+          continue;
+        default:
+          perror("accept()");
+          return;
+      }
+    }
 
-  if(socket == NULL) {
-    close(fd);
-    return;
-  } 
-  
-  int flags = fcntl(fd, F_GETFL, 0);
-  int r = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-  if(r < 0) {
-    /* TODO error report */
-  }
-  
+    oi_socket *socket = NULL;
+    if(server->on_connection)
+      socket = server->on_connection(server, (struct sockaddr*)&address, addr_len);
+
+    if(socket == NULL) {
+      close(fd);
+      continue;
+    } 
+    
+#if !(defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC))
+    int flags = fcntl(fd, F_GETFL, 0);
+    int r = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    if(r < 0) {
+      /* TODO error report */
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+    
 #ifdef SO_NOSIGPIPE
-  flags = 1;
-  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &flags, sizeof(flags));
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
 #endif
 
-  socket->server = server;
-  assign_file_descriptor(socket, fd);
-  oi_socket_attach(socket, loop);
+    socket->server = server;
+    assign_file_descriptor(socket, fd);
+    oi_socket_attach(socket, loop);
+  }
+
+  /* The batch is used up and there is probably more. An edge-triggered
+   * loop will not report the socket again, so come back next iteration. */
+  if(server->listening && ev_edge_triggered(loop))
+    ev_feed_event(loop, watcher, EV_READ);
 }
 
 int
@@ -552,6 +637,19 @@ oi_server_listen(oi_server *server, struct addrinfo *addrinfo)
 
   flags = 1;
   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+  if(server->reuseport) {
+#ifdef SO_REUSEPORT
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags)) < 0) {
+      perror("setsockopt(SO_REUSEPORT)");
+      close(fd);
+      return -1;
+    }
+#else
+    fprintf(stderr, "SO_REUSEPORT is not supported on this platform\n");
+    close(fd);
+    return -1;
+#endif
+  }
   setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
   setsockopt(fd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
 
@@ -579,6 +677,19 @@ oi_server_listen(oi_server *server, struct addrinfo *addrinfo)
   return 0;
 }
 
+/**
+ * Accepts from an fd which is already listening, e.g. another server's, so
+ * that several loops can share one socket. The fd stays the caller's.
+ */
+void
+oi_server_listen_fd(oi_server *server, int fd)
+{
+  assert(server->listening == FALSE);
+  server->fd = fd;
+  server->listening = TRUE;
+  ev_io_set (&server->connection_watcher, server->fd, EV_READ);
+}
+
 /**
  * Stops the server. Will not accept new connections.  Does not drop
  * existing connections.
@@ -612,6 +723,8 @@ void
 oi_server_init(oi_server *server, int backlog)
 {
   server->backlog = backlog;
+  server->accept_batch = 64;
+  server->reuseport = FALSE;
   server->listening = FALSE;
   server->fd = -1;
   server->connection_watcher.data = server;
@@ -622,6 +735,15 @@ oi_server_init(oi_server *server, int backlog)
   server->data = NULL;
 }
 
+static void
+socket_timeout(oi_socket *socket)
+{
+  if(socket->on_timeout) { socket->on_timeout(socket); }
+
+  /* TODD set timer to zero */
+  full_close(socket);
+}
+
 /* Internal callback. called by socket->timeout_watcher */
 static void 
 on_timeout(struct ev_loop *loop, ev_timer *watcher, int revents)
@@ -632,11 +754,18 @@ on_timeout(struct ev_loop *loop, ev_timer *watcher, int revents)
 
  // printf("on_timeout\n");
 
-  if(socket->on_timeout) { socket->on_timeout(socket); }
+  socket_timeout(socket);
+}
+
+/* Internal callback. called by socket->wheel */
+static void 
+on_wheel_timeout(oi_wheel_entry *entry)
+{
+  oi_socket *socket = entry->data;
 
+  assert(entry == &socket->timeout_entry);
 
-  /* TODD set timer to zero */
-  full_close(socket);
+  socket_timeout(socket);
 }
 
 static void
@@ -662,6 +791,7 @@ on_io_event(struct ev_loop *loop, ev_io *watcher, int revents)
   }
 
   int r;
+  int reads = 0;
   int have_read_event = TRUE;
   int have_write_event = TRUE;
 
@@ -670,7 +800,15 @@ on_io_event(struct ev_loop *loop, ev_io *watcher, int revents)
     if(socket->read_action) {
       r = socket->read_action(socket);
       if(r == ERROR) goto close;
-      if(r == AGAIN) have_read_event = FALSE;
+      if(r == AGAIN) {
+        have_read_event = FALSE;
+      } else if(++reads == OI_MAX_READS_PER_EVENT) {
+        /* Let the other watchers run. There is probably more to read, and
+         * an edge-triggered loop will not say so again. */
+        have_read_event = FALSE;
+        if(ev_edge_triggered(loop) && socket->read_watcher.active)
+          ev_timer_start(loop, &socket->resume_watcher);
+      }
     } else {
       have_read_event = FALSE;
     }
@@ -709,6 +847,20 @@ close:
    * access beyond this point. */
 }
 
+/* Internal callback. called by socket->resume_watcher in the loop
+ * iteration after on_io_event stopped short of EAGAIN. The timer is due
+ * at once, so the loop does not block, and has the lowest priority, so
+ * the watchers which became ready in the meantime go first. Feeding the
+ * event from on_io_event itself would run it again before them.
+ */
+static void
+on_resume(struct ev_loop *loop, ev_timer *watcher, int revents)
+{
+  oi_socket *socket = watcher->data;
+  if(socket->read_watcher.active)
+    on_io_event(loop, &socket->read_watcher, EV_READ);
+}
+
 /**
  * If using SSL do consider setting
  *   gnutls_db_set_retrieve_function (socket->session, _);
@@ -723,6 +875,7 @@ oi_socket_init(oi_socket *socket, float timeout)
   socket->server = NULL;
   socket->loop = NULL;
   socket->connected = FALSE;
+  socket->written = 0;
 
   oi_queue_init(&socket->out_stream);
 
@@ -742,10 +895,20 @@ oi_socket_init(oi_socket *socket, float timeout)
   ev_timer_init(&socket->timeout_watcher, on_timeout, 0., timeout);
   socket->timeout_watcher.data = socket;  
 
+  ev_timer_init(&socket->resume_watcher, on_resume, 0., 0.);
+  ev_set_priority(&socket->resume_watcher, EV_MINPRI);
+  socket->resume_watcher.data = socket;
+
+  oi_wheel_entry_init(&socket->timeout_entry, timeout);
+  socket->timeout_entry.on_timeout = on_wheel_timeout;
+  socket->timeout_entry.data = socket;
+  socket->wheel = NULL;
+
   socket->read_action = NULL;
   socket->write_action = NULL;
 
   socket->chunksize = TCP_MAXWIN; 
+  socket->read_buffer = NULL;
   socket->on_connect = NULL;
   socket->on_read = NULL;
   socket->on_drain = NULL;
@@ -815,7 +978,10 @@ oi_socket_close (oi_socket *socket)
 void 
 oi_socket_reset_timeout(oi_socket *socket)
 {
-  ev_timer_again(socket->loop, &socket->timeout_watcher);
+  if(socket->wheel)
+    oi_wheel_again(&socket->timeout_entry);
+  else
+    ev_timer_again(socket->loop, &socket->timeout_watcher);
 }
 
 /**
@@ -825,13 +991,22 @@ oi_socket_reset_timeout(oi_socket *socket)
 void 
 oi_socket_write(oi_socket *socket, oi_buf *buf)
 {
-  if(socket->write_action == NULL)
+  if(socket->write_action == NULL) {
+    /* write end is closed. nothing will be written. */
+    if(buf->release) { buf->release(buf); }
     return;
+  }
 
   oi_queue_insert_head(&socket->out_stream, &buf->queue);
 
   buf->written = 0;
+  if(socket->write_watcher.active)
+    return;
   ev_io_start(socket->loop, &socket->write_watcher);
+  /* No EAGAIN has been seen, so there may never be an edge. Writes made
+   * before the loop gets here still go out in one sendmsg(). */
+  if(ev_edge_triggered(socket->loop))
+    ev_feed_event(socket->loop, &socket->write_watcher, EV_WRITE);
 }
 
 static void
@@ -860,7 +1035,10 @@ oi_socket_attach(oi_socket *socket, struct ev_loop *loop)
 {
   socket->loop = loop;
 
-  ev_timer_again(loop, &socket->timeout_watcher);
+  if(socket->wheel)
+    oi_wheel_start(socket->wheel, &socket->timeout_entry);
+  else
+    ev_timer_again(loop, &socket->timeout_watcher);
 
   if(socket->read_action) 
     ev_io_start(loop, &socket->read_watcher);
@@ -879,6 +1057,8 @@ oi_socket_detach(oi_socket *socket)
     ev_io_stop(socket->loop, &socket->write_watcher);
     ev_io_stop(socket->loop, &socket->read_watcher);
     ev_timer_stop(socket->loop, &socket->timeout_watcher);
+    ev_timer_stop(socket->loop, &socket->resume_watcher);
+    oi_wheel_stop(&socket->timeout_entry);
     socket->loop = NULL;
   }
 }
@@ -888,14 +1068,17 @@ oi_socket_read_stop (oi_socket *socket)
 {
   ev_io_stop(socket->loop, &socket->read_watcher);
   ev_clear_pending (socket->loop, &socket->read_watcher);
+  ev_timer_stop(socket->loop, &socket->resume_watcher);
 }
 
 void
 oi_socket_read_start (oi_socket *socket)
 {
-  if(socket->read_action) {
+  if(socket->read_action && !socket->read_watcher.active) {
     ev_io_start(socket->loop, &socket->read_watcher);
-    /* XXX feed event? */
+    /* Reading may have stopped before EAGAIN. */
+    if(ev_edge_triggered(socket->loop))
+      ev_feed_event(socket->loop, &socket->read_watcher, EV_READ);
   }
 }
 
@@ -3,6 +3,7 @@
 #include <oi_queue.h>
 #include <oi_error.h>
 #include <oi_buf.h>
+#include <oi_wheel.h>
 
 #ifndef oi_socket_h
 #define oi_socket_h
@@ -22,6 +23,7 @@ typedef struct oi_socket  oi_socket;
 
 void oi_server_init          (oi_server *, int backlog);
  int oi_server_listen        (oi_server *, struct addrinfo *addrinfo);
+void oi_server_listen_fd     (oi_server *, int fd);
 void oi_server_attach        (oi_server *, struct ev_loop *loop);
 void oi_server_detach        (oi_server *);
 void oi_server_close         (oi_server *); 
@@ -53,6 +55,8 @@ struct oi_server {
   ev_io connection_watcher;
 
   /* public */
+  int accept_batch; /* max connections accepted per readiness event */
+  unsigned reuseport:1; /* set SO_REUSEPORT before binding */
   oi_socket* (*on_connection) (oi_server *, struct sockaddr *remote_addr, socklen_t remove_addr_len);
   void       (*on_error)      (oi_server *, struct oi_error e);
   void *data;
@@ -77,12 +81,21 @@ struct oi_socket {
   ev_io write_watcher;
   ev_io read_watcher;
   ev_timer timeout_watcher;
+  ev_timer resume_watcher;
+  oi_wheel_entry timeout_entry;
 #if HAVE_GNUTLS
   gnutls_session_t session;
 #endif
   
   /* public */
   size_t chunksize; /* the maximum chunk that on_read() will return */
+  oi_wheel *wheel; /* if set, the idle timeout is kept on this wheel */
+  /* if set, recv() reads into the memory this returns, at most *size
+   * bytes, instead of a buffer on the stack. on_read() then gets a pointer
+   * into it. Returning NULL falls back to the stack. Not used by secure
+   * sockets.
+   */
+  void* (*read_buffer)  (oi_socket *, size_t *size);
   void (*on_connect)   (oi_socket *);
   void (*on_read)      (oi_socket *, const void *buf, size_t count);
   void (*on_drain)     (oi_socket *);
@@ -0,0 +1,212 @@
+#include <assert.h>
+
+#include <ev.h>
+#include <oi_wheel.h>
+
+#define LEVEL0_MASK (OI_WHEEL_SIZE - 1)
+
+/* The tick at or after which the entry expires. Never the current tick;
+ * that slot is being (or has been) processed. */
+static unsigned long
+deadline_tick(oi_wheel *wheel, oi_wheel_entry *entry)
+{
+  double x = (entry->deadline - wheel->base) / wheel->tick;
+  unsigned long t;
+
+  if(x <= (double)wheel->current)
+    return wheel->current + 1;
+  t = (unsigned long)x;
+  if((double)t < x) t++; /* round up */
+  return t;
+}
+
+static void
+place(oi_wheel *wheel, oi_wheel_entry *entry)
+{
+  unsigned long t = deadline_tick(wheel, entry);
+  unsigned long delta = t - wheel->current;
+  oi_queue *slot;
+
+  if(delta < OI_WHEEL_SIZE) {
+    slot = &wheel->level0[t & LEVEL0_MASK];
+  } else if(delta < OI_WHEEL_SIZE * (OI_WHEEL_LEVEL1 - 1)) {
+    slot = &wheel->level1[(t >> OI_WHEEL_BITS) % OI_WHEEL_LEVEL1];
+  } else {
+    /* too far out. park it in the last slot, it will be placed again */
+    unsigned long last = (wheel->current >> OI_WHEEL_BITS) + OI_WHEEL_LEVEL1 - 1;
+    slot = &wheel->level1[last % OI_WHEEL_LEVEL1];
+  }
+
+  oi_queue_insert_head(slot, &entry->queue);
+}
+
+/* Moves everything in slot to list, leaving slot empty. Callbacks may add
+ * to the wheel while list is being worked through. */
+static void
+take(oi_queue *slot, oi_queue *list)
+{
+  oi_queue_init(list);
+  if(oi_queue_empty(slot))
+    return;
+  list->next = slot->next;
+  list->prev = slot->prev;
+  list->next->prev = list;
+  list->prev->next = list;
+  oi_queue_init(slot);
+}
+
+static void
+cascade(oi_wheel *wheel, oi_queue *slot)
+{
+  oi_queue list;
+  take(slot, &list);
+
+  while(!oi_queue_empty(&list)) {
+    oi_queue *q = oi_queue_head(&list);
+    oi_wheel_entry *entry = oi_queue_data(q, oi_wheel_entry, queue);
+    oi_queue_remove(q);
+    place(wheel, entry);
+  }
+}
+
+/* Resetting an entry only moves its deadline. Entries which were reset
+ * since they were placed are simply placed again here. */
+static void
+expire(oi_wheel *wheel, oi_queue *slot)
+{
+  oi_queue list;
+  take(slot, &list);
+
+  while(!oi_queue_empty(&list)) {
+    oi_queue *q = oi_queue_head(&list);
+    oi_wheel_entry *entry = oi_queue_data(q, oi_wheel_entry, queue);
+    oi_queue_remove(q);
+
+    if(entry->deadline > wheel->base + wheel->current * wheel->tick) {
+      place(wheel, entry);
+      continue;
+    }
+
+    entry->wheel = NULL;
+    wheel->count--;
+    if(entry->on_timeout) { entry->on_timeout(entry); }
+    /* WARNING: the callback may free the entry */
+  }
+}
+
+static void
+on_tick(struct ev_loop *loop, ev_timer *watcher, int revents)
+{
+  oi_wheel *wheel = watcher->data;
+  ev_tstamp now = ev_now(loop);
+
+  while(wheel->count > 0
+     && wheel->base + (wheel->current + 1) * wheel->tick <= now)
+  {
+    wheel->current++;
+    if((wheel->current & LEVEL0_MASK) == 0) {
+      unsigned long i = (wheel->current >> OI_WHEEL_BITS) % OI_WHEEL_LEVEL1;
+      cascade(wheel, &wheel->level1[i]);
+    }
+    expire(wheel, &wheel->level0[wheel->current & LEVEL0_MASK]);
+  }
+
+  if(wheel->count == 0)
+    ev_timer_stop(loop, &wheel->timer);
+}
+
+void
+oi_wheel_init(oi_wheel *wheel, float tick)
+{
+  int i;
+
+  wheel->loop = NULL;
+  wheel->tick = tick > 0. ? tick : 1.;
+  wheel->count = 0;
+  wheel->base = 0.;
+  wheel->current = 0;
+
+  for(i = 0; i < OI_WHEEL_SIZE; i++) { oi_queue_init(&wheel->level0[i]); }
+  for(i = 0; i < OI_WHEEL_LEVEL1; i++) { oi_queue_init(&wheel->level1[i]); }
+
+  ev_init(&wheel->timer, on_tick);
+  wheel->timer.data = wheel;
+}
+
+void
+oi_wheel_attach(oi_wheel *wheel, struct ev_loop *loop)
+{
+  wheel->loop = loop;
+  if(wheel->count > 0) {
+    ev_timer_set(&wheel->timer, wheel->tick, wheel->tick);
+    ev_timer_start(loop, &wheel->timer);
+  }
+}
+
+void
+oi_wheel_detach(oi_wheel *wheel)
+{
+  if(wheel->loop) {
+    ev_timer_stop(wheel->loop, &wheel->timer);
+    wheel->loop = NULL;
+  }
+}
+
+void
+oi_wheel_entry_init(oi_wheel_entry *entry, float timeout)
+{
+  entry->wheel = NULL;
+  entry->timeout = timeout;
+  entry->deadline = 0.;
+  entry->queue.prev = NULL;
+  entry->queue.next = NULL;
+  entry->on_timeout = NULL;
+  entry->data = NULL;
+}
+
+/* Puts the entry on the wheel to expire entry->timeout seconds from now.
+ * Entries with a timeout of 0 are not put on the wheel. */
+void
+oi_wheel_start(oi_wheel *wheel, oi_wheel_entry *entry)
+{
+  assert(wheel->loop != NULL && "attach the wheel first");
+
+  oi_wheel_stop(entry);
+  if(entry->timeout <= 0.)
+    return;
+
+  if(wheel->count++ == 0) {
+    /* empty wheel, start counting ticks from now */
+    wheel->base = ev_now(wheel->loop);
+    wheel->current = 0;
+    ev_timer_set(&wheel->timer, wheel->tick, wheel->tick);
+    ev_timer_start(wheel->loop, &wheel->timer);
+  }
+
+  entry->wheel = wheel;
+  entry->deadline = ev_now(wheel->loop) + entry->timeout;
+  place(wheel, entry);
+}
+
+/* Pushes the deadline back to entry->timeout seconds from now. The entry
+ * stays in its slot until that slot comes round. */
+void
+oi_wheel_again(oi_wheel_entry *entry)
+{
+  if(entry->wheel)
+    entry->deadline = ev_now(entry->wheel->loop) + entry->timeout;
+}
+
+void
+oi_wheel_stop(oi_wheel_entry *entry)
+{
+  oi_wheel *wheel = entry->wheel;
+  if(wheel == NULL)
+    return;
+
+  oi_queue_remove(&entry->queue);
+  entry->wheel = NULL;
+
+  if(--wheel->count == 0 && wheel->loop)
+    ev_timer_stop(wheel->loop, &wheel->timer);
+}
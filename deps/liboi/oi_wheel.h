@@ -0,0 +1,63 @@
+#include <ev.h>
+#include <oi_queue.h>
+
+#ifndef oi_wheel_h
+#define oi_wheel_h
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A coarse timer wheel for idle timeouts. The wheel runs a single ev_timer
+ * which fires once per tick no matter how many entries it holds. Two
+ * levels: the first has one slot per tick, the second one slot per
+ * OI_WHEEL_SIZE ticks. Entries further out than the second level reaches
+ * wait in its last slot and are looked at again when it comes round.
+ */
+#define OI_WHEEL_BITS   8
+#define OI_WHEEL_SIZE   (1 << OI_WHEEL_BITS)
+#define OI_WHEEL_LEVEL1 64
+
+typedef struct oi_wheel oi_wheel;
+typedef struct oi_wheel_entry oi_wheel_entry;
+
+void oi_wheel_init        (oi_wheel *, float tick);
+void oi_wheel_attach      (oi_wheel *, struct ev_loop *loop);
+void oi_wheel_detach      (oi_wheel *);
+
+void oi_wheel_entry_init  (oi_wheel_entry *, float timeout);
+void oi_wheel_start       (oi_wheel *, oi_wheel_entry *);
+void oi_wheel_again       (oi_wheel_entry *);
+void oi_wheel_stop        (oi_wheel_entry *);
+
+struct oi_wheel {
+  /* read only */
+  struct ev_loop *loop;
+  ev_tstamp tick;
+  size_t count; /* entries on the wheel */
+
+  /* private */
+  ev_timer timer;
+  ev_tstamp base; /* time of tick 0 */
+  unsigned long current; /* ticks since base */
+  oi_queue level0[OI_WHEEL_SIZE];
+  oi_queue level1[OI_WHEEL_LEVEL1];
+};
+
+struct oi_wheel_entry {
+  /* read only */
+  oi_wheel *wheel; /* NULL when not on a wheel */
+  ev_tstamp timeout;
+  ev_tstamp deadline;
+
+  /* private */
+  oi_queue queue;
+
+  /* public */
+  void (*on_timeout) (oi_wheel_entry *);
+  void *data;
+};
+
+#ifdef __cplusplus
+}
+#endif
+#endif // oi_wheel_h
@@ -0,0 +1,336 @@
+#include "node.h"
+#include "buffer.h"
+#include "pool.h"
+
+#include <oi_buf.h>
+
+#include <new>
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace v8;
+
+static Persistent<FunctionTemplate> buffer_template;
+
+#define LENGTH_SYMBOL String::NewSymbol("length")
+
+// Buffers of up to 64kb are allocated from free lists, one per power of
+// two size, so that the many short lived buffers of small reads do not
+// each cost a malloc and free. Each list keeps at most about a megabyte.
+#define BUFFER_POOL_MIN_SHIFT 6
+#define BUFFER_POOL_MAX_SHIFT 16
+#define BUFFER_POOL_BYTES (1024*1024)
+
+static FreeList* buffer_pools[BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1];
+
+static FreeList*
+PoolFor (size_t length)
+{
+  if (length > (1 << BUFFER_POOL_MAX_SHIFT))
+    return NULL;
+  int shift = BUFFER_POOL_MIN_SHIFT;
+  while ((size_t)(1 << shift) < length)
+    shift++;
+  return buffer_pools[shift - BUFFER_POOL_MIN_SHIFT];
+}
+
+// Returns storage for the Buffer and its bytes and sets capacity to the
+// number of bytes actually available.
+static void*
+AllocStorage (size_t length, size_t *capacity)
+{
+  FreeList *pool = PoolFor(length);
+  if (pool == NULL) {
+    *capacity = length;
+    return malloc(sizeof(Buffer) + length);
+  }
+  *capacity = pool->block_size() - sizeof(Buffer);
+  return pool->Alloc();
+}
+
+// Adopted blocks come from malloc in any size; only those exactly as big
+// as a pool's blocks may go back to it.
+static void
+FreeStorage (void *storage, size_t capacity)
+{
+  FreeList *pool = PoolFor(capacity);
+  if (pool && capacity == pool->block_size() - sizeof(Buffer))
+    pool->Free(storage);
+  else
+    free(storage);
+}
+
+// V8 counts external memory in an int. Buffers of 2gb and over are
+// reported as INT_MAX, the same amount on the way in and out.
+static int
+ExternalBytes (size_t capacity)
+{
+  return capacity > INT_MAX ? INT_MAX : static_cast<int>(capacity);
+}
+
+Buffer::Buffer (size_t length, size_t capacity)
+{
+  length_ = length;
+  capacity_ = capacity;
+  refs_ = 0;
+  V8::AdjustAmountOfExternalAllocatedMemory(ExternalBytes(capacity_));
+}
+
+Buffer::~Buffer ()
+{
+  V8::AdjustAmountOfExternalAllocatedMemory(-ExternalBytes(capacity_));
+  handle_.Dispose();
+  handle_.Clear();
+}
+
+void
+Buffer::Wrap (Handle<Object> handle)
+{
+  HandleScope scope;
+  handle_ = Persistent<Object>::New(handle);
+  handle_->SetInternalField(0, External::New(this));
+  handle_.MakeWeak(this, Buffer::MakeWeak);
+}
+
+void
+Buffer::MakeWeak (Persistent<Value> _, void *data)
+{
+  Buffer *buffer = static_cast<Buffer*> (data);
+  assert(buffer->refs_ == 0);
+  size_t capacity = buffer->capacity_;
+  buffer->~Buffer();
+  FreeStorage(buffer, capacity);
+}
+
+void
+Buffer::Ref ()
+{
+  if (refs_++ == 0)
+    handle_.ClearWeak();
+}
+
+void
+Buffer::Unref ()
+{
+  assert(refs_ > 0);
+  if (--refs_ == 0)
+    handle_.MakeWeak(this, Buffer::MakeWeak);
+}
+
+void
+Buffer::Truncate (size_t length)
+{
+  if (length < length_)
+    length_ = length;
+}
+
+bool
+Buffer::HasInstance (Handle<Value> val)
+{
+  if (!val->IsObject())
+    return false;
+  return buffer_template->HasInstance(val);
+}
+
+Buffer*
+Buffer::Unwrap (Handle<Object> handle)
+{
+  HandleScope scope;
+  Handle<External> field = Handle<External>::Cast(handle->GetInternalField(0));
+  Buffer* buffer = static_cast<Buffer*>(field->Value());
+  return buffer;
+}
+
+Buffer*
+Buffer::FromData (char *data)
+{
+  return reinterpret_cast<Buffer*>(data) - 1;
+}
+
+Buffer*
+Buffer::New (size_t length)
+{
+  HandleScope scope;
+
+  const int argc = 1;
+  Handle<Value> argv[argc] = { Number::New(length) };
+  Local<Object> handle = buffer_template->GetFunction()->NewInstance(argc, argv);
+  if (handle.IsEmpty())
+    return NULL;
+
+  return Buffer::Unwrap(handle);
+}
+
+Buffer*
+Buffer::New (const char *data, size_t length)
+{
+  Buffer *buffer = Buffer::New(length);
+  if (buffer)
+    memcpy(buffer->data(), data, length);
+  return buffer;
+}
+
+Buffer*
+Buffer::Adopt (char *data, size_t length)
+{
+  HandleScope scope;
+
+  Buffer *buffer = new (data - sizeof(Buffer)) Buffer(length, length);
+
+  const int argc = 1;
+  Handle<Value> argv[argc] = { External::New(buffer) };
+  Local<Object> handle = buffer_template->GetFunction()->NewInstance(argc, argv);
+  if (handle.IsEmpty()) {
+    buffer->~Buffer();
+    free(buffer);
+    return NULL;
+  }
+
+  return buffer;
+}
+
+Handle<Value>
+Buffer::Constructor (const Arguments& args)
+{
+  if (!args.IsConstructCall())
+    return ThrowException(String::New("Buffer must be called with new"));
+
+  // From Adopt(), with the bytes already in place.
+  if (args.Length() == 1 && args[0]->IsExternal()) {
+    Handle<External> external = Handle<External>::Cast(args[0]);
+    static_cast<Buffer*>(external->Value())->Wrap(args.This());
+    return args.This();
+  }
+
+  if (args.Length() < 1 || !args[0]->IsNumber())
+    return ThrowException(String::New("Buffer requires a length"));
+
+  HandleScope scope;
+
+  int64_t length = args[0]->IntegerValue();
+  if (length < 0 || static_cast<uint64_t>(length) > (size_t)-1 - sizeof(Buffer))
+    return ThrowException(String::New("Bad buffer length"));
+
+  size_t capacity;
+  void *storage = AllocStorage(length, &capacity);
+  if (storage == NULL)
+    return ThrowException(String::New("Out of memory"));
+
+  Buffer *buffer = new (storage) Buffer(length, capacity);
+  buffer->Wrap(args.This());
+
+  return args.This();
+}
+
+void
+Buffer::ReleaseOiBuf (oi_buf *buf)
+{
+  Buffer *buffer = static_cast<Buffer*>(buf->data);
+  free(buf);
+  buffer->Unref();
+}
+
+oi_buf*
+Buffer::NewOiBuf ()
+{
+  oi_buf *buf = static_cast<oi_buf*>(malloc(sizeof(oi_buf)));
+  if (buf == NULL)
+    return NULL;
+  buf->base = data();
+  buf->len = length_;
+  buf->release = Buffer::ReleaseOiBuf;
+  buf->data = this;
+  Ref();
+  return buf;
+}
+
+Handle<Value>
+Buffer::GetLength (Local<String> property, const AccessorInfo& info)
+{
+  Buffer *buffer = Buffer::Unwrap(info.Holder());
+  // Integer::New would wrap lengths of 2^31 and more.
+  return Number::New(buffer->length_);
+}
+
+Handle<Value>
+Buffer::GetIndex (uint32_t index, const AccessorInfo& info)
+{
+  Buffer *buffer = Buffer::Unwrap(info.Holder());
+  if (index >= buffer->length_)
+    return Handle<Value>(); // not intercepted
+
+  unsigned char val = static_cast<unsigned char>(buffer->data()[index]);
+  return Integer::New(val);
+}
+
+Handle<Value>
+Buffer::SetIndex (uint32_t index, Local<Value> value, const AccessorInfo& info)
+{
+  Buffer *buffer = Buffer::Unwrap(info.Holder());
+  if (index >= buffer->length_)
+    return Handle<Value>(); // not intercepted
+
+  buffer->data()[index] = static_cast<char>(value->Int32Value());
+  return value;
+}
+
+// Same as Array.prototype.encodeUtf8 in main.js: each byte becomes one
+// character. Kept so code written for the old raw arrays still works.
+Handle<Value>
+Buffer::EncodeUtf8 (const Arguments& args)
+{
+  HandleScope scope;
+  Buffer *buffer = Buffer::Unwrap(args.Holder());
+
+  size_t length = buffer->length_;
+  uint16_t *chars = static_cast<uint16_t*>(malloc(length * sizeof(uint16_t)));
+  if (chars == NULL && length > 0)
+    return ThrowException(String::New("Out of memory"));
+
+  const unsigned char *bytes = reinterpret_cast<unsigned char*>(buffer->data());
+  for (size_t i = 0; i < length; i++)
+    chars[i] = bytes[i];
+
+  Local<String> string = String::New(chars, length);
+  free(chars);
+
+  return scope.Close(string);
+}
+
+// Decodes the bytes as UTF-8.
+Handle<Value>
+Buffer::ToString (const Arguments& args)
+{
+  HandleScope scope;
+  Buffer *buffer = Buffer::Unwrap(args.Holder());
+  Local<String> string = String::New(buffer->data(), buffer->length_);
+  return scope.Close(string);
+}
+
+void
+NodeInit_buffer (Handle<Object> target)
+{
+  HandleScope scope;
+
+  for (int shift = BUFFER_POOL_MIN_SHIFT; shift <= BUFFER_POOL_MAX_SHIFT; shift++) {
+    size_t size = 1 << shift;
+    buffer_pools[shift - BUFFER_POOL_MIN_SHIFT] =
+      new FreeList(sizeof(Buffer) + size, BUFFER_POOL_BYTES / size);
+  }
+
+  Local<FunctionTemplate> t = FunctionTemplate::New(Buffer::Constructor);
+  buffer_template = Persistent<FunctionTemplate>::New(t);
+  buffer_template->SetClassName(String::NewSymbol("Buffer"));
+
+  Local<ObjectTemplate> instance_template = buffer_template->InstanceTemplate();
+  instance_template->SetInternalFieldCount(1);
+  instance_template->SetAccessor(LENGTH_SYMBOL, Buffer::GetLength);
+  instance_template->SetIndexedPropertyHandler(Buffer::GetIndex, Buffer::SetIndex);
+
+  NODE_SET_METHOD(instance_template, "encodeUtf8", Buffer::EncodeUtf8);
+  NODE_SET_METHOD(instance_template, "toString", Buffer::ToString);
+
+  target->Set(String::NewSymbol("Buffer"), buffer_template->GetFunction());
+}
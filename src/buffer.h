@@ -0,0 +1,78 @@
+#ifndef node_buffer_h
+#define node_buffer_h
+
+#include <v8.h>
+#include <oi_buf.h>
+#include <stddef.h>
+
+/* A fixed length chunk of bytes which lives outside of the V8 heap. In
+ * javascript it is called "Buffer" and can be indexed like an array:
+ *
+ *   var b = new Buffer(10);
+ *   b[0] = 42;
+ *
+ * The bytes and the C++ object are allocated together in one block, taken
+ * from a pool when the buffer is small. The memory is released when the
+ * javascript object has been collected and no native users (pending
+ * socket writes, eio requests) hold a reference.
+ */
+class Buffer {
+public:
+  static bool HasInstance (v8::Handle<v8::Value> val);
+  static Buffer* Unwrap (v8::Handle<v8::Object> handle);
+
+  /* Both return a buffer with its javascript object created. */
+  static Buffer* New (size_t length);
+  static Buffer* New (const char *data, size_t length);
+
+  /* Takes over data instead of copying it. data must point sizeof(Buffer)
+   * bytes into a block from malloc; the buffer is built in front of it. */
+  static Buffer* Adopt (char *data, size_t length);
+
+  /* Recovers the buffer from a pointer previously returned by data(). */
+  static Buffer* FromData (char *data);
+
+  char* data () { return reinterpret_cast<char*>(this + 1); }
+  size_t length () const { return length_; }
+  v8::Local<v8::Object> handle () { return v8::Local<v8::Object>::New(handle_); }
+
+  /* Only shrinks. Used when a read returns fewer bytes than requested. */
+  void Truncate (size_t length);
+
+  /* While ref'd the javascript object will not be collected. */
+  void Ref ();
+  void Unref ();
+
+  /* Returns an oi_buf which points into the buffer's memory. The buffer
+   * is ref'd until oi releases the oi_buf. */
+  oi_buf* NewOiBuf ();
+
+private:
+  Buffer (size_t length, size_t capacity);
+  ~Buffer ();
+
+  static v8::Handle<v8::Value> Constructor (const v8::Arguments& args);
+  static v8::Handle<v8::Value> EncodeUtf8 (const v8::Arguments& args);
+  static v8::Handle<v8::Value> ToString (const v8::Arguments& args);
+  static v8::Handle<v8::Value> GetLength (v8::Local<v8::String> property,
+                                          const v8::AccessorInfo& info);
+  static v8::Handle<v8::Value> GetIndex (uint32_t index,
+                                         const v8::AccessorInfo& info);
+  static v8::Handle<v8::Value> SetIndex (uint32_t index,
+                                         v8::Local<v8::Value> value,
+                                         const v8::AccessorInfo& info);
+  static void ReleaseOiBuf (oi_buf *buf);
+  static void MakeWeak (v8::Persistent<v8::Value> _, void *data);
+  void Wrap (v8::Handle<v8::Object> handle);
+
+  size_t length_;
+  size_t capacity_;
+  int refs_;
+  v8::Persistent<v8::Object> handle_;
+
+  friend void NodeInit_buffer (v8::Handle<v8::Object> target);
+};
+
+void NodeInit_buffer (v8::Handle<v8::Object> target);
+
+#endif
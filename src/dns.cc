@@ -0,0 +1,214 @@
+#include "node.h"
+#include "dns.h"
+
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+// Seconds a successful lookup is reused. getaddrinfo() does not tell us
+// the record's real TTL.
+#define DNS_CACHE_TTL 60.0
+
+// The cache holds about this many entries at most. See Prune().
+#define DNS_CACHE_MAX 1024
+
+struct Waiter {
+  node_resolve_cb cb;
+  void *data;
+};
+
+struct CacheEntry {
+  string key;
+  string host;
+  string port;
+  bool has_host;
+  bool has_port;
+  struct addrinfo hints;
+
+  struct addrinfo *address; // NULL while the first lookup is in flight
+  ev_tstamp expires;
+  bool resolving;
+  bool notifying; // its waiters are being called back
+  list<Waiter> waiters;
+};
+
+typedef map<string, CacheEntry*> Cache;
+static Cache cache;
+
+static string
+MakeKey (const char *host, const char *port, const struct addrinfo *hints)
+{
+  char prefix[64];
+  snprintf( prefix
+          , sizeof prefix
+          , "%d/%d/%d/%c%c"
+          , hints->ai_family
+          , hints->ai_socktype
+          , hints->ai_flags
+          , host ? 'h' : '-'
+          , port ? 'p' : '-'
+          );
+  string key(prefix);
+  if (host) key.append(host);
+  key.push_back('\0');
+  if (port) key.append(port);
+  return key;
+}
+
+static void
+Evict (Cache::iterator it)
+{
+  CacheEntry *entry = it->second;
+  if (entry->address) freeaddrinfo(entry->address);
+  delete entry;
+  cache.erase(it);
+}
+
+static bool
+ExpiresSooner (Cache::iterator a, Cache::iterator b)
+{
+  return a->second->expires < b->second->expires;
+}
+
+// Called when the cache is full. Expired entries go first. If that is not
+// enough, because a client keeps asking for new names, the quarter of the
+// entries which would expire soonest go too. Entries with a lookup in
+// flight, or whose waiters are being called back, always stay.
+static void
+Prune (void)
+{
+  ev_tstamp now = ev_now(node_loop());
+  vector<Cache::iterator> fresh;
+
+  Cache::iterator it = cache.begin();
+  while (it != cache.end()) {
+    CacheEntry *entry = it->second;
+    if (entry->resolving || entry->notifying) {
+      it++;
+    } else if (entry->expires <= now) {
+      Evict(it++);
+    } else {
+      fresh.push_back(it++);
+    }
+  }
+
+  if (cache.size() < DNS_CACHE_MAX) return;
+
+  size_t n = min(fresh.size(), static_cast<size_t>(DNS_CACHE_MAX / 4));
+  nth_element(fresh.begin(), fresh.begin() + n, fresh.end(), ExpiresSooner);
+  for (size_t i = 0; i < n; i++)
+    Evict(fresh[i]);
+}
+
+/* This function is executed in the thread pool. It only reads the entry's
+ * name, which does not change while a lookup is in flight. */
+static int
+Resolve (eio_req *req)
+{
+  CacheEntry *entry = static_cast<CacheEntry*>(req->data);
+  struct addrinfo *address = NULL;
+
+  req->result = getaddrinfo( entry->has_host ? entry->host.c_str() : NULL
+                           , entry->has_port ? entry->port.c_str() : NULL
+                           , &entry->hints
+                           , &address
+                           );
+  req->ptr2 = address;
+  return 0;
+}
+
+static int
+AfterResolve (eio_req *req)
+{
+  CacheEntry *entry = static_cast<CacheEntry*>(req->data);
+  struct addrinfo *address = static_cast<struct addrinfo*>(req->ptr2);
+  int status = req->result;
+
+  if (entry->address) freeaddrinfo(entry->address);
+  entry->address = status == 0 ? address : NULL;
+  entry->expires = ev_now(node_loop()) + DNS_CACHE_TTL;
+  entry->resolving = false;
+
+  // Failures are not cached. The entry leaves the cache before the
+  // callbacks run since they may look up this same name again.
+  if (status != 0) cache.erase(entry->key);
+
+  list<Waiter> waiters;
+  waiters.swap(entry->waiters);
+
+  // A callback can reach javascript, which may look up other names and
+  // prune the cache; notifying keeps this entry out of that.
+  entry->notifying = true;
+  for (list<Waiter>::iterator it = waiters.begin(); it != waiters.end(); it++)
+    it->cb(status, entry->address, it->data);
+  entry->notifying = false;
+
+  if (status != 0) delete entry;
+
+  return 0;
+}
+
+void
+node_resolve ( const char *host
+             , const char *port
+             , const struct addrinfo *hints
+             , node_resolve_cb cb
+             , void *data
+             )
+{
+  // Numeric hosts never need the resolver.
+  struct addrinfo numeric_hints = *hints;
+  numeric_hints.ai_flags |= AI_NUMERICHOST;
+  struct addrinfo *address = NULL;
+  int r = getaddrinfo(host, port, &numeric_hints, &address);
+  if (r != EAI_NONAME) {
+    cb(r, r == 0 ? address : NULL, data);
+    if (address) freeaddrinfo(address);
+    return;
+  }
+
+  string key = MakeKey(host, port, hints);
+  CacheEntry *entry;
+
+  Cache::iterator it = cache.find(key);
+  if (it != cache.end()) {
+    entry = it->second;
+    if (!entry->resolving && entry->expires > ev_now(node_loop())) {
+      cb(0, entry->address, data);
+      return;
+    }
+  } else {
+    if (cache.size() >= DNS_CACHE_MAX) Prune();
+
+    entry = new CacheEntry;
+    entry->key = key;
+    entry->has_host = host != NULL;
+    entry->has_port = port != NULL;
+    if (host) entry->host = host;
+    if (port) entry->port = port;
+    entry->hints = *hints;
+    entry->address = NULL;
+    entry->expires = 0.;
+    entry->resolving = false;
+    entry->notifying = false;
+    cache[key] = entry;
+  }
+
+  Waiter waiter = { cb, data };
+  entry->waiters.push_back(waiter);
+
+  if (!entry->resolving) {
+    entry->resolving = true;
+    node_eio_warmup();
+    eio_custom(Resolve, EIO_PRI_DEFAULT, AfterResolve, entry);
+  }
+}
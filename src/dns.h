@@ -0,0 +1,27 @@
+#ifndef node_dns_h
+#define node_dns_h
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+/* status is 0 or a getaddrinfo() error code. The address belongs to the
+ * resolver and is only valid for the duration of the callback. */
+typedef void (*node_resolve_cb) (int status, struct addrinfo *address, void *data);
+
+/* Resolves host and port with getaddrinfo() in the thread pool. Answers
+ * are cached for a short while, keyed by host, port and the family,
+ * socktype and flags of hints. A lookup for a name which is already in
+ * flight waits for that lookup rather than starting another one.
+ *
+ * Numeric addresses (and a NULL host) and cached names are answered
+ * before node_resolve() returns.
+ */
+void node_resolve ( const char *host
+                  , const char *port
+                  , const struct addrinfo *hints
+                  , node_resolve_cb cb
+                  , void *data
+                  );
+
+#endif // node_dns_h
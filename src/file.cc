@@ -1,8 +1,15 @@
 #include "node.h"
+#include "file.h"
+#include "buffer.h"
+#include "file_uring.h"
+#include "file_stream.h"
 #include <string.h>
 
+#include <oi_queue.h>
+
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -11,22 +18,84 @@
 using namespace v8;
 
 #define FD_SYMBOL v8::String::NewSymbol("fd")
-#define ACTION_QUEUE_SYMBOL v8::String::NewSymbol("_actionQueue")
 
 // This is the file system object which contains methods
 // for accessing the file system (like rename, mkdir, etC). 
 // In javascript it is called "File".
 static Persistent<Object> fs;
 
+class ActionQueue;
+
+/* A file operation with its arguments already converted from javascript.
+ * start() submits it, to io_uring if the kernel has it or else to eio,
+ * once it reaches the head of its queue and returns 0, or an errno value
+ * if it could not be started. Either way finish() is called with the
+ * system call's result and errno when it completes. */
+struct Action {
+  Action (ActionQueue *queue_, Handle<Value> callback_);
+  ~Action ();
+
+  ActionQueue *queue;
+  int (*start) (Action *action);
+  void (*finish) (Action *action, ssize_t result, int errorno);
+  Persistent<Function> callback;
+  oi_queue link;
+
+  char *path;
+  char *new_path;
+  int flags;
+  char *buf;
+  Buffer *buffer; // if set, buf points into it
+  size_t length;
+  off_t pos;
+  struct stat st; // filled in by stat
+};
+
+/* Operations on one file are run one at a time, in the order they were
+ * made. Each waits here until the one before it has completed and its
+ * callback is called straight from the eio completion. The file's object
+ * is not collected while any are pending.
+ */
+class ActionQueue {
+public:
+  ActionQueue ();
+
+  void Push (Handle<Object> handle, Action *action);
+  Local<Object> handle () { return Local<Object>::New(handle_); }
+
+  static void Done (Action *action, int argc, Handle<Value> argv[]);
+
+private:
+  void Next ();
+  void Finish (Action *action, int argc, Handle<Value> argv[]);
+
+  oi_queue pending_; // newest at the head
+  Action *current_;
+  Persistent<Object> handle_; // only set while actions are pending
+};
+
+static ActionQueue fs_queue;
+
 class FileSystem {
 public:
   static Handle<Value> Rename (const Arguments& args);
-  static int AfterRename (eio_req *req);
+  static int StartRename (Action *action);
+  static void AfterRename (Action *action, ssize_t result, int errorno);
+
+  static Handle<Value> Unlink (const Arguments& args);
+  static int StartUnlink (Action *action);
+  static void AfterUnlink (Action *action, ssize_t result, int errorno);
 
   static Handle<Value> Stat (const Arguments& args);
-  static int AfterStat (eio_req *req);
+  static int StartStat (Action *action);
+  static void AfterStat (Action *action, ssize_t result, int errorno);
 
   static Handle<Value> StrError (const Arguments& args);
+  static Handle<Value> UringCompletions (const Arguments& args);
+
+  static Handle<Value> ReadFile (const Arguments& args);
+  static int ExecuteReadFile (eio_req *req);
+  static int AfterReadFile (eio_req *req);
 };
 
 class File {
@@ -37,64 +106,150 @@ public:
   static Handle<Value> New (const Arguments& args);
 
   static Handle<Value> Open (const Arguments& args);
-  static int AfterOpen (eio_req *req);
+  static int StartOpen (Action *action);
+  static void AfterOpen (Action *action, ssize_t result, int errorno);
 
   static Handle<Value> Close (const Arguments& args); 
-  static int AfterClose (eio_req *req);
+  static int StartClose (Action *action);
+  static void AfterClose (Action *action, ssize_t result, int errorno);
 
   static Handle<Value> Write (const Arguments& args);
-  static int AfterWrite (eio_req *req);
+  static int StartWrite (Action *action);
+  static void AfterWrite (Action *action, ssize_t result, int errorno);
 
   static Handle<Value> Read (const Arguments& args);
-  static int AfterRead (eio_req *req);
+  static int StartRead (Action *action);
+  static void AfterRead (Action *action, ssize_t result, int errorno);
+
+  static Handle<Value> ReadV (const Arguments& args);
+  static Handle<Value> WriteV (const Arguments& args);
 
 private:
   static File* Unwrap (Handle<Object> handle);
-  bool HasUtf8Encoding (void);
-  int GetFD (void);
+  static int GetFD (Handle<Object> handle);
   static void MakeWeak (Persistent<Value> _, void *data);
   Persistent<Object> handle_;
+  ActionQueue actions_;
 };
 
-static void
-CallTopCallback (Handle<Object> handle, const int argc, Handle<Value> argv[])
+Action::Action (ActionQueue *queue_, Handle<Value> callback_)
 {
-  HandleScope scope;
+  queue = queue_;
+  start = NULL;
+  finish = NULL;
+  if (callback_->IsFunction())
+    callback = Persistent<Function>::New(Handle<Function>::Cast(callback_));
+  path = NULL;
+  new_path = NULL;
+  flags = 0;
+  buf = NULL;
+  buffer = NULL;
+  length = 0;
+  pos = -1;
+}
 
-  Local<Value> queue_value = handle->Get(ACTION_QUEUE_SYMBOL);
-  assert(queue_value->IsArray());
-
-  Local<Array> queue = Local<Array>::Cast(queue_value);
-  Local<Value> top_value = queue->Get(Integer::New(0));
-  if (top_value->IsObject()) {
-    Local<Object> top = top_value->ToObject();
-    Local<Value> callback_value = top->Get(String::NewSymbol("callback"));
-    if (callback_value->IsFunction()) {
-      Handle<Function> callback = Handle<Function>::Cast(callback_value);
-
-      TryCatch try_catch;
-      callback->Call(handle, argc, argv);
-      if(try_catch.HasCaught()) {
-        node_fatal_exception(try_catch);
-        return;
-      }
+Action::~Action ()
+{
+  free(path);
+  free(new_path);
+  if (buffer)
+    buffer->Unref();
+  else
+    free(buf);
+  callback.Dispose();
+}
+
+ActionQueue::ActionQueue ()
+{
+  oi_queue_init(&pending_);
+  current_ = NULL;
+}
+
+void
+ActionQueue::Push (Handle<Object> handle, Action *action)
+{
+  if (handle_.IsEmpty())
+    handle_ = Persistent<Object>::New(handle);
+  oi_queue_insert_head(&pending_, &action->link);
+  if (current_ == NULL)
+    Next();
+}
+
+void
+ActionQueue::Next ()
+{
+  while (current_ == NULL && !oi_queue_empty(&pending_)) {
+    oi_queue *q = oi_queue_last(&pending_);
+    oi_queue_remove(q);
+    current_ = oi_queue_data(q, Action, link);
+
+    // Those which cannot start are answered right here. A loop, not
+    // Done(), so that a long queue on a closed file does not recurse.
+    int errorno = current_->start(current_);
+    if (errorno) {
+      HandleScope scope;
+      const int argc = 1;
+      Local<Value> argv[argc];
+      argv[0] = Integer::New(errorno);
+      Finish(current_, argc, argv);
     }
   }
 
-  // poll_actions
-  Local<Value> poll_actions_value = handle->Get(String::NewSymbol("_pollActions"));
-  assert(poll_actions_value->IsFunction());  
-  Handle<Function> poll_actions = Handle<Function>::Cast(poll_actions_value);
+  if (current_ == NULL && !handle_.IsEmpty()) {
+    handle_.Dispose();
+    handle_.Clear();
+  }
+}
 
-  poll_actions->Call(handle, 0, NULL);
+void
+ActionQueue::Finish (Action *action, int argc, Handle<Value> argv[])
+{
+  assert(current_ == action);
+  HandleScope scope;
+
+  // Actions queued from the callback go after the ones already waiting,
+  // so the next one only starts once the callback has returned.
+  if (!action->callback.IsEmpty()) {
+    TryCatch try_catch;
+    action->callback->Call(handle(), argc, argv);
+    if (try_catch.HasCaught())
+      node_fatal_exception(try_catch);
+  }
+
+  delete action;
+  current_ = NULL;
+}
+
+void
+ActionQueue::Done (Action *action, int argc, Handle<Value> argv[])
+{
+  ActionQueue *queue = action->queue;
+  queue->Finish(action, argc, argv);
+  queue->Next();
 }
 
+static int
+AfterEio (eio_req *req)
+{
+  Action *action = static_cast<Action*>(req->data);
+  if (req->type == EIO_STAT && req->result == 0)
+    action->st = *static_cast<struct stat*>(req->ptr2);
+  action->finish(action, req->result, req->errorno);
+  return 0;
+}
+
+// io_uring gives -errno instead of setting errno.
 static void
-InitActionQueue (Handle<Object> handle)
+AfterUring (void *data, ssize_t result)
 {
-  handle->Set(ACTION_QUEUE_SYMBOL, Array::New());
+  Action *action = static_cast<Action*>(data);
+  if (result < 0)
+    action->finish(action, -1, -result);
+  else
+    action->finish(action, result, 0);
 }
 
+// File.rename(path, new_path, callback)
 Handle<Value>
 FileSystem::Rename (const Arguments& args)
 {
@@ -106,23 +261,75 @@ FileSystem::Rename (const Arguments& args)
   String::Utf8Value path(args[0]->ToString());
   String::Utf8Value new_path(args[1]->ToString());
 
-  node_eio_warmup();
-  eio_req *req = eio_rename(*path, *new_path, EIO_PRI_DEFAULT, AfterRename, NULL);
+  Action *action = new Action(&fs_queue, args[2]);
+  action->start = FileSystem::StartRename;
+  action->finish = FileSystem::AfterRename;
+  action->path = strdup(*path);
+  action->new_path = strdup(*new_path);
+  fs_queue.Push(fs, action);
 
   return Undefined();
 }
 
 int
-FileSystem::AfterRename (eio_req *req)
+FileSystem::StartRename (Action *action)
+{
+  if (node_uring_rename(action->path, action->new_path, AfterUring, action) == 0)
+    return 0;
+  node_eio_warmup();
+  eio_rename(action->path, action->new_path, EIO_PRI_DEFAULT, AfterEio, action);
+  return 0;
+}
+
+void
+FileSystem::AfterRename (Action *action, ssize_t result, int errorno)
 {
   HandleScope scope;
   const int argc = 1;
   Local<Value> argv[argc];
-  argv[0] = Integer::New(req->errorno);
-  CallTopCallback(fs, argc, argv);
+  argv[0] = Integer::New(errorno);
+  ActionQueue::Done(action, argc, argv);
+}
+
+// File.unlink(path, callback)
+Handle<Value>
+FileSystem::Unlink (const Arguments& args)
+{
+  if (args.Length() < 1)
+    return Undefined();
+
+  HandleScope scope;
+
+  String::Utf8Value path(args[0]->ToString());
+
+  Action *action = new Action(&fs_queue, args[1]);
+  action->start = FileSystem::StartUnlink;
+  action->finish = FileSystem::AfterUnlink;
+  action->path = strdup(*path);
+  fs_queue.Push(fs, action);
+
+  return Undefined();
+}
+
+int
+FileSystem::StartUnlink (Action *action)
+{
+  node_eio_warmup();
+  eio_unlink(action->path, EIO_PRI_DEFAULT, AfterEio, action);
   return 0;
 }
 
+void
+FileSystem::AfterUnlink (Action *action, ssize_t result, int errorno)
+{
+  HandleScope scope;
+  const int argc = 1;
+  Local<Value> argv[argc];
+  argv[0] = Integer::New(errorno);
+  ActionQueue::Done(action, argc, argv);
+}
+
+// File.stat(path, callback)
 Handle<Value>
 FileSystem::Stat (const Arguments& args)
 {
@@ -133,26 +340,39 @@ FileSystem::Stat (const Arguments& args)
 
   String::Utf8Value path(args[0]->ToString());
 
-  node_eio_warmup();
-  eio_req *req = eio_stat(*path, EIO_PRI_DEFAULT, AfterStat, NULL);
+  Action *action = new Action(&fs_queue, args[1]);
+  action->start = FileSystem::StartStat;
+  action->finish = FileSystem::AfterStat;
+  action->path = strdup(*path);
+  fs_queue.Push(fs, action);
 
   return Undefined();
 }
 
 int
-FileSystem::AfterStat (eio_req *req)
+FileSystem::StartStat (Action *action)
+{
+  if (node_uring_stat(action->path, &action->st, AfterUring, action) == 0)
+    return 0;
+  node_eio_warmup();
+  eio_stat(action->path, EIO_PRI_DEFAULT, AfterEio, action);
+  return 0;
+}
+
+void
+FileSystem::AfterStat (Action *action, ssize_t result, int errorno)
 {
   HandleScope scope;
 
   const int argc = 2;
   Local<Value> argv[argc];
-  argv[0] = Integer::New(req->errorno);
+  argv[0] = Integer::New(errorno);
 
   Local<Object> stats = Object::New();
   argv[1] = stats;
 
-  if (req->result == 0) {
-    struct stat *s = static_cast<struct stat*>(req->ptr2);
+  if (result == 0) {
+    struct stat *s = &action->st;
 
     /* ID of device containing file */
     stats->Set(NODE_SYMBOL("dev"), Integer::New(s->st_dev));
@@ -182,9 +402,7 @@ FileSystem::AfterStat (eio_req *req)
     stats->Set(NODE_SYMBOL("ctime"), Date::New(1000*static_cast<double>(s->st_ctime)));
   }
 
-  CallTopCallback(fs, argc, argv);
-    
-  return 0;
+  ActionQueue::Done(action, argc, argv);
 }
 
 Handle<Value>
@@ -202,6 +420,200 @@ FileSystem::StrError (const Arguments& args)
   return scope.Close(message);
 }
 
+Handle<Value>
+FileSystem::UringCompletions (const Arguments& args)
+{
+  HandleScope scope;
+  Local<Number> count = Number::New(node_uring_completions());
+  return scope.Close(count);
+}
+
+/* Owns the malloc'd contents of a file which were read for a string. */
+class ExternalContents : public String::ExternalAsciiStringResource {
+public:
+  ExternalContents (char *data, size_t length) : data_(data), length_(length)
+  {
+    V8::AdjustAmountOfExternalAllocatedMemory(length_);
+  }
+  ~ExternalContents ()
+  {
+    V8::AdjustAmountOfExternalAllocatedMemory(-static_cast<int>(length_));
+    free(data_);
+  }
+  const char* data () const { return data_; }
+  size_t length () const { return length_; }
+private:
+  char *data_;
+  size_t length_;
+};
+
+// Files smaller than this are copied into an ordinary string.
+#define EXTERNAL_CONTENTS_THRESHOLD 1024
+
+struct ReadFileRequest {
+  char *path;
+  bool raw;
+  Persistent<Function> callback;
+
+  // filled in by the thread pool. eio overwrites req->errorno with
+  // whatever errno is when the custom request returns.
+  int errorno;
+  char *data;
+  size_t length;
+};
+
+// File.readFile(path, [encoding], callback)
+//
+// callback(status, contents) gets the whole file as a string, decoded as
+// utf8, or as a Buffer if encoding is "raw". Unlike other File.* methods
+// it does not wait for queued operations.
+Handle<Value>
+FileSystem::ReadFile (const Arguments& args)
+{
+  if (args.Length() < 2 || !args[args.Length() - 1]->IsFunction())
+    return ThrowException(String::New("readFile() needs a path and a callback"));
+
+  HandleScope scope;
+
+  String::Utf8Value path(args[0]->ToString());
+
+  ReadFileRequest *rf = new ReadFileRequest;
+  rf->path = strdup(*path);
+  rf->raw = false;
+  if (args.Length() > 2 && args[1]->IsString()) {
+    String::AsciiValue encoding(args[1]->ToString());
+    rf->raw = strcasecmp(*encoding, "raw") == 0;
+  }
+  Local<Function> callback = Local<Function>::Cast(args[args.Length() - 1]);
+  rf->callback = Persistent<Function>::New(callback);
+  rf->data = NULL;
+  rf->length = 0;
+
+  node_eio_warmup();
+  eio_custom(FileSystem::ExecuteReadFile, EIO_PRI_DEFAULT, FileSystem::AfterReadFile, rf);
+
+  return Undefined();
+}
+
+/* The buffer is sized by fstat() so that normally one read() fills it,
+ * but files which grow, or report a size of zero like those in /proc, are
+ * read until EOF. */
+int
+node_read_file (const char *path, struct stat *st, char **data_out, size_t *length_out,
+                size_t headroom)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return errno;
+
+  if (fstat(fd, st) < 0) {
+    int errorno = errno;
+    close(fd);
+    return errorno;
+  }
+
+  // One byte over so that EOF is seen without growing the buffer.
+  size_t capacity = st->st_size > 0 ? st->st_size + 1 : 4096;
+  char *block = static_cast<char*>(malloc(headroom + capacity));
+  size_t length = 0;
+
+  for (;;) {
+    if (block == NULL) {
+      close(fd);
+      return ENOMEM;
+    }
+
+    ssize_t r = read(fd, block + headroom + length, capacity - length);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      int errorno = errno;
+      free(block);
+      close(fd);
+      return errorno;
+    }
+    if (r == 0) break;
+
+    length += r;
+    if (length == capacity) {
+      capacity *= 2;
+      char *grown = static_cast<char*>(realloc(block, headroom + capacity));
+      if (grown == NULL) free(block);
+      block = grown;
+    }
+  }
+  close(fd);
+
+  *data_out = block + headroom;
+  *length_out = length;
+  return 0;
+}
+
+Local<String>
+node_contents_string (char *data, size_t length)
+{
+  HandleScope scope;
+
+  const unsigned char *p = reinterpret_cast<const unsigned char*>(data);
+  bool ascii = true;
+  for (size_t i = 0; i < length && ascii; i++)
+    if (p[i] & 0x80) ascii = false;
+
+  Local<String> string;
+  if (ascii && length >= EXTERNAL_CONTENTS_THRESHOLD) {
+    // The string takes over the memory; nothing is copied.
+    string = String::NewExternal(new ExternalContents(data, length));
+  } else {
+    string = String::New(data, length);
+    free(data);
+  }
+  return scope.Close(string);
+}
+
+/* This function is executed in the thread pool. */
+int
+FileSystem::ExecuteReadFile (eio_req *req)
+{
+  ReadFileRequest *rf = static_cast<ReadFileRequest*>(req->data);
+  struct stat st;
+  // Raw contents are read in behind room for the Buffer which adopts them.
+  size_t headroom = rf->raw ? sizeof(Buffer) : 0;
+  rf->errorno = node_read_file(rf->path, &st, &rf->data, &rf->length, headroom);
+  return 0;
+}
+
+int
+FileSystem::AfterReadFile (eio_req *req)
+{
+  ReadFileRequest *rf = static_cast<ReadFileRequest*>(req->data);
+  HandleScope scope;
+
+  const int argc = 2;
+  Local<Value> argv[argc];
+  argv[0] = Integer::New(rf->errorno);
+  argv[1] = Local<Value>::New(Null());
+
+  if (rf->errorno == 0) {
+    if (rf->raw) {
+      Buffer *buffer = Buffer::Adopt(rf->data, rf->length);
+      if (buffer) argv[1] = buffer->handle();
+    } else {
+      argv[1] = node_contents_string(rf->data, rf->length);
+    }
+  }
+
+  Local<Function> callback = Local<Function>::New(rf->callback);
+  rf->callback.Dispose();
+  free(rf->path);
+  delete rf;
+
+  TryCatch try_catch;
+  callback->Call(fs, argc, argv);
+  if (try_catch.HasCaught())
+    node_fatal_exception(try_catch);
+
+  return 0;
+}
+
 ///////////////////// FILE ///////////////////// 
 
 File::File (Handle<Object> handle)
@@ -209,8 +621,6 @@ File::File (Handle<Object> handle)
   HandleScope scope;
   handle_ = Persistent<Object>::New(handle);
 
-  InitActionQueue(handle);
-
   Handle<External> external = External::New(this);
   handle_->SetInternalField(0, external);
   handle_.MakeWeak(this, File::MakeWeak);
@@ -233,20 +643,17 @@ File::Unwrap (Handle<Object> handle)
   return file;
 }
 
-bool
-File::HasUtf8Encoding (void)
-{
-  return false;
-}
-
+// Returns -1 if the file is not open.
 int
-File::GetFD (void)
+File::GetFD (Handle<Object> handle)
 {
-  Handle<Value> fd_value = handle_->Get(FD_SYMBOL);
-  int fd = fd_value->IntegerValue();
+  HandleScope scope;
+  Local<Value> fd_value = handle->Get(FD_SYMBOL);
+  if (!fd_value->IsNumber())
+    return -1;
+  return fd_value->Int32Value();
 }
 
-
 void
 File::MakeWeak (Persistent<Value> _, void *data)
 {
@@ -254,6 +661,7 @@ File::MakeWeak (Persistent<Value> _, void *data)
   delete file;
 }
 
+// file.close(callback)
 Handle<Value>
 File::Close (const Arguments& args) 
 {
@@ -261,31 +669,43 @@ File::Close (const Arguments& args)
 
   File *file = File::Unwrap(args.Holder());  
 
-  int fd = file->GetFD();
-
-  node_eio_warmup();
-  eio_req *req = eio_close (fd, EIO_PRI_DEFAULT, File::AfterClose, file);
+  Action *action = new Action(&file->actions_, args[0]);
+  action->start = File::StartClose;
+  action->finish = File::AfterClose;
+  file->actions_.Push(args.Holder(), action);
 
   return Undefined();
 }
 
 int
-File::AfterClose (eio_req *req)
+File::StartClose (Action *action)
+{
+  int fd = GetFD(action->queue->handle());
+  if (fd < 0) return EBADF;
+
+  if (node_uring_close(fd, AfterUring, action) == 0)
+    return 0;
+  node_eio_warmup();
+  eio_close(fd, EIO_PRI_DEFAULT, AfterEio, action);
+  return 0;
+}
+
+void
+File::AfterClose (Action *action, ssize_t result, int errorno)
 {
-  File *file = static_cast<File*>(req->data);
+  HandleScope scope;
 
-  if (req->result == 0) {
-    file->handle_->Delete(FD_SYMBOL);
+  if (result == 0) {
+    action->queue->handle()->Delete(FD_SYMBOL);
   }
 
   const int argc = 1;
   Local<Value> argv[argc];
-  argv[0] = Integer::New(req->errorno);
-  CallTopCallback(file->handle_, argc, argv);
-
-  return 0;
+  argv[0] = Integer::New(errorno);
+  ActionQueue::Done(action, argc, argv);
 }
 
+// file.open(path, mode, callback)
 Handle<Value>
 File::Open (const Arguments& args)
 {
@@ -297,11 +717,6 @@ File::Open (const Arguments& args)
 
   File *file = File::Unwrap(args.Holder());  
 
-  // make sure that we don't already have a pending open
-  if (file->handle_->Has(FD_SYMBOL)) {
-    return ThrowException(String::New("File object is opened."));
-  }
-
   String::Utf8Value path(args[0]->ToString());
 
   int flags = O_RDONLY; // default
@@ -323,36 +738,52 @@ File::Open (const Arguments& args)
     }
   }
 
-  // TODO how should the mode be set?
-  node_eio_warmup();
-  eio_req *req = eio_open (*path, flags, 0666, EIO_PRI_DEFAULT, File::AfterOpen, file);
+  Action *action = new Action(&file->actions_, args[2]);
+  action->start = File::StartOpen;
+  action->finish = File::AfterOpen;
+  action->path = strdup(*path);
+  action->flags = flags;
+  file->actions_.Push(args.Holder(), action);
 
   return Undefined();
 }
 
 int
-File::AfterOpen (eio_req *req)
+File::StartOpen (Action *action)
+{
+  // make sure that we don't already have an open fd
+  if (GetFD(action->queue->handle()) >= 0) return EBUSY;
+
+  // TODO how should the mode be set?
+  if (node_uring_open(action->path, action->flags, 0666, AfterUring, action) == 0)
+    return 0;
+  node_eio_warmup();
+  eio_open(action->path, action->flags, 0666, EIO_PRI_DEFAULT, AfterEio, action);
+  return 0;
+}
+
+void
+File::AfterOpen (Action *action, ssize_t result, int errorno)
 {
-  File *file = static_cast<File*>(req->data);
   HandleScope scope;
 
-  if(req->result >= 0) {
-    file->handle_->Set(FD_SYMBOL, Integer::New(req->result));
+  if(result >= 0) {
+    action->queue->handle()->Set(FD_SYMBOL, Integer::New(result));
   }
 
   const int argc = 1;
-  Handle<Value> argv[argc];
-  argv[0] = Integer::New(req->errorno);
-  CallTopCallback(file->handle_, argc, argv);
-
-  return 0;
+  Local<Value> argv[argc];
+  argv[0] = Integer::New(errorno);
+  ActionQueue::Done(action, argc, argv);
 }
 
+// file.write(data, [position], callback)
+//
+// Without a position the data is written at the file's current offset.
 Handle<Value>
 File::Write (const Arguments& args)
 {
-  if (args.Length() < 2) return Undefined();
-  if (!args[1]->IsNumber()) return Undefined();
+  if (args.Length() < 1) return Undefined();
 
   HandleScope scope;
 
@@ -360,8 +791,16 @@ File::Write (const Arguments& args)
 
   char *buf = NULL; 
   size_t length = 0;
+  Buffer *buffer = NULL;
 
-  if (args[0]->IsString()) {
+  if (Buffer::HasInstance(args[0])) {
+    // raw encoding. The data is written straight out of the buffer.
+    buffer = Buffer::Unwrap(args[0]->ToObject());
+    buf = buffer->data();
+    length = buffer->length();
+    buffer->Ref();
+
+  } else if (args[0]->IsString()) {
     // utf8 encoding
     Local<String> string = args[0]->ToString();
     length = string->Utf8Length();
@@ -369,7 +808,7 @@ File::Write (const Arguments& args)
     string->WriteUtf8(buf, length);
     
   } else if (args[0]->IsArray()) {
-    // raw encoding
+    // raw encoding, old style. Prefer Buffer.
     Local<Array> array = Local<Array>::Cast(args[0]);
     length = array->Length();
     buf = static_cast<char*>(malloc(length));
@@ -383,96 +822,342 @@ File::Write (const Arguments& args)
     return Undefined();
   }
 
-  size_t pos = args[1]->Uint32Value();
+  bool has_pos = args[1]->IsNumber();
 
-  if (file->handle_->Has(FD_SYMBOL) == false) {
-    printf("trying to write to a bad fd!\n");  
-    return Undefined();
-  }
-
-  int fd = file->GetFD();
-
-  node_eio_warmup();
-  eio_req *req = eio_write(fd, buf, length, pos, EIO_PRI_DEFAULT, File::AfterWrite, file);
+  Action *action = new Action(&file->actions_, has_pos ? args[2] : args[1]);
+  action->start = File::StartWrite;
+  action->finish = File::AfterWrite;
+  action->buf = buf;
+  action->buffer = buffer;
+  action->length = length;
+  action->pos = has_pos ? args[1]->IntegerValue() : -1;
+  file->actions_.Push(args.Holder(), action);
 
   return Undefined();
 }
 
 int
-File::AfterWrite (eio_req *req)
+File::StartWrite (Action *action)
 {
-  File *file = static_cast<File*>(req->data);
+  int fd = GetFD(action->queue->handle());
+  if (fd < 0) return EBADF;
 
-  //char *buf = static_cast<char*>(req->ptr2);
-  free(req->ptr2);
-  size_t written = req->result;
+  if (node_uring_write(fd, action->buf, action->length, action->pos, AfterUring, action) == 0)
+    return 0;
+  node_eio_warmup();
+  eio_write(fd, action->buf, action->length, action->pos, EIO_PRI_DEFAULT, AfterEio, action);
+  return 0;
+}
 
+void
+File::AfterWrite (Action *action, ssize_t written, int errorno)
+{
   HandleScope scope;
 
   const int argc = 2;
   Local<Value> argv[argc];
-  argv[0] = Integer::New(req->errorno);
+  argv[0] = Integer::New(errorno);
   argv[1] = written >= 0 ? Integer::New(written) : Integer::New(0);
-  CallTopCallback(file->handle_, argc, argv);
-
-  return 0;
+  ActionQueue::Done(action, argc, argv);
 }
 
+// file.read(length, [position], callback)
+//
+// Without a position the file is read from its current offset.
 Handle<Value>
 File::Read (const Arguments& args)
 {
   if (args.Length() < 1) return Undefined();
   if (!args[0]->IsNumber()) return Undefined();
-  if (!args[1]->IsNumber()) return Undefined();
 
   HandleScope scope;
   File *file = File::Unwrap(args.Holder());
   size_t length = args[0]->IntegerValue();
-  size_t pos = args[1]->Uint32Value();
-
-  int fd = file->GetFD();
-
-  // NOTE: NULL pointer tells eio to allocate it itself
-  node_eio_warmup();
-  eio_req *req = eio_read(fd, NULL, length, pos, EIO_PRI_DEFAULT, File::AfterRead, file);
-  assert(req);
+  bool has_pos = args[1]->IsNumber();
+
+  // The data is read directly into the buffer handed to the callback.
+  Buffer *buffer = Buffer::New(length);
+  if (buffer == NULL)
+    return Undefined(); // exception pending
+  buffer->Ref();
+
+  Action *action = new Action(&file->actions_, has_pos ? args[2] : args[1]);
+  action->start = File::StartRead;
+  action->finish = File::AfterRead;
+  action->buffer = buffer;
+  action->buf = buffer->data();
+  action->length = length;
+  action->pos = has_pos ? args[1]->IntegerValue() : -1;
+  file->actions_.Push(args.Holder(), action);
 
   return Undefined();
 }
 
 int
-File::AfterRead (eio_req *req)
+File::StartRead (Action *action)
+{
+  int fd = GetFD(action->queue->handle());
+  if (fd < 0) return EBADF;
+
+  if (node_uring_read(fd, action->buf, action->length, action->pos, AfterUring, action) == 0)
+    return 0;
+  node_eio_warmup();
+  eio_read(fd, action->buf, action->length, action->pos, EIO_PRI_DEFAULT, AfterEio, action);
+  return 0;
+}
+
+void
+File::AfterRead (Action *action, ssize_t result, int errorno)
 {
-  File *file = static_cast<File*>(req->data);
   HandleScope scope;
 
   const int argc = 2;
   Local<Value> argv[argc];
-  argv[0] = Integer::New(req->errorno);
-
-  char *buf = static_cast<char*>(req->ptr2);
+  argv[0] = Integer::New(errorno);
 
-  if(req->result == 0) { 
-    // eof 
+  if(result <= 0) {
+    // eof or error
     argv[1] = Local<Value>::New(Null());
   } else {
-    size_t length = req->result;
-    if (file->HasUtf8Encoding()) {
-      // utf8 encoding
-      argv[1] = String::New(buf, req->result);
+    // raw encoding
+    action->buffer->Truncate(result);
+    argv[1] = action->buffer->handle();
+  }
+  ActionQueue::Done(action, argc, argv);
+}
+
+/* The segments of one readv() or writev() call. They are submitted together
+ * as an eio group and run side by side in the thread pool; the callback is
+ * made once, after the last of them has completed. Batches do not go
+ * through the action queue, so any number can be in flight on one file.
+ */
+class Batch {
+public:
+  Batch (Handle<Object> file, Handle<Function> callback, int count, bool writing);
+  ~Batch ();
+
+  void SetSegment (int index, off_t position, Buffer *buffer);
+  void Submit (int fd);
+
+private:
+  static int AfterSegment (eio_req *req);
+  static int AfterGroup (eio_req *req);
+
+  Persistent<Object> file_; // not collected while the batch runs
+  Persistent<Function> callback_;
+  int count_;
+  bool writing_;
+  int errorno_; // of the first segment which failed
+  Buffer **buffers_;
+  off_t *positions_;
+  ssize_t *results_;
+};
+
+Batch::Batch (Handle<Object> file, Handle<Function> callback, int count, bool writing)
+{
+  file_ = Persistent<Object>::New(file);
+  callback_ = Persistent<Function>::New(callback);
+  count_ = count;
+  writing_ = writing;
+  errorno_ = 0;
+  buffers_ = new Buffer*[count];
+  positions_ = new off_t[count];
+  results_ = new ssize_t[count];
+  for (int i = 0; i < count; i++) {
+    buffers_[i] = NULL;
+    results_[i] = 0;
+  }
+}
+
+Batch::~Batch ()
+{
+  for (int i = 0; i < count_; i++) {
+    if (buffers_[i]) buffers_[i]->Unref();
+  }
+  delete [] buffers_;
+  delete [] positions_;
+  delete [] results_;
+  file_.Dispose();
+  callback_.Dispose();
+}
+
+void
+Batch::SetSegment (int index, off_t position, Buffer *buffer)
+{
+  buffer->Ref();
+  buffers_[index] = buffer;
+  positions_[index] = position;
+}
+
+void
+Batch::Submit (int fd)
+{
+  node_eio_warmup();
+  eio_req *grp = eio_grp(Batch::AfterGroup, this);
+
+  for (int i = 0; i < count_; i++) {
+    Buffer *buffer = buffers_[i];
+    eio_req *req = writing_
+      ? eio_write(fd, buffer->data(), buffer->length(), positions_[i], EIO_PRI_DEFAULT, Batch::AfterSegment, this)
+      : eio_read(fd, buffer->data(), buffer->length(), positions_[i], EIO_PRI_DEFAULT, Batch::AfterSegment, this);
+    // int3 is unused by reads and writes. Completions are only handled in
+    // eio_poll(), on this thread, so setting it after submission is fine.
+    req->int3 = i;
+    eio_grp_add(grp, req);
+  }
+}
+
+int
+Batch::AfterSegment (eio_req *req)
+{
+  Batch *batch = static_cast<Batch*>(req->data);
+  batch->results_[req->int3] = req->result;
+  if (req->result < 0 && batch->errorno_ == 0)
+    batch->errorno_ = req->errorno;
+  return 0;
+}
+
+int
+Batch::AfterGroup (eio_req *req)
+{
+  Batch *batch = static_cast<Batch*>(req->data);
+  HandleScope scope;
+
+  Local<Array> results = Array::New(batch->count_);
+  for (int i = 0; i < batch->count_; i++) {
+    ssize_t result = batch->results_[i];
+    Local<Value> value;
+    if (batch->writing_) {
+      value = Integer::New(result > 0 ? result : 0);
+    } else if (result <= 0) {
+      value = Local<Value>::New(Null()); // eof or error
     } else {
-      // raw encoding
-      Local<Array> array = Array::New(length);
-      for (int i = 0; i < length; i++) {
-        array->Set(Integer::New(i), Integer::New(buf[i]));
-      }
-      argv[1] = array;
+      Buffer *buffer = batch->buffers_[i];
+      buffer->Truncate(result);
+      value = buffer->handle();
     }
+    results->Set(Integer::New(i), value);
   }
-  CallTopCallback(file->handle_, argc, argv);
+
+  const int argc = 2;
+  Local<Value> argv[argc];
+  argv[0] = Integer::New(batch->errorno_);
+  argv[1] = results;
+
+  Local<Object> file = Local<Object>::New(batch->file_);
+  Local<Function> callback = Local<Function>::New(batch->callback_);
+  delete batch;
+
+  TryCatch try_catch;
+  callback->Call(file, argc, argv);
+  if (try_catch.HasCaught())
+    node_fatal_exception(try_catch);
+
   return 0;
 }
 
+// file.readv([[position, length], ...], callback)
+//
+// callback(status, buffers) gets one Buffer per segment, or null where the
+// read hit the end of the file or failed.
+Handle<Value>
+File::ReadV (const Arguments& args)
+{
+  if (args.Length() < 2 || !args[0]->IsArray() || !args[1]->IsFunction())
+    return ThrowException(String::New("readv() needs an array of segments and a callback"));
+
+  HandleScope scope;
+
+  int fd = GetFD(args.Holder());
+  if (fd < 0)
+    return ThrowException(String::New("File object is not opened."));
+
+  Local<Array> segments = Local<Array>::Cast(args[0]);
+  int count = segments->Length();
+  Batch *batch = new Batch(args.Holder(), Local<Function>::Cast(args[1]), count, false);
+
+  for (int i = 0; i < count; i++) {
+    Local<Value> segment_value = segments->Get(Integer::New(i));
+    if (!segment_value->IsArray()) {
+      delete batch;
+      return ThrowException(String::New("readv() segments are [position, length]"));
+    }
+    Local<Array> segment = Local<Array>::Cast(segment_value);
+    int64_t position = segment->Get(Integer::New(0))->IntegerValue();
+    int64_t length = segment->Get(Integer::New(1))->IntegerValue();
+    if (position < 0 || length < 0) {
+      delete batch;
+      return ThrowException(String::New("Bad readv() segment"));
+    }
+
+    Buffer *buffer = Buffer::New(length);
+    if (buffer == NULL) {
+      delete batch;
+      return Undefined(); // exception pending
+    }
+    batch->SetSegment(i, position, buffer);
+  }
+
+  batch->Submit(fd);
+  return Undefined();
+}
+
+// file.writev([[position, data], ...], callback)
+//
+// data is a Buffer or a string, which is written as utf8. callback(status,
+// written) gets the number of bytes written for each segment.
+Handle<Value>
+File::WriteV (const Arguments& args)
+{
+  if (args.Length() < 2 || !args[0]->IsArray() || !args[1]->IsFunction())
+    return ThrowException(String::New("writev() needs an array of segments and a callback"));
+
+  HandleScope scope;
+
+  int fd = GetFD(args.Holder());
+  if (fd < 0)
+    return ThrowException(String::New("File object is not opened."));
+
+  Local<Array> segments = Local<Array>::Cast(args[0]);
+  int count = segments->Length();
+  Batch *batch = new Batch(args.Holder(), Local<Function>::Cast(args[1]), count, true);
+
+  for (int i = 0; i < count; i++) {
+    Local<Value> segment_value = segments->Get(Integer::New(i));
+    if (!segment_value->IsArray()) {
+      delete batch;
+      return ThrowException(String::New("writev() segments are [position, data]"));
+    }
+    Local<Array> segment = Local<Array>::Cast(segment_value);
+    int64_t position = segment->Get(Integer::New(0))->IntegerValue();
+    Local<Value> data = segment->Get(Integer::New(1));
+    if (position < 0) {
+      delete batch;
+      return ThrowException(String::New("Bad writev() segment"));
+    }
+
+    Buffer *buffer;
+    if (Buffer::HasInstance(data)) {
+      buffer = Buffer::Unwrap(data->ToObject());
+    } else if (data->IsString()) {
+      Local<String> string = data->ToString();
+      buffer = Buffer::New(string->Utf8Length());
+      if (buffer == NULL) {
+        delete batch;
+        return Undefined(); // exception pending
+      }
+      string->WriteUtf8(buffer->data(), buffer->length());
+    } else {
+      delete batch;
+      return ThrowException(String::New("writev() data must be a Buffer or a string"));
+    }
+    batch->SetSegment(i, position, buffer);
+  }
+
+  batch->Submit(fd);
+  return Undefined();
+}
+
 Handle<Value>
 File::New(const Arguments& args)
 {
@@ -496,21 +1181,31 @@ NodeInit_file (Handle<Object> target)
   file_template->InstanceTemplate()->SetInternalFieldCount(1);
 
   fs = Persistent<Object>::New(file_template->GetFunction());
-  InitActionQueue(fs);
 
   target->Set(String::NewSymbol("File"), fs);
 
   // file system methods
-  NODE_SET_METHOD(fs, "_ffi_rename", FileSystem::Rename);
-  NODE_SET_METHOD(fs, "_ffi_stat", FileSystem::Stat);
+  NODE_SET_METHOD(fs, "rename", FileSystem::Rename);
+  NODE_SET_METHOD(fs, "unlink", FileSystem::Unlink);
+  NODE_SET_METHOD(fs, "stat", FileSystem::Stat);
   NODE_SET_METHOD(fs, "strerror", FileSystem::StrError);
+  NODE_SET_METHOD(fs, "readFile", FileSystem::ReadFile);
   fs->Set(String::NewSymbol("STDIN_FILENO"), Integer::New(STDIN_FILENO));
   fs->Set(String::NewSymbol("STDOUT_FILENO"), Integer::New(STDOUT_FILENO));
   fs->Set(String::NewSymbol("STDERR_FILENO"), Integer::New(STDERR_FILENO));
+  fs->Set(String::NewSymbol("ENOENT"), Integer::New(ENOENT));
+  // Which of the two runs open, close, read, write, stat and rename.
+  fs->Set(String::NewSymbol("backend"),
+          String::New(node_uring_enabled() ? "io_uring" : "eio"));
+  NODE_SET_METHOD(fs, "uringCompletions", FileSystem::UringCompletions);
 
   // file methods
-  NODE_SET_METHOD(file_template->InstanceTemplate(), "_ffi_open", File::Open);
-  NODE_SET_METHOD(file_template->InstanceTemplate(), "_ffi_close", File::Close);
-  NODE_SET_METHOD(file_template->InstanceTemplate(), "_ffi_write", File::Write);
-  NODE_SET_METHOD(file_template->InstanceTemplate(), "_ffi_read", File::Read);
+  NODE_SET_METHOD(file_template->InstanceTemplate(), "open", File::Open);
+  NODE_SET_METHOD(file_template->InstanceTemplate(), "close", File::Close);
+  NODE_SET_METHOD(file_template->InstanceTemplate(), "write", File::Write);
+  NODE_SET_METHOD(file_template->InstanceTemplate(), "read", File::Read);
+  NODE_SET_METHOD(file_template->InstanceTemplate(), "readv", File::ReadV);
+  NODE_SET_METHOD(file_template->InstanceTemplate(), "writev", File::WriteV);
+
+  NodeInit_file_stream(fs);
 }
@@ -2,7 +2,19 @@
 #define node_file_h
 
 #include <v8.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 void NodeInit_file (v8::Handle<v8::Object> target);
 
+/* Reads all of path, blocking, so call it from the thread pool. Returns 0
+ * and data on success or an errno value. data points headroom bytes into
+ * a block from malloc; the bytes in front of it are left for the caller. */
+int node_read_file (const char *path, struct stat *st, char **data, size_t *length,
+                    size_t headroom);
+
+/* Makes a string of file contents, decoded as utf8, taking over data. Large
+ * ascii contents become an external string without a copy. */
+v8::Local<v8::String> node_contents_string (char *data, size_t length);
+
 #endif
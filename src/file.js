@@ -1,62 +1,68 @@
-File.rename = function (file1, file2, callback) {
-  this._addAction("rename", [file1, file2], callback);
-};
-
-File.stat = function (path, callback) {
-  this._addAction("stat", [path], callback);
-};
-
 File.exists = function (path, callback) {
-  this._addAction("stat", [path], function (status) {
+  this.stat(path, function (status) {
       callback(status == 0);
   });
 }
 
 File.cat = function (path, callback) {
-  var content = "";
-  var file = new File;
-  var pos = 0;
-  var chunkSize = 10*1024;
-
-  function readChunk () {
-    file.read(chunkSize, pos, function (status, chunk) {
-      if (chunk) {
-        content += chunk.encodeUtf8();
-        pos += chunk.length;
-        readChunk();
-      } else {
-        callback(0, content);
-        file.close();
-      }
-    });
-  }
-
-  file.open(path, "r", function (status) {
-    if (status == 0) 
-      readChunk();
-    else
-      callback (status);
-  });
+  this.readFile(path, "utf8", callback);
 }
 
-File.prototype.puts = function (data, callback) {
-  this.write(data + "\n", callback);
-};
-
-File.prototype.open = function (path, mode, callback) {
-  this._addAction("open", [path, mode], callback);
+// File.createReadStream(path, [options])
+//
+// options.chunkSize is how many bytes each onData() call gets (default
+// 64kb). options.readAhead is how many chunks pipe() lets wait in the
+// socket's write queue before it pauses the file (default 4).
+File.createReadStream = function (path, options) {
+  options = options || {};
+  var stream = new File.ReadStream(path, options.chunkSize);
+  stream.readAhead = options.readAhead || 4;
+  return stream;
 };
 
-File.prototype.close = function (callback) {
-  this._addAction("close", [], callback);
+// File.createWriteStream(path, [options])
+//
+// options.mode is "w" (default) or "a". write() returns false once
+// options.highWaterMark bytes (default 64kb) are waiting to be written.
+File.createWriteStream = function (path, options) {
+  options = options || {};
+  return new File.WriteStream(path, options.mode, options.highWaterMark);
 };
 
-File.prototype.write = function (buf, pos, callback) {
-  this._addAction("write", [buf, pos], callback);
+// Writes the file to a Socket, or a WriteStream, which takes over its
+// onDrain. Reading pauses while readAhead chunks are waiting there and
+// resumes on the drain, so memory use stays constant however big the file
+// is. callback is called once everything has been written out.
+File.ReadStream.prototype.pipe = function (destination, callback) {
+  var stream = this;
+  var waiting = 0;
+  var ended = false;
+
+  this.onData = function (chunk) {
+    waiting++;
+    if (destination.write(chunk) === false || waiting >= stream.readAhead)
+      stream.pause();
+  };
+
+  this.onEnd = function () {
+    ended = true;
+    if (waiting == 0 && callback) callback();
+  };
+
+  destination.onDrain = function () {
+    waiting = 0;
+    if (ended) {
+      if (callback) callback();
+    } else {
+      stream.resume();
+    }
+  };
+
+  return destination;
 };
 
-File.prototype.read = function (length, pos, callback) {
-  this._addAction("read", [length, pos], callback);
+File.prototype.puts = function (data, callback) {
+  this.write(data + "\n", callback);
 };
 
 // Some explanation of the File binding.
@@ -64,47 +70,19 @@ File.prototype.read = function (length, pos, callback) {
 // All file operations are blocking. To get around this they are executed
 // in a thread pool in C++ (libeio). 
 //
-// The ordering of method calls to a file should be preserved, so they are
-// only executed one at a time. A queue, called _actionQueue is employed. 
-//
-// The constructor File() is implemented in C++. It initlizes 
-// the member _actionQueue = []
+// The ordering of method calls to a file should be preserved, so open(),
+// close(), read() and write() on one file, and File.rename(),
+// File.unlink() and File.stat(), are only executed one at a time. They
+// wait in a queue kept by the C++ side (see ActionQueue in file.cc), which
+// calls each one's callback when it returns from the thread pool and then
+// starts the next.
 //
-// Any of the methods called on a file are put into this queue. When they
-// reach the head of the queue they will be executed. C++ calles the
-// method _pollActions each time it becomes idle. If there is no action
-// currently being executed then _pollActions will not be called. Thus when
-// actions are added to an empty _actionQueue, they should be immediately
-// executed.
+// readv() and writev() are the exception. They take positions for all of
+// their segments, so they are run straight away, concurrently with each
+// other and with whatever is in the queue.
 //
-// When an action has completed, the C++ side is going to look at the first
-// element of _actionQueue in order to get a handle on the callback
-// function. Only after that completion callback has been made can the
-// action be shifted out of the queue.
-// 
-// See File::CallTopCallback() in file.cc to see the other side of the
-// binding.
-File._addAction = File.prototype._addAction = function (method, args, callback) {
-  this._actionQueue.push({ method: method 
-                         , callback: callback
-                         , args: args
-                         });
-  if (this._actionQueue.length == 1) this._act();
-}
-
-File._act = File.prototype._act = function () {
-  var action = this._actionQueue[0];
-  if (action)
-    // TODO FIXME what if the action throws an error?
-    this["_ffi_" + action.method].apply(this, action.args);
-};
-
-// called from C++ after each action finishes
-// (i.e. when it returns from the thread pool)
-File._pollActions = File.prototype._pollActions = function () {
-  this._actionQueue.shift();
-  this._act();
-};
+// File.ReadStream and File.WriteStream (file_stream.cc) go through liboi's
+// oi_file instead, each with its own file descriptor.
 
 var stdout = new File();
 stdout.fd = File.STDOUT_FILENO;
@@ -0,0 +1,213 @@
+#include "node.h"
+#include "file_cache.h"
+
+#include <string>
+#include <list>
+#include <map>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Seconds a stat is trusted before the path is looked at again.
+#define FILE_CACHE_TTL 1.0
+
+// Unused expired entries are dropped once the cache holds this many.
+#define FILE_CACHE_MAX 256
+
+CachedFile::CachedFile (int fd_, const struct stat &st_)
+{
+  fd = fd_;
+  st = st_;
+  refs_ = 0;
+}
+
+CachedFile::~CachedFile ()
+{
+  close(fd);
+}
+
+void
+CachedFile::Unref ()
+{
+  assert(refs_ > 0);
+  if (--refs_ == 0)
+    delete this;
+}
+
+struct OpenWaiter {
+  node_open_cached_cb cb;
+  void *data;
+};
+
+class FileCacheEntry {
+public:
+  FileCacheEntry (const char *path_) : path(path_)
+  {
+    file = NULL;
+    checked = 0.;
+    validating = false;
+  }
+
+  ~FileCacheEntry ()
+  {
+    if (file) file->Unref();
+  }
+
+  void Revalidate ();
+
+  string path;
+  CachedFile *file; // the cache holds one reference
+  ev_tstamp checked;
+  bool validating;
+  list<OpenWaiter> waiters;
+
+private:
+  static int Stat (eio_req *req);
+  static int AfterStat (eio_req *req);
+};
+
+typedef map<string, FileCacheEntry*> FileCache;
+static FileCache file_cache;
+
+// What the thread pool found out about a path.
+struct StatResult {
+  struct stat st;
+  int fd; // -1 when the cached file is still good
+  int errorno;
+};
+
+static bool
+SameFile (const struct stat &a, const struct stat &b)
+{
+  return a.st_dev == b.st_dev
+      && a.st_ino == b.st_ino
+      && a.st_size == b.st_size
+      && a.st_mtime == b.st_mtime;
+}
+
+/* This function is executed in the thread pool. The entry's path and
+ * file do not change while it is validating. */
+int
+FileCacheEntry::Stat (eio_req *req)
+{
+  FileCacheEntry *entry = static_cast<FileCacheEntry*>(req->data);
+  StatResult *result = static_cast<StatResult*>(req->ptr2);
+  result->fd = -1;
+  result->errorno = 0;
+
+  if (stat(entry->path.c_str(), &result->st) < 0) {
+    result->errorno = errno;
+    return 0;
+  }
+
+  if (entry->file && SameFile(entry->file->st, result->st))
+    return 0;
+
+  int fd = open(entry->path.c_str(), O_RDONLY);
+  if (fd < 0 || fstat(fd, &result->st) < 0) {
+    result->errorno = errno;
+    if (fd >= 0) close(fd);
+    return 0;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  result->fd = fd;
+  return 0;
+}
+
+int
+FileCacheEntry::AfterStat (eio_req *req)
+{
+  FileCacheEntry *entry = static_cast<FileCacheEntry*>(req->data);
+  StatResult *result = static_cast<StatResult*>(req->ptr2);
+  req->ptr2 = NULL;
+
+  entry->validating = false;
+  entry->checked = ev_now(node_loop());
+
+  if (result->fd >= 0) {
+    // Changed or new. Whoever still sends the old one keeps it open.
+    if (entry->file) entry->file->Unref();
+    entry->file = new CachedFile(result->fd, result->st);
+    entry->file->Ref();
+  }
+
+  int errorno = result->errorno;
+  delete result;
+
+  // Failures are not cached. The entry leaves the cache before the
+  // callbacks run since they may open this same path again.
+  if (errorno) file_cache.erase(entry->path);
+
+  list<OpenWaiter> waiters;
+  waiters.swap(entry->waiters);
+
+  for (list<OpenWaiter>::iterator it = waiters.begin(); it != waiters.end(); it++) {
+    if (errorno) {
+      it->cb(errorno, NULL, it->data);
+    } else {
+      entry->file->Ref();
+      it->cb(0, entry->file, it->data);
+    }
+  }
+
+  if (errorno) delete entry;
+
+  return 0;
+}
+
+void
+FileCacheEntry::Revalidate ()
+{
+  assert(!validating);
+  validating = true;
+  node_eio_warmup();
+  eio_req *req = eio_custom(FileCacheEntry::Stat, EIO_PRI_DEFAULT, FileCacheEntry::AfterStat, this);
+  req->ptr2 = new StatResult;
+}
+
+static void
+Prune (void)
+{
+  ev_tstamp now = ev_now(node_loop());
+  FileCache::iterator it = file_cache.begin();
+  while (it != file_cache.end()) {
+    FileCacheEntry *entry = it->second;
+    if (!entry->validating && entry->checked + FILE_CACHE_TTL <= now) {
+      delete entry;
+      file_cache.erase(it++);
+    } else {
+      it++;
+    }
+  }
+}
+
+void
+node_open_cached (const char *path, node_open_cached_cb cb, void *data)
+{
+  FileCacheEntry *entry;
+
+  FileCache::iterator it = file_cache.find(path);
+  if (it != file_cache.end()) {
+    entry = it->second;
+    if (!entry->validating && entry->checked + FILE_CACHE_TTL > ev_now(node_loop())) {
+      entry->file->Ref();
+      cb(0, entry->file, data);
+      return;
+    }
+  } else {
+    if (file_cache.size() >= FILE_CACHE_MAX) Prune();
+    entry = new FileCacheEntry(path);
+    file_cache[entry->path] = entry;
+  }
+
+  OpenWaiter waiter = { cb, data };
+  entry->waiters.push_back(waiter);
+
+  if (!entry->validating)
+    entry->Revalidate();
+}
@@ -0,0 +1,36 @@
+#ifndef node_file_cache_h
+#define node_file_cache_h
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* An open, read only file descriptor and its stat, shared by everyone
+ * serving the same path. Closed when the cache has let go of it and the
+ * last reference is dropped. */
+class CachedFile {
+public:
+  int fd;
+  struct stat st;
+
+  void Ref () { refs_++; }
+  void Unref ();
+
+private:
+  CachedFile (int fd, const struct stat &st);
+  ~CachedFile ();
+
+  int refs_;
+  friend class FileCacheEntry;
+};
+
+/* errorno is 0 or an errno value. On success file has been ref'd for the
+ * callback's owner, who must Unref() it when done. */
+typedef void (*node_open_cached_cb) (int errorno, CachedFile *file, void *data);
+
+/* Opens path for reading. A path which was looked at less than a second
+ * ago is answered from the cache before this returns. Otherwise it is
+ * stat'ed in the thread pool and reopened only if its inode, size or
+ * mtime changed. Concurrent lookups of one path share the stat. */
+void node_open_cached (const char *path, node_open_cached_cb cb, void *data);
+
+#endif // node_file_cache_h
@@ -0,0 +1,580 @@
+#include "node.h"
+#include "file_stream.h"
+#include "buffer.h"
+
+#include <oi_file.h>
+#include <oi_buf.h>
+#include <oi_queue.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace v8;
+
+#define ON_DATA_SYMBOL String::NewSymbol("onData")
+#define ON_END_SYMBOL String::NewSymbol("onEnd")
+#define ON_DRAIN_SYMBOL String::NewSymbol("onDrain")
+#define ON_ERROR_SYMBOL String::NewSymbol("onError")
+#define ON_CLOSE_SYMBOL String::NewSymbol("onClose")
+
+#define DEFAULT_CHUNK_SIZE (64*1024)
+
+// Calls handle[name](argv...) if it is a function.
+static void
+Emit (Handle<Object> handle, Handle<String> name, int argc, Handle<Value> argv[])
+{
+  HandleScope scope;
+  Local<Value> callback_v = handle->Get(name);
+  if (!callback_v->IsFunction()) return;
+  Local<Function> callback = Local<Function>::Cast(callback_v);
+
+  TryCatch try_catch;
+  callback->Call(handle, argc, argv);
+  if (try_catch.HasCaught())
+    node_fatal_exception(try_catch);
+}
+
+/* Reads a file from start to end, chunk_size bytes at a time, handing each
+ * chunk to onData(buffer) and then calling onEnd(). Each chunk is read
+ * straight into its own Buffer, and the next read is started before
+ * onData() is called, so one chunk is always read ahead.
+ *
+ * pause() stops further reads. A read already in flight completes, but its
+ * chunk is held back until resume(). The object is not collected while
+ * the file is open.
+ */
+class ReadStream {
+public:
+  static Handle<Value> New (const Arguments& args);
+  static Handle<Value> Pause (const Arguments& args);
+  static Handle<Value> Resume (const Arguments& args);
+  static Handle<Value> Close (const Arguments& args);
+
+private:
+  ReadStream (Handle<Object> handle, const char *path, size_t chunk_size);
+  ~ReadStream ();
+
+  void ReadNext ();
+  void Deliver ();
+  void Shutdown ();
+
+  static void OnOpen (oi_file *file);
+  static void OnRead (oi_file *file, size_t count);
+  static void OnError (oi_file *file, struct oi_error e);
+  static void OnClose (oi_file *file);
+
+  static ReadStream* Unwrap (Handle<Object> handle);
+  static void MakeWeak (Persistent<Value> _, void *data);
+
+  oi_file file_;
+  char *path_; // oi_file keeps the pointer until the file is closed
+  size_t chunk_size_;
+  Buffer *reading_; // the read in flight goes into this
+  Buffer *pending_; // read but held back by pause()
+  bool paused_;
+  bool eof_;
+  bool closing_;
+  Persistent<Object> handle_;
+};
+
+ReadStream::ReadStream (Handle<Object> handle, const char *path, size_t chunk_size)
+{
+  oi_file_init(&file_);
+  file_.on_open = ReadStream::OnOpen;
+  file_.on_read = ReadStream::OnRead;
+  file_.on_error = ReadStream::OnError;
+  file_.on_close = ReadStream::OnClose;
+  file_.data = this;
+
+  path_ = strdup(path);
+  chunk_size_ = chunk_size;
+  reading_ = NULL;
+  pending_ = NULL;
+  paused_ = false;
+  eof_ = false;
+  closing_ = false;
+
+  HandleScope scope;
+  handle_ = Persistent<Object>::New(handle);
+  handle_->SetInternalField(0, External::New(this));
+
+  oi_file_attach(&file_, node_loop());
+  oi_file_open_path(&file_, path_, O_RDONLY, 0);
+}
+
+ReadStream::~ReadStream ()
+{
+  free(path_);
+  handle_->SetInternalField(0, Undefined());
+  handle_.Dispose();
+  handle_.Clear();
+}
+
+ReadStream*
+ReadStream::Unwrap (Handle<Object> handle)
+{
+  HandleScope scope;
+  Handle<External> field = Handle<External>::Cast(handle->GetInternalField(0));
+  return static_cast<ReadStream*>(field->Value());
+}
+
+void
+ReadStream::MakeWeak (Persistent<Value> _, void *data)
+{
+  ReadStream *stream = static_cast<ReadStream*>(data);
+  delete stream;
+}
+
+void
+ReadStream::ReadNext ()
+{
+  assert(reading_ == NULL);
+  reading_ = Buffer::New(chunk_size_);
+  if (reading_ == NULL) return; // exception pending
+  reading_->Ref();
+  oi_file_read_start(&file_, reading_->data(), chunk_size_);
+}
+
+// Hands out what has been read for as long as the stream is not paused,
+// and keeps a read going.
+void
+ReadStream::Deliver ()
+{
+  HandleScope scope;
+
+  while (!paused_ && !closing_ && pending_) {
+    Buffer *chunk = pending_;
+    pending_ = NULL;
+
+    if (reading_ == NULL && !eof_) ReadNext();
+
+    Local<Value> argv[1] = { chunk->handle() };
+    chunk->Unref(); // the handle above keeps it
+    Emit(handle_, ON_DATA_SYMBOL, 1, argv);
+  }
+
+  if (paused_ || closing_) return;
+
+  if (eof_) {
+    Shutdown();
+    Emit(handle_, ON_END_SYMBOL, 0, NULL);
+  } else if (reading_ == NULL && file_.fd >= 0) {
+    ReadNext();
+  }
+}
+
+// Closes the file once no read is in flight. OnClose() lets the object go.
+void
+ReadStream::Shutdown ()
+{
+  if (closing_) return;
+  closing_ = true;
+
+  if (pending_) {
+    pending_->Unref();
+    pending_ = NULL;
+  }
+  oi_file_read_stop(&file_);
+
+  if (reading_ == NULL) {
+    if (file_.fd >= 0)
+      oi_file_close(&file_);
+    else
+      OnClose(&file_);
+  }
+}
+
+void
+ReadStream::OnOpen (oi_file *file)
+{
+  ReadStream *stream = static_cast<ReadStream*>(file->data);
+#ifdef POSIX_FADV_SEQUENTIAL
+  // Let the kernel read further ahead of us.
+  posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  if (stream->closing_) {
+    oi_file_close(file);
+    return;
+  }
+  stream->Deliver();
+}
+
+void
+ReadStream::OnRead (oi_file *file, size_t count)
+{
+  ReadStream *stream = static_cast<ReadStream*>(file->data);
+  Buffer *chunk = stream->reading_;
+  stream->reading_ = NULL;
+
+  // oi would read again into the same memory once we return.
+  oi_file_read_stop(file);
+
+  if (stream->closing_) {
+    chunk->Unref();
+    oi_file_close(file);
+    return;
+  }
+
+  if (count == 0) {
+    chunk->Unref();
+    stream->eof_ = true;
+  } else {
+    assert(stream->pending_ == NULL);
+    chunk->Truncate(count);
+    stream->pending_ = chunk;
+  }
+  stream->Deliver();
+}
+
+void
+ReadStream::OnError (oi_file *file, struct oi_error e)
+{
+  ReadStream *stream = static_cast<ReadStream*>(file->data);
+  HandleScope scope;
+
+  if (stream->reading_) {
+    stream->reading_->Unref();
+    stream->reading_ = NULL;
+  }
+
+  Local<Value> argv[1] = { Integer::New(e.code) };
+  Emit(stream->handle_, ON_ERROR_SYMBOL, 1, argv);
+
+  if (e.domain == oi_error::OI_ERROR_CLOSE || file->fd < 0) {
+    stream->closing_ = true;
+    OnClose(file);
+    return;
+  }
+
+  // No more reads will complete; close now even if Shutdown() was waiting.
+  stream->closing_ = false;
+  stream->Shutdown();
+}
+
+void
+ReadStream::OnClose (oi_file *file)
+{
+  ReadStream *stream = static_cast<ReadStream*>(file->data);
+  HandleScope scope;
+
+  oi_file_detach(file);
+  Emit(stream->handle_, ON_CLOSE_SYMBOL, 0, NULL);
+  stream->handle_.MakeWeak(stream, ReadStream::MakeWeak);
+}
+
+// new File.ReadStream(path, [chunkSize])
+Handle<Value>
+ReadStream::New (const Arguments& args)
+{
+  if (args.Length() < 1 || !args[0]->IsString())
+    return ThrowException(String::New("ReadStream needs a path"));
+
+  HandleScope scope;
+
+  String::Utf8Value path(args[0]->ToString());
+  size_t chunk_size = DEFAULT_CHUNK_SIZE;
+  if (args[1]->IsNumber() && args[1]->IntegerValue() > 0)
+    chunk_size = args[1]->IntegerValue();
+
+  new ReadStream(args.Holder(), *path, chunk_size);
+
+  return args.This();
+}
+
+// stream.pause()
+Handle<Value>
+ReadStream::Pause (const Arguments& args)
+{
+  HandleScope scope;
+  ReadStream *stream = ReadStream::Unwrap(args.Holder());
+  stream->paused_ = true;
+  oi_file_read_stop(&stream->file_);
+  return Undefined();
+}
+
+// stream.resume()
+Handle<Value>
+ReadStream::Resume (const Arguments& args)
+{
+  HandleScope scope;
+  ReadStream *stream = ReadStream::Unwrap(args.Holder());
+  if (stream->paused_) {
+    stream->paused_ = false;
+    if (stream->file_.fd >= 0) stream->Deliver();
+  }
+  return Undefined();
+}
+
+// stream.close()
+//
+// Stops reading before the end of the file. onClose() is called once the
+// file is closed.
+Handle<Value>
+ReadStream::Close (const Arguments& args)
+{
+  HandleScope scope;
+  ReadStream *stream = ReadStream::Unwrap(args.Holder());
+  if (stream->file_.fd >= 0) stream->Shutdown();
+  else stream->closing_ = true; // still opening
+  return Undefined();
+}
+
+/* Writes everything given to write() to a file, in order, without waiting
+ * for each write to complete. onDrain() is called, like a Socket's, each
+ * time all of them have been written. write() returns false once at least
+ * highWaterMark bytes are waiting, as a hint to wait for it. close() waits
+ * for the queue to empty. The object is not collected while the file is
+ * open.
+ */
+class WriteStream {
+public:
+  static Handle<Value> New (const Arguments& args);
+  static Handle<Value> Write (const Arguments& args);
+  static Handle<Value> Close (const Arguments& args);
+
+private:
+  WriteStream (Handle<Object> handle, const char *path, int flags, size_t high_water_mark);
+  ~WriteStream ();
+
+  static void OnOpen (oi_file *file);
+  static void OnDrain (oi_file *file);
+  static void OnError (oi_file *file, struct oi_error e);
+  static void OnClose (oi_file *file);
+
+  static WriteStream* Unwrap (Handle<Object> handle);
+  static void MakeWeak (Persistent<Value> _, void *data);
+
+  oi_file file_;
+  char *path_;
+  oi_queue opening_; // writes made before the file was open, newest at the head
+  size_t queued_; // bytes written since the file last drained
+  size_t high_water_mark_;
+  bool closing_;
+  bool failed_;
+  Persistent<Object> handle_;
+};
+
+WriteStream::WriteStream (Handle<Object> handle, const char *path, int flags,
+                          size_t high_water_mark)
+{
+  oi_file_init(&file_);
+  file_.on_open = WriteStream::OnOpen;
+  file_.on_drain = WriteStream::OnDrain;
+  file_.on_error = WriteStream::OnError;
+  file_.on_close = WriteStream::OnClose;
+  file_.data = this;
+
+  path_ = strdup(path);
+  oi_queue_init(&opening_);
+  queued_ = 0;
+  high_water_mark_ = high_water_mark;
+  closing_ = false;
+  failed_ = false;
+
+  HandleScope scope;
+  handle_ = Persistent<Object>::New(handle);
+  handle_->SetInternalField(0, External::New(this));
+
+  oi_file_attach(&file_, node_loop());
+  oi_file_open_path(&file_, path_, flags, 0666);
+}
+
+WriteStream::~WriteStream ()
+{
+  assert(oi_queue_empty(&opening_));
+  free(path_);
+  handle_->SetInternalField(0, Undefined());
+  handle_.Dispose();
+  handle_.Clear();
+}
+
+WriteStream*
+WriteStream::Unwrap (Handle<Object> handle)
+{
+  HandleScope scope;
+  Handle<External> field = Handle<External>::Cast(handle->GetInternalField(0));
+  return static_cast<WriteStream*>(field->Value());
+}
+
+void
+WriteStream::MakeWeak (Persistent<Value> _, void *data)
+{
+  WriteStream *stream = static_cast<WriteStream*>(data);
+  delete stream;
+}
+
+void
+WriteStream::OnOpen (oi_file *file)
+{
+  WriteStream *stream = static_cast<WriteStream*>(file->data);
+
+  while (!oi_queue_empty(&stream->opening_)) {
+    oi_queue *q = oi_queue_last(&stream->opening_);
+    oi_queue_remove(q);
+    oi_file_write(file, oi_queue_data(q, oi_buf, queue));
+  }
+
+  if (stream->closing_ && stream->queued_ == 0)
+    oi_file_close(file);
+}
+
+void
+WriteStream::OnDrain (oi_file *file)
+{
+  WriteStream *stream = static_cast<WriteStream*>(file->data);
+  stream->queued_ = 0;
+
+  if (stream->closing_) {
+    oi_file_close(file);
+    return;
+  }
+
+  Emit(stream->handle_, ON_DRAIN_SYMBOL, 0, NULL);
+}
+
+void
+WriteStream::OnError (oi_file *file, struct oi_error e)
+{
+  WriteStream *stream = static_cast<WriteStream*>(file->data);
+  HandleScope scope;
+
+  stream->failed_ = true;
+
+  while (!oi_queue_empty(&stream->opening_)) {
+    oi_queue *q = oi_queue_last(&stream->opening_);
+    oi_queue_remove(q);
+    oi_buf *buf = oi_queue_data(q, oi_buf, queue);
+    if (buf->release) buf->release(buf);
+  }
+
+  Local<Value> argv[1] = { Integer::New(e.code) };
+  Emit(stream->handle_, ON_ERROR_SYMBOL, 1, argv);
+
+  // Whatever is still queued is dropped.
+  if (e.domain == oi_error::OI_ERROR_CLOSE || file->fd < 0)
+    OnClose(file);
+  else
+    oi_file_close(file);
+}
+
+void
+WriteStream::OnClose (oi_file *file)
+{
+  WriteStream *stream = static_cast<WriteStream*>(file->data);
+  HandleScope scope;
+
+  oi_file_detach(file);
+  Emit(stream->handle_, ON_CLOSE_SYMBOL, 0, NULL);
+  stream->handle_.MakeWeak(stream, WriteStream::MakeWeak);
+}
+
+// new File.WriteStream(path, [mode], [highWaterMark])
+//
+// mode is "w" (the default) to truncate the file or "a" to append to it.
+Handle<Value>
+WriteStream::New (const Arguments& args)
+{
+  if (args.Length() < 1 || !args[0]->IsString())
+    return ThrowException(String::New("WriteStream needs a path"));
+
+  HandleScope scope;
+
+  String::Utf8Value path(args[0]->ToString());
+
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+  if (args[1]->IsString()) {
+    String::AsciiValue mode(args[1]->ToString());
+    if ((*mode)[0] == 'a') flags = O_WRONLY | O_CREAT | O_APPEND;
+  }
+
+  size_t high_water_mark = DEFAULT_CHUNK_SIZE;
+  if (args[2]->IsNumber() && args[2]->IntegerValue() > 0)
+    high_water_mark = args[2]->IntegerValue();
+
+  new WriteStream(args.Holder(), *path, flags, high_water_mark);
+
+  return args.This();
+}
+
+// stream.write(data)
+//
+// data is a Buffer, which is written without a copy and must not be
+// changed until it has been, or a string, written as utf8. Returns false
+// if the caller should wait for onDrain() before writing more.
+Handle<Value>
+WriteStream::Write (const Arguments& args)
+{
+  HandleScope scope;
+  WriteStream *stream = WriteStream::Unwrap(args.Holder());
+
+  if (stream->closing_ || stream->failed_)
+    return ThrowException(String::New("write() after close() or an error"));
+
+  oi_buf *buf;
+  if (Buffer::HasInstance(args[0])) {
+    buf = Buffer::Unwrap(args[0]->ToObject())->NewOiBuf();
+  } else if (args[0]->IsString()) {
+    Local<String> string = args[0]->ToString();
+    size_t length = string->Utf8Length();
+    buf = oi_buf_new2(length);
+    if (buf) string->WriteUtf8(buf->base, length);
+  } else {
+    return ThrowException(String::New("write() needs a Buffer or a string"));
+  }
+  if (buf == NULL)
+    return ThrowException(String::New("Out of memory"));
+
+  stream->queued_ += buf->len;
+
+  if (stream->file_.fd >= 0) {
+    oi_file_write(&stream->file_, buf);
+  } else {
+    buf->written = 0;
+    oi_queue_insert_head(&stream->opening_, &buf->queue);
+  }
+
+  return stream->queued_ < stream->high_water_mark_ ? True() : False();
+}
+
+// stream.close()
+//
+// Closes the file once everything written so far is on disk, then calls
+// onClose().
+Handle<Value>
+WriteStream::Close (const Arguments& args)
+{
+  HandleScope scope;
+  WriteStream *stream = WriteStream::Unwrap(args.Holder());
+
+  if (stream->closing_ || stream->failed_)
+    return Undefined();
+  stream->closing_ = true;
+
+  // Otherwise OnOpen() or OnDrain() closes it.
+  if (stream->file_.fd >= 0 && stream->queued_ == 0)
+    oi_file_close(&stream->file_);
+
+  return Undefined();
+}
+
+void
+NodeInit_file_stream (Handle<Object> fs)
+{
+  HandleScope scope;
+
+  Local<FunctionTemplate> read_stream = FunctionTemplate::New(ReadStream::New);
+  read_stream->InstanceTemplate()->SetInternalFieldCount(1);
+  NODE_SET_METHOD(read_stream->InstanceTemplate(), "pause", ReadStream::Pause);
+  NODE_SET_METHOD(read_stream->InstanceTemplate(), "resume", ReadStream::Resume);
+  NODE_SET_METHOD(read_stream->InstanceTemplate(), "close", ReadStream::Close);
+  fs->Set(String::NewSymbol("ReadStream"), read_stream->GetFunction());
+
+  Local<FunctionTemplate> write_stream = FunctionTemplate::New(WriteStream::New);
+  write_stream->InstanceTemplate()->SetInternalFieldCount(1);
+  NODE_SET_METHOD(write_stream->InstanceTemplate(), "write", WriteStream::Write);
+  NODE_SET_METHOD(write_stream->InstanceTemplate(), "close", WriteStream::Close);
+  fs->Set(String::NewSymbol("WriteStream"), write_stream->GetFunction());
+}
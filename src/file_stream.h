@@ -0,0 +1,13 @@
+#ifndef node_file_stream_h
+#define node_file_stream_h
+
+#include <v8.h>
+
+/* Adds File.ReadStream and File.WriteStream, which read or write a whole
+ * file in chunks through liboi's oi_file rather than one request at a time
+ * through the action queue. See file.js for createReadStream(),
+ * createWriteStream() and pipe().
+ */
+void NodeInit_file_stream (v8::Handle<v8::Object> fs);
+
+#endif // node_file_stream_h
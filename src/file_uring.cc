@@ -0,0 +1,442 @@
+#include "file_uring.h"
+
+#include <errno.h>
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#if HAVE_IO_URING
+
+#include "pool.h"
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct UringRequest {
+  node_uring_cb cb;
+  void *data;
+  struct stat *stat_out; // only for stat
+  struct statx statx_buf;
+};
+
+static FreeList request_pool(sizeof(UringRequest), 256);
+
+static struct ev_loop *uring_loop;
+static int ring_fd = -1;
+static int event_fd = -1;
+static char *sq_ring, *cq_ring;
+static size_t sq_ring_size, cq_ring_size;
+static ev_io reap_watcher;
+static ev_prepare submit_watcher;
+
+// The rings shared with the kernel. We are the only producer of
+// submissions and the only consumer of completions.
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static unsigned sq_entries, cq_entries;
+
+static unsigned to_submit; // filled in but not yet handed to the kernel
+static unsigned inflight;  // handed out and not yet completed
+static bool rw_cur_pos;    // kernel takes -1 as the current offset
+static bool supported[IORING_OP_LAST];
+static unsigned long completions;
+
+// A forked child shares the parent's ring. It must not touch it, or the
+// two would take each other's completions; it gets a ring of its own
+// before its first request.
+static bool forked;
+
+static int
+io_uring_setup (unsigned entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter (int fd, unsigned submit, unsigned min_complete, unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, fd, submit, min_complete, flags, NULL, 0);
+}
+
+static int
+io_uring_register (int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void
+Flush (void)
+{
+  while (to_submit > 0) {
+    int r = io_uring_enter(ring_fd, to_submit, 0, 0);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      // EAGAIN or EBUSY: the kernel is short of memory or completions
+      // are backed up. Try again on the next loop iteration.
+      return;
+    }
+    to_submit -= r;
+  }
+  ev_prepare_stop(uring_loop, &submit_watcher);
+}
+
+static void
+SubmitCallback (EV_P_ ev_prepare *w, int revents)
+{
+  Flush();
+}
+
+static void
+Complete (UringRequest *req, int res)
+{
+  if (req->stat_out && res == 0) {
+    struct statx *sx = &req->statx_buf;
+    struct stat *st = req->stat_out;
+    memset(st, 0, sizeof *st);
+    st->st_dev = makedev(sx->stx_dev_major, sx->stx_dev_minor);
+    st->st_ino = sx->stx_ino;
+    st->st_mode = sx->stx_mode;
+    st->st_nlink = sx->stx_nlink;
+    st->st_uid = sx->stx_uid;
+    st->st_gid = sx->stx_gid;
+    st->st_rdev = makedev(sx->stx_rdev_major, sx->stx_rdev_minor);
+    st->st_size = sx->stx_size;
+    st->st_blksize = sx->stx_blksize;
+    st->st_blocks = sx->stx_blocks;
+    st->st_atime = sx->stx_atime.tv_sec;
+    st->st_mtime = sx->stx_mtime.tv_sec;
+    st->st_ctime = sx->stx_ctime.tv_sec;
+  }
+
+  node_uring_cb cb = req->cb;
+  void *data = req->data;
+  request_pool.Free(req);
+  cb(data, res);
+}
+
+static void
+ReapCallback (EV_P_ ev_io *w, int revents)
+{
+  uint64_t count;
+  while (read(event_fd, &count, sizeof count) < 0 && errno == EINTR)
+    ;
+
+  for (;;) {
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+      break;
+
+    struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+    UringRequest *req = reinterpret_cast<UringRequest*>(cqe->user_data);
+    int res = cqe->res;
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+    inflight--;
+    completions++;
+    // May queue more requests.
+    Complete(req, res);
+  }
+
+  if (inflight == 0)
+    ev_io_stop(EV_A_ w);
+}
+
+/* Returns the next free submission entry, cleared and tagged with a new
+ * request, or NULL if op is not supported or there is no room for it to
+ * complete. Once the entry is filled in it must be passed to Queue(). */
+static void Rebuild (void);
+
+static struct io_uring_sqe*
+Prepare (int op, node_uring_cb cb, void *data, UringRequest **req_out)
+{
+  if (forked) Rebuild();
+  if (ring_fd < 0 || !supported[op]) return NULL;
+  if (inflight >= cq_entries) return NULL;
+
+  unsigned tail = *sq_tail;
+  if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+    Flush();
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+      return NULL;
+  }
+
+  UringRequest *req = static_cast<UringRequest*>(request_pool.Alloc());
+  if (req == NULL) return NULL;
+  req->cb = cb;
+  req->data = data;
+  req->stat_out = NULL;
+
+  unsigned index = tail & *sq_mask;
+  struct io_uring_sqe *sqe = &sqes[index];
+  memset(sqe, 0, sizeof *sqe);
+  sqe->opcode = op;
+  sqe->user_data = reinterpret_cast<uintptr_t>(req);
+  sq_array[index] = index;
+
+  *req_out = req;
+  return sqe;
+}
+
+static int
+Queue (void)
+{
+  __atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+  to_submit++;
+  inflight++;
+  ev_prepare_start(uring_loop, &submit_watcher);
+  ev_io_start(uring_loop, &reap_watcher);
+  return 0;
+}
+
+int
+node_uring_open (const char *path, int flags, mode_t mode, node_uring_cb cb, void *data)
+{
+  UringRequest *req;
+  struct io_uring_sqe *sqe = Prepare(IORING_OP_OPENAT, cb, data, &req);
+  if (sqe == NULL) return ENOSYS;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = reinterpret_cast<uintptr_t>(path);
+  sqe->len = mode;
+  sqe->open_flags = flags;
+  return Queue();
+}
+
+int
+node_uring_close (int fd, node_uring_cb cb, void *data)
+{
+  UringRequest *req;
+  struct io_uring_sqe *sqe = Prepare(IORING_OP_CLOSE, cb, data, &req);
+  if (sqe == NULL) return ENOSYS;
+  sqe->fd = fd;
+  return Queue();
+}
+
+static int
+ReadWrite (int op, int fd, const void *buf, size_t length, off_t pos, node_uring_cb cb, void *data)
+{
+  if (pos < 0 && !rw_cur_pos) return ENOSYS;
+
+  UringRequest *req;
+  struct io_uring_sqe *sqe = Prepare(op, cb, data, &req);
+  if (sqe == NULL) return ENOSYS;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uintptr_t>(buf);
+  sqe->len = length;
+  sqe->off = pos < 0 ? (uint64_t) -1 : pos;
+  return Queue();
+}
+
+int
+node_uring_read (int fd, void *buf, size_t length, off_t pos, node_uring_cb cb, void *data)
+{
+  return ReadWrite(IORING_OP_READ, fd, buf, length, pos, cb, data);
+}
+
+int
+node_uring_write (int fd, const void *buf, size_t length, off_t pos, node_uring_cb cb, void *data)
+{
+  return ReadWrite(IORING_OP_WRITE, fd, buf, length, pos, cb, data);
+}
+
+int
+node_uring_stat (const char *path, struct stat *buf, node_uring_cb cb, void *data)
+{
+  UringRequest *req;
+  struct io_uring_sqe *sqe = Prepare(IORING_OP_STATX, cb, data, &req);
+  if (sqe == NULL) return ENOSYS;
+  req->stat_out = buf;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = reinterpret_cast<uintptr_t>(path);
+  sqe->len = STATX_BASIC_STATS;
+  sqe->off = reinterpret_cast<uintptr_t>(&req->statx_buf);
+  return Queue();
+}
+
+int
+node_uring_rename (const char *path, const char *new_path, node_uring_cb cb, void *data)
+{
+  UringRequest *req;
+  struct io_uring_sqe *sqe = Prepare(IORING_OP_RENAMEAT, cb, data, &req);
+  if (sqe == NULL) return ENOSYS;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = reinterpret_cast<uintptr_t>(path);
+  sqe->len = AT_FDCWD;
+  sqe->off = reinterpret_cast<uintptr_t>(new_path);
+  return Queue();
+}
+
+// Asks the kernel which operations it knows. Kernels before 5.6 have no
+// probe, nor most of the operations we want, so nothing is used there.
+static void
+Probe (void)
+{
+  size_t size = sizeof(struct io_uring_probe)
+              + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = static_cast<struct io_uring_probe*>(calloc(1, size));
+  if (probe == NULL) return;
+
+  if (io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0) {
+    for (int i = 0; i < probe->ops_len && i < IORING_OP_LAST; i++)
+      supported[i] = probe->ops[i].flags & IO_URING_OP_SUPPORTED;
+  }
+  free(probe);
+}
+
+static void RegisterAtFork (void);
+
+bool
+node_uring_init (EV_P_ unsigned int entries)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof p);
+
+  int fd = io_uring_setup(entries, &p);
+  if (fd < 0) return false; // ENOSYS, or forbidden by a seccomp policy
+
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap && cq_size > sq_size) sq_size = cq_size;
+
+  char *sq = static_cast<char*>(mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING));
+  if (sq == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+
+  char *cq = sq;
+  if (!single_mmap) {
+    cq = static_cast<char*>(mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING));
+    if (cq == MAP_FAILED) {
+      munmap(sq, sq_size);
+      close(fd);
+      return false;
+    }
+  }
+
+  void *s = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (s == MAP_FAILED || efd < 0
+      || io_uring_register(fd, IORING_REGISTER_EVENTFD, &efd, 1) < 0) {
+    if (s != MAP_FAILED) munmap(s, p.sq_entries * sizeof(struct io_uring_sqe));
+    if (efd >= 0) close(efd);
+    if (!single_mmap) munmap(cq, cq_size);
+    munmap(sq, sq_size);
+    close(fd);
+    return false;
+  }
+
+  ring_fd = fd;
+  event_fd = efd;
+  sq_ring = sq;
+  sq_ring_size = sq_size;
+  cq_ring = single_mmap ? NULL : cq;
+  cq_ring_size = cq_size;
+  sqes = static_cast<struct io_uring_sqe*>(s);
+
+  sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+  sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+  sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+  sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+  cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+  cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+  cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+  cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+  sq_entries = p.sq_entries;
+  cq_entries = p.cq_entries;
+  rw_cur_pos = p.features & IORING_FEAT_RW_CUR_POS;
+
+  Probe();
+
+  uring_loop = EV_A;
+  ev_io_init(&reap_watcher, ReapCallback, event_fd, EV_READ);
+  ev_prepare_init(&submit_watcher, SubmitCallback);
+
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, RegisterAtFork);
+
+  return true;
+}
+
+static void
+AfterFork (void)
+{
+  if (ring_fd >= 0) forked = true;
+}
+
+static void
+RegisterAtFork (void)
+{
+  pthread_atfork(NULL, NULL, AfterFork);
+}
+
+// Drops the parent's ring in the child and sets up a new one of the same
+// size. Whatever the parent had in flight stays the parent's; its
+// callbacks are never called here. If the new ring cannot be had, files
+// go through eio from now on.
+static void
+Rebuild (void)
+{
+  forked = false;
+
+  unsigned entries = sq_entries;
+  ev_io_stop(uring_loop, &reap_watcher);
+  ev_prepare_stop(uring_loop, &submit_watcher);
+
+  munmap(sqes, sq_entries * sizeof(struct io_uring_sqe));
+  if (cq_ring) munmap(cq_ring, cq_ring_size);
+  munmap(sq_ring, sq_ring_size);
+  close(event_fd);
+  close(ring_fd);
+  ring_fd = event_fd = -1;
+
+  to_submit = 0;
+  inflight = 0;
+  memset(supported, 0, sizeof supported);
+
+  node_uring_init(uring_loop, entries);
+}
+
+bool
+node_uring_enabled (void)
+{
+  if (forked) Rebuild();
+  return ring_fd >= 0;
+}
+
+unsigned long
+node_uring_completions (void)
+{
+  return completions;
+}
+
+#else // !HAVE_IO_URING
+
+bool node_uring_init (EV_P_ unsigned int entries) { return false; }
+bool node_uring_enabled (void) { return false; }
+unsigned long node_uring_completions (void) { return 0; }
+
+int node_uring_open (const char *path, int flags, mode_t mode, node_uring_cb cb, void *data) { return ENOSYS; }
+int node_uring_close (int fd, node_uring_cb cb, void *data) { return ENOSYS; }
+int node_uring_read (int fd, void *buf, size_t length, off_t pos, node_uring_cb cb, void *data) { return ENOSYS; }
+int node_uring_write (int fd, const void *buf, size_t length, off_t pos, node_uring_cb cb, void *data) { return ENOSYS; }
+int node_uring_stat (const char *path, struct stat *buf, node_uring_cb cb, void *data) { return ENOSYS; }
+int node_uring_rename (const char *path, const char *new_path, node_uring_cb cb, void *data) { return ENOSYS; }
+
+#endif // HAVE_IO_URING
@@ -0,0 +1,46 @@
+#ifndef node_file_uring_h
+#define node_file_uring_h
+
+#include <ev.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* File operations handed straight to the kernel with io_uring instead of
+ * going through the eio thread pool. Submissions are batched and made once
+ * per loop iteration, just before libev blocks; completions are reaped from
+ * the loop through an eventfd the kernel signals.
+ *
+ * Each node_uring_* function returns 0 if the operation was queued, and
+ * cb(data, result) is later called from the loop with what the system
+ * call would have returned, or -errno. Anything else means the operation
+ * could not be queued, because io_uring is off or unavailable, the kernel
+ * does not support that operation or the ring is full, and the caller
+ * should use eio instead.
+ *
+ * A process forked after the ring was set up leaves the parent's ring
+ * alone and sets up one of its own the next time it is used.
+ */
+typedef void (*node_uring_cb) (void *data, ssize_t result);
+
+/* Sets up a ring of the given number of entries. Returns false, leaving
+ * everything to eio, when the kernel or the build has no io_uring. */
+bool node_uring_init (EV_P_ unsigned int entries);
+
+bool node_uring_enabled (void);
+
+/* How many operations have completed through the ring, for tests and
+ * benchmarks which want to know the ring is really used. */
+unsigned long node_uring_completions (void);
+
+int node_uring_open (const char *path, int flags, mode_t mode, node_uring_cb cb, void *data);
+int node_uring_close (int fd, node_uring_cb cb, void *data);
+
+// pos -1 reads or writes at the file's current offset.
+int node_uring_read (int fd, void *buf, size_t length, off_t pos, node_uring_cb cb, void *data);
+int node_uring_write (int fd, const void *buf, size_t length, off_t pos, node_uring_cb cb, void *data);
+
+// buf is filled in before cb is called with 0.
+int node_uring_stat (const char *path, struct stat *buf, node_uring_cb cb, void *data);
+int node_uring_rename (const char *path, const char *new_path, node_uring_cb cb, void *data);
+
+#endif // node_file_uring_h
@@ -1,13 +1,27 @@
 #include "node.h"
 #include "http.h"
+#include "buffer.h"
+#include "pool.h"
+#include "dns.h"
+#include "file_cache.h"
+#include "http_worker.h"
 
 #include <oi_socket.h>
 #include <ebb_request_parser.h>
+#include <ebb_scan.h>
 
 #include <string>
 #include <list>
+#include <vector>
+#include <algorithm>
 
 #include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
 
 using namespace v8;
 using namespace std;
@@ -25,7 +39,11 @@ static Persistent<String> headers_str;
 
 static Persistent<String> on_request_str; 
 static Persistent<String> on_body_str; 
+static Persistent<String> on_error_str;
 static Persistent<String> respond_str; 
+static Persistent<String> set_body_encoding_str;
+static Persistent<String> collect_body_str;
+static Persistent<String> send_file_str;
 
 static Persistent<String> copy_str;
 static Persistent<String> delete_str;
@@ -42,15 +60,124 @@ static Persistent<String> put_str;
 static Persistent<String> trace_str;
 static Persistent<String> unlock_str;
 
+static Persistent<String> http_1_0_str;
+static Persistent<String> http_1_1_str;
+
+// Upper-cased header names as produced by on_header_field. Requests
+// mostly carry the same dozen headers; interning them once saves a symbol
+// table lookup per header per request.
+static struct {
+  const char *name;
+  size_t length;
+  Persistent<String> symbol;
+} header_symbols[] = 
+#define HEADER_SYMBOL(name) { name, sizeof(name) - 1, Persistent<String>() }
+  { HEADER_SYMBOL("HOST")
+  , HEADER_SYMBOL("USER_AGENT")
+  , HEADER_SYMBOL("ACCEPT")
+  , HEADER_SYMBOL("ACCEPT_ENCODING")
+  , HEADER_SYMBOL("ACCEPT_LANGUAGE")
+  , HEADER_SYMBOL("ACCEPT_CHARSET")
+  , HEADER_SYMBOL("CONNECTION")
+  , HEADER_SYMBOL("KEEP_ALIVE")
+  , HEADER_SYMBOL("COOKIE")
+  , HEADER_SYMBOL("REFERER")
+  , HEADER_SYMBOL("CACHE_CONTROL")
+  , HEADER_SYMBOL("PRAGMA")
+  , HEADER_SYMBOL("CONTENT_TYPE")
+  , HEADER_SYMBOL("CONTENT_LENGTH")
+  , HEADER_SYMBOL("TRANSFER_ENCODING")
+  , HEADER_SYMBOL("AUTHORIZATION")
+  , HEADER_SYMBOL("IF_MODIFIED_SINCE")
+  , HEADER_SYMBOL("IF_NONE_MATCH")
+  , HEADER_SYMBOL("RANGE")
+  , HEADER_SYMBOL("EXPECT")
+  , HEADER_SYMBOL("ORIGIN")
+  , HEADER_SYMBOL("UPGRADE")
+  , HEADER_SYMBOL("X_FORWARDED_FOR")
+  , HEADER_SYMBOL("X_REQUESTED_WITH")
+  , { NULL, 0, Persistent<String>() }
+#undef HEADER_SYMBOL
+  };
+
+// indexes for the lazy request properties
+enum { PATH_PROPERTY
+     , URI_PROPERTY
+     , QUERY_STRING_PROPERTY
+     , FRAGMENT_PROPERTY
+     , METHOD_PROPERTY
+     , HTTP_VERSION_PROPERTY
+     , HEADERS_PROPERTY
+     };
+
+// How a response body is delimited. respond(status, headers) without a
+// Content-Length or Transfer-Encoding header leaves the choice to the
+// server: the head is held back (FRAMING_PENDING) until the body turns out
+// to be complete in one piece, which gets a Content-Length, or not, which
+// makes it chunked. See HttpRequest::StartBody.
+enum { FRAMING_NONE // javascript delimits the body itself, if at all
+     , FRAMING_PENDING
+     , FRAMING_CHUNKED
+     };
+
 #define INVALID_STATE_ERR 1
 
+// Default number of response bytes a connection may hold in memory (not
+// yet written to the socket) before it stops reading pipelined requests.
+#define DEFAULT_RESPONSE_BUFFER_LIMIT (128*1024)
+
+// Seconds a connection may sit idle before it is closed.
+#define DEFAULT_IDLE_TIMEOUT 30.0
+
+// Finished requests kept around per connection for reuse.
+#define MAX_FREE_REQUESTS 4
+
+// ASCII body chunks at least this long become external strings instead of
+// being copied onto the V8 heap.
+#define EXTERNAL_BODY_THRESHOLD 1024
+
+// Most bytes handed to one eio_sendfile call.
+#define SENDFILE_CHUNK (512*1024)
+
+// A recycled request drops a collected body buffer bigger than this rather
+// than keeping its capacity around.
+#define MAX_KEPT_BODY_CAPACITY (64*1024)
+
+// Requests are received into a per-connection buffer of this size. It
+// comes from a free list for each read and is only held between reads
+// while a request head is incomplete.
+#define READ_BUFFER_SIZE (64*1024)
+
+// A read is not started with less room than this. The buffer is compacted
+// or grown first.
+#define MIN_READ_SPACE 4096
+
+// Longest request line plus headers a connection will buffer.
+#define MAX_HEAD_SIZE (80*1024)
+
+// In threads mode, the most bytes of parsed requests a connection may have
+// on their way to javascript. No single request may be bigger.
+#define DEFAULT_REQUEST_BUFFER_LIMIT (1024*1024)
+
+// Connection::keep_from when no part of the buffer is referenced.
+#define NO_SPAN (static_cast<size_t>(-1))
+
+class Connection;
+
 class HttpServer {
 public:
-  HttpServer (Handle<Object> _js_server);
+  HttpServer (Handle<Object> _js_server, int backlog, int accept_batch);
   ~HttpServer ();
 
+  size_t response_buffer_limit;
+  size_t request_buffer_limit; // threads mode only
+  double idle_timeout; // seconds
+  int threads; // HttpWorkers to start, 0 to handle sockets on node_loop()
+
+  void Resolve(const char *host, const char *port);
   int Start(struct addrinfo *servinfo);
   void Stop();
+  Connection* NewConnection ();
 
   Handle<Value> Callback()
   {
@@ -60,60 +187,189 @@ public:
   }
 
 private:
+  static void AfterResolve(int status, struct addrinfo *servinfo, void *data);
+  static void OnMessages (EV_P_ ev_async *watcher, int revents);
+  int StartThreads ();
+
   oi_server server;
   Persistent<Object> js_server;
+  bool resolving;
+  bool resolve_async; // the constructor returned before the lookup finished
+
+  vector<HttpWorker*> http_workers;
+  size_t accepting; // http_workers which have not answered STOP
+  Mailbox<HttpMessage> inbox;
+  ev_async inbox_watcher;
+
+ public:
+  int start_error;
 };
 
 class HttpRequest;
-
+class FileSegment;
+
+/* Request heads are parsed in place. The request line and header spans are
+ * offsets into read_buffer, and header names are upper-cased in there, so
+ * nothing is copied until javascript asks for a property. The buffer is
+ * kept from keep_from on until the head is complete. When more room is
+ * needed the unfinished head is moved to the front (and its spans moved
+ * with it) rather than being appended anywhere else, so a token that
+ * straddles two reads stays contiguous.
+ *
+ * Responses to pipelined requests must go out in request order. Output
+ * for a request which is not at the front of the line is held in that
+ * request's output list. Once the bytes held in memory (held output plus
+ * whatever the socket has not sent yet) exceed response_buffer_limit,
+ * reading is paused until the socket drains below half of that.
+ *
+ * In threads mode the socket is a WorkerConnection's on another thread
+ * (remote) and socket is unused. Requests arrive parsed through Deliver()
+ * and output is handed to the worker; there is no read buffer on this
+ * side, and the worker throttles reading (see http_worker.h).
+ */
 class Connection {
 public:
-  Connection();
+  Connection(size_t response_buffer_limit, double idle_timeout);
   ~Connection();
 
+  static void* operator new (size_t size) throw();
+  static void operator delete (void *p);
+
   void Parse(const void *buf, size_t count);
+  void Deliver (ParsedRequest *parsed);
+  size_t Keep (const char *p);
   void Write();
   void Close();
-  void AddRequest (HttpRequest *request);
+  HttpRequest* NewRequest ();
+  void Buffered (size_t length) { buffered_bytes += length; }
 
   oi_socket socket;
+  WorkerConnection *remote;
   Persistent<Function> js_onrequest;
 
+  char *read_buffer;
+  size_t read_buffer_size;
+  size_t read_used; // bytes of read_buffer holding received data
+  size_t keep_from; // first byte a request head refers to, or NO_SPAN
+
 private:
+  static void OnDrain (oi_socket *socket);
+  static void* ReadBuffer (oi_socket *socket, size_t *size);
+  bool Reserve (size_t want);
+  void ReleaseReadBuffer ();
+  void WriteRequests ();
+  size_t Backlog ();
+  void UpdateReadState ();
+  void Recycle (HttpRequest *request);
+
   ebb_request_parser parser;
   list<HttpRequest*> requests;
-  list<HttpRequest*> finished_requests;
+  list<HttpRequest*> free_requests;
+
+  size_t response_buffer_limit;
+  size_t buffered_bytes; // held in requests' output lists
+  size_t socket_bytes; // total ever handed to oi_socket_write
+  bool reading_paused;
+  bool close_on_drain;
+  bool writing; // inside Write()
+  bool write_again;
   friend class HttpServer;
 };
 
 class HttpRequest {
  public:
   HttpRequest (Connection &c);
-  /* Deleted from C++ as soon as possible.
-   * Javascript object might linger. This is okay
+  /* Recycled or deleted from C++ as soon as the response has been handed
+   * to the socket. Javascript object might linger. This is okay
    */
   ~HttpRequest();
 
+  static void* operator new (size_t size) throw();
+  static void operator delete (void *p);
+
+  void Reset ();
+  void Output (oi_buf *buf);
+
   void MakeBodyCallback (const char *base, size_t length);
+  void OnBody (const char *base, size_t length);
+  void OnComplete ();
+  Local<Value> BodyChunk (const char *base, size_t length);
   Local<Object> CreateJSObject ();
+  Local<Value> MaterializeProperty (int property);
+  void KeepUnread ();
+  const char* HeadBase ();
+  void Rebase (size_t shift);
+  void Detach ();
+  void Adopt (ParsedRequest *parsed);
   void Respond (Handle<Value> data);
-
-  string path;
-  string query_string;
-  string fragment;
-  string uri;
-
-  list<string> header_fields;
-  list<string> header_values;
+  void RespondHeaders (int status, Handle<Value> headers);
+  oi_buf* FormatHeaders ( int status
+                        , Handle<Value> headers
+                        , off_t content_length
+                        , bool open = false
+                        , bool *framed = NULL
+                        );
+  void StartBody (bool complete);
+  void OutputChunk (oi_buf *buf);
+  void SendFile (Handle<String> path, Handle<Value> options, Handle<Value> callback);
+
+  // Offsets into the connection's read buffer until Detach(), into head
+  // afterwards. Both head and headers keep their capacity when the request
+  // is recycled.
+  typedef HttpSpan Span;
+  Span path;
+  Span query_string;
+  Span fragment;
+  Span uri;
+
+  typedef HttpHeaderSpan HeaderSpan;
+  vector<HeaderSpan> headers;
+
+  string head; // what javascript has not read yet, once detached
+  bool detached;
+  int materialized; // bit per property handed to javascript
 
   Connection &connection;
   ebb_request parser_info;
 
+  // request.collectBody(n) gathers up to n body bytes here and passes
+  // them to onbody in one piece when the request is complete.
+  string body;
+  size_t body_limit; // 0 when not collecting
+  bool raw_body; // chunks are Buffers instead of strings
+
   list<oi_buf*> output;
-  bool done;
+  int framing;
+  oi_buf *response_head; // held back while FRAMING_PENDING
+  oi_buf *first_chunk; // ditto
+  list<HttpRequest*>::iterator unframed_it;
+  bool force_close; // the body ends when the connection does
+  bool done; // response finished
+  bool complete; // parser finished with the request
   Persistent<Object> js_object;
 };
 
+/* What a request's javascript object still needs once the C++ request
+ * has been recycled: the part of the head it has not read, with the spans
+ * into it. Properties are made from it as before, on first read. The
+ * object owns it and frees it when it is collected.
+ */
+class DetachedHead {
+ public:
+  DetachedHead (HttpRequest *request, Handle<Object> object);
+
+  Local<Value> MaterializeProperty (int property);
+
+ private:
+  static void MakeWeak (Persistent<Value> _, void *data);
+
+  string head;
+  HttpSpan line[4]; // path, uri, query_string, fragment
+  vector<HttpHeaderSpan> headers;
+  ebb_request info;
+  Persistent<Object> handle_;
+};
+
 static Handle<Value>
 GetMethodString (int method)
 {
@@ -136,109 +392,1062 @@ GetMethodString (int method)
   return Null();
 }
 
+static Handle<Value>
+GetHttpVersionString (int major, int minor)
+{
+  if (major == 1 && minor == 1) return http_1_1_str;
+  if (major == 1 && minor == 0) return http_1_0_str;
+
+  HandleScope scope;
+  char version[10];
+  snprintf ( version
+           , 10 // big enough? :)
+           , "%d.%d"
+           , major
+           , minor
+           ); 
+  return scope.Close(String::New(version));
+}
+
+static Handle<String>
+GetHeaderSymbol (const char *field, size_t length)
+{
+  for (int i = 0; header_symbols[i].name; i++) {
+    const char *name = header_symbols[i].name;
+    if (header_symbols[i].length == length && name[0] == field[0]
+        && memcmp(name, field, length) == 0) 
+    {
+      return header_symbols[i].symbol;
+    }
+  }
+  return String::NewSymbol(field, length);
+}
+
+// line holds the path, uri, query_string and fragment spans into base.
+static Local<Value>
+NewRequestProperty ( int property
+                   , const char *base
+                   , const HttpSpan *line
+                   , const vector<HttpHeaderSpan> &headers
+                   , const ebb_request &info
+                   )
+{
+  HandleScope scope;
+
+  switch (property) {
+    case PATH_PROPERTY:
+    case URI_PROPERTY:
+    case QUERY_STRING_PROPERTY:
+    case FRAGMENT_PROPERTY: {
+      const HttpSpan &span = line[property - PATH_PROPERTY];
+      return scope.Close(String::New(base + span.offset, span.length));
+    }
+
+    case METHOD_PROPERTY:
+      return scope.Close(GetMethodString(info.method));
+
+    case HTTP_VERSION_PROPERTY:
+      return scope.Close(GetHttpVersionString( info.version_major
+                                             , info.version_minor
+                                             ));
+
+    case HEADERS_PROPERTY: {
+      Local<Object> result = Object::New();
+      for (size_t i = 0; i < headers.size(); i++) {
+        const HttpHeaderSpan &span = headers[i];
+        result->Set( GetHeaderSymbol(base + span.field_offset, span.field_length)
+                   , String::New(base + span.value_offset, span.value_length) 
+                   );
+      }
+      return scope.Close(result);
+    }
+  }
+
+  assert(0 && "unknown request property");
+  return Local<Value>::New(Undefined());
+}
+
+// Returns NULL if the C++ request has already been deleted.
+static HttpRequest*
+UnwrapRequest (Handle<Object> handle)
+{
+  HandleScope scope;
+  Handle<Value> v = handle->GetInternalField(0);
+  if (v->IsUndefined())
+    return NULL;
+  Handle<External> field = Handle<External>::Cast(v);
+  return static_cast<HttpRequest*>(field->Value());
+}
+
+// Returns NULL unless the C++ request is gone and left a DetachedHead.
+static DetachedHead*
+UnwrapDetachedHead (Handle<Object> handle)
+{
+  HandleScope scope;
+  Handle<Value> v = handle->GetInternalField(1);
+  if (!v->IsExternal())
+    return NULL;
+  Handle<External> field = Handle<External>::Cast(v);
+  return static_cast<DetachedHead*>(field->Value());
+}
+
 static Handle<Value>
 RespondCallback (const Arguments& args) 
 {
   HandleScope scope;
 
-  Handle<Value> v = args.Holder()->GetInternalField(0);
-  if(v->IsUndefined()) {
+  HttpRequest* request = UnwrapRequest(args.Holder());
+  if(request == NULL) {
     // check that args.Holder()->GetInternalField(0)
     // is not NULL if so raise INVALID_STATE_ERR
     printf("null request external\n");
     ThrowException(Integer::New(INVALID_STATE_ERR)); 
     return Undefined();
   }
-  Handle<External> field = Handle<External>::Cast(v);
-  HttpRequest* request = static_cast<HttpRequest*>(field->Value());
-  request->Respond(args[0]);
+  if (args[0]->IsNumber())
+    request->RespondHeaders(args[0]->Int32Value(), args[1]);
+  else
+    request->Respond(args[0]);
+  return Undefined();
+}
+
+// request.sendFile(path, options, callback)
+// Sends the file, or the part of it given by options.offset and
+// options.length, after whatever was written before. If options.status is
+// given the status line, options.headers and a Content-Length are written
+// first. callback(errno) is called once the file is sent or has failed; 0
+// means success. If the file cannot be opened nothing is written and
+// javascript may still respond some other way.
+static Handle<Value>
+SendFileCallback (const Arguments& args)
+{
+  HandleScope scope;
+
+  HttpRequest* request = UnwrapRequest(args.Holder());
+  if (request == NULL)
+    return ThrowException(Integer::New(INVALID_STATE_ERR));
+
+  if (args.Length() < 1 || !args[0]->IsString())
+    return ThrowException(String::New("sendFile requires a path"));
+
+  // The socket belongs to another thread.
+  if (request->connection.remote)
+    return ThrowException(String::New("sendFile is not available with threads"));
+
+  request->SendFile(args[0]->ToString(), args[1], args[2]);
+  return Undefined();
+}
+
+// request.setBodyEncoding("raw") makes onbody receive Buffers.
+// "binary", the default, gives strings with one character per byte.
+static Handle<Value>
+SetBodyEncodingCallback (const Arguments& args)
+{
+  HandleScope scope;
+
+  HttpRequest* request = UnwrapRequest(args.Holder());
+  if (request == NULL)
+    return ThrowException(Integer::New(INVALID_STATE_ERR));
+
+  String::AsciiValue encoding(args[0]->ToString());
+  if (strcmp(*encoding, "raw") == 0)
+    request->raw_body = true;
+  else if (strcmp(*encoding, "binary") == 0)
+    request->raw_body = false;
+  else
+    return ThrowException(String::New("Unknown body encoding"));
+
   return Undefined();
 }
 
+// request.collectBody(maxBytes) 
+// Instead of one onbody call per read, the body is handed over in a single
+// chunk once the request is complete. A body which grows past maxBytes
+// goes back to being streamed: what was collected so far is passed on and
+// the rest follows in chunks as usual.
+static Handle<Value>
+CollectBodyCallback (const Arguments& args)
+{
+  HandleScope scope;
+
+  HttpRequest* request = UnwrapRequest(args.Holder());
+  if (request == NULL)
+    return ThrowException(Integer::New(INVALID_STATE_ERR));
+
+  if (!args[0]->IsNumber() || args[0]->IntegerValue() <= 0)
+    return ThrowException(String::New("collectBody requires a positive length"));
+
+  request->body_limit = args[0]->IntegerValue();
+  // Don't let a client make us allocate more than the limit up front.
+  size_t expected = request->parser_info.content_length;
+  if (request->parser_info.transfer_encoding == EBB_IDENTITY && expected > 0)
+    request->body.reserve(expected < request->body_limit ? expected : request->body_limit);
+
+  return Undefined();
+}
+
+// The request properties (path, headers, ...) are accessors. Nothing is
+// converted to javascript until it is first read; the result is then kept
+// as a hidden value on the object. Once the C++ request is recycled or
+// deleted the unread ones are made from its DetachedHead.
+static Handle<Value>
+RequestPropertyGetter (Local<String> property, const AccessorInfo& info)
+{
+  HandleScope scope;
+  Local<Object> holder = info.Holder();
+
+  Local<Value> cached = holder->GetHiddenValue(property);
+  if (!cached.IsEmpty())
+    return scope.Close(cached);
+
+  int index = info.Data()->Int32Value();
+  Local<Value> value;
+  HttpRequest *request = UnwrapRequest(holder);
+  if (request) {
+    value = request->MaterializeProperty(index);
+  } else {
+    DetachedHead *rest = UnwrapDetachedHead(holder);
+    if (rest == NULL)
+      return Undefined();
+    value = rest->MaterializeProperty(index);
+  }
+  holder->SetHiddenValue(property, value);
+  return scope.Close(value);
+}
+
+static void
+RequestPropertySetter (Local<String> property, Local<Value> value, const AccessorInfo& info)
+{
+  HandleScope scope;
+  info.Holder()->SetHiddenValue(property, value);
+}
+
+// Response chunks up to RESPONSE_BUF_SIZE bytes come from a free list.
+// The oi_buf and its bytes are always a single allocation.
+#define RESPONSE_BUF_SIZE 4096
+
+static FreeList response_buf_pool(sizeof(oi_buf) + RESPONSE_BUF_SIZE, 256);
+static FreeList connection_pool(sizeof(Connection), 256);
+static FreeList request_pool(sizeof(HttpRequest), 1024);
+static FreeList read_buffer_pool(READ_BUFFER_SIZE, 16);
+
+void*
+Connection::operator new (size_t size) throw()
+{
+  assert(size == connection_pool.block_size());
+  return connection_pool.Alloc();
+}
+
+void
+Connection::operator delete (void *p)
+{
+  connection_pool.Free(p);
+}
+
+void*
+HttpRequest::operator new (size_t size) throw()
+{
+  assert(size == request_pool.block_size());
+  return request_pool.Alloc();
+}
+
+void
+HttpRequest::operator delete (void *p)
+{
+  request_pool.Free(p);
+}
+
+static void
+release_response_buf (oi_buf *buf)
+{
+  free(buf);
+}
+
+static void
+release_pooled_response_buf (oi_buf *buf)
+{
+  response_buf_pool.Free(buf);
+}
+
+static oi_buf*
+new_response_buf (size_t length)
+{
+  oi_buf *buf;
+
+  if (length > RESPONSE_BUF_SIZE) {
+    buf = static_cast<oi_buf*>(malloc(sizeof(oi_buf) + length));
+    if (buf == NULL) return NULL;
+    buf->release = release_response_buf;
+  } else {
+    buf = static_cast<oi_buf*>(response_buf_pool.Alloc());
+    if (buf == NULL) return NULL;
+    buf->release = release_pooled_response_buf;
+  }
+
+  buf->base = reinterpret_cast<char*>(buf + 1);
+  buf->len = length;
+  return buf;
+}
+
+static Local<Object>
+PoolStats (FreeList &pool)
+{
+  HandleScope scope;
+  Local<Object> stats = Object::New();
+  stats->Set(String::NewSymbol("hits"), Number::New(pool.hits));
+  stats->Set(String::NewSymbol("misses"), Number::New(pool.misses));
+  stats->Set(String::NewSymbol("free"), Integer::New(pool.nfree));
+  return scope.Close(stats);
+}
+
+// HTTPServer.poolStats() 
+static Handle<Value>
+PoolStatsCallback (const Arguments& args)
+{
+  HandleScope scope;
+  Local<Object> stats = Object::New();
+  stats->Set(String::NewSymbol("connections"), PoolStats(connection_pool));
+  stats->Set(String::NewSymbol("requests"), PoolStats(request_pool));
+  stats->Set(String::NewSymbol("buffers"), PoolStats(response_buf_pool));
+  stats->Set(String::NewSymbol("readBuffers"), PoolStats(read_buffer_pool));
+  return scope.Close(stats);
+}
+
+static const char*
+ReasonPhrase (int status)
+{
+  switch (status) {
+    case 100: return "Continue";
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 411: return "Length Required";
+    case 413: return "Request Entity Too Large";
+    case 414: return "Request-URI Too Long";
+    case 416: return "Requested Range Not Satisfiable";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+  }
+  return "Unknown";
+}
+
+static bool
+IsFramingHeader (Handle<String> name)
+{
+  int length = name->Length();
+  if (length != 14 && length != 17) return false;
+  String::AsciiValue s(name);
+  return strcasecmp(*s, "Content-Length") == 0 
+      || strcasecmp(*s, "Transfer-Encoding") == 0;
+}
+
+/* Formats the status line and the headers into a single buffer.
+ * headers is an object like { "Content-Type": "text/plain" }. A
+ * Content-Length header is added if content_length is not negative.
+ * When open is true the blank line ending the head is left off, so more
+ * headers can follow in another buffer. framed, if given, is set to
+ * whether headers has a Content-Length or Transfer-Encoding of its own.
+ */
+oi_buf*
+HttpRequest::FormatHeaders ( int status
+                           , Handle<Value> headers_value
+                           , off_t content_length
+                           , bool open
+                           , bool *framed
+                           )
+{
+  HandleScope scope;
+
+  bool http_1_0 = parser_info.version_major == 1 && parser_info.version_minor == 0;
+
+  char status_line[64];
+  int status_line_length = snprintf ( status_line
+                                    , sizeof status_line
+                                    , "HTTP/%s %d %s\r\n"
+                                    , http_1_0 ? "1.0" : "1.1"
+                                    , status
+                                    , ReasonPhrase(status)
+                                    );
+
+  char content_length_line[64];
+  int content_length_line_length = 0;
+  if (content_length >= 0) {
+    content_length_line_length = snprintf ( content_length_line
+                                          , sizeof content_length_line
+                                          , "Content-Length: %lld\r\n"
+                                          , (long long)content_length
+                                          );
+  }
+
+  // names and values, alternating
+  vector< Local<String> > strings;
+  size_t length = status_line_length + content_length_line_length + (open ? 0 : 2);
+  if (framed) *framed = false;
+
+  if (headers_value->IsObject()) {
+    Local<Object> header_object = headers_value->ToObject();
+    Local<Array> names = header_object->GetPropertyNames();
+    uint32_t n = names->Length();
+    strings.reserve(2*n);
+    for (uint32_t i = 0; i < n; i++) {
+      Local<String> name = names->Get(Integer::New(i))->ToString();
+      Local<String> value = header_object->Get(name)->ToString();
+      length += name->Utf8Length() + 2 + value->Utf8Length() + 2;
+      if (framed && IsFramingHeader(name)) *framed = true;
+      strings.push_back(name);
+      strings.push_back(value);
+    }
+  }
+
+  oi_buf *buf = new_response_buf(length);
+  if (buf == NULL) return NULL;
+
+  char *p = buf->base;
+  memcpy(p, status_line, status_line_length);
+  p += status_line_length;
+
+  for (size_t i = 0; i < strings.size(); i += 2) {
+    p += strings[i]->WriteUtf8(p, buf->base + length - p);
+    *p++ = ':';
+    *p++ = ' ';
+    p += strings[i+1]->WriteUtf8(p, buf->base + length - p);
+    *p++ = '\r';
+    *p++ = '\n';
+  }
+  memcpy(p, content_length_line, content_length_line_length);
+  p += content_length_line_length;
+  if (!open) {
+    *p++ = '\r';
+    *p++ = '\n';
+  }
+  assert(static_cast<size_t>(p - buf->base) == length);
+
+  return buf;
+}
+
+// A short framing line (chunk size, Content-Length, ...) in a buffer of
+// its own. It goes out in the same sendmsg() as the payload next to it.
+// Callers which get NULL close the connection: the payload must not go
+// out without its framing.
+static oi_buf*
+framing_buf (const char *format, unsigned long long value = 0)
+{
+  char line[64];
+  int length = snprintf(line, sizeof line, format, value);
+  oi_buf *buf = new_response_buf(length);
+  if (buf == NULL) return NULL;
+  memcpy(buf->base, line, length);
+  return buf;
+}
+
+// Requests with FRAMING_PENDING. Whatever has not been decided by the time
+// the loop is about to block goes out chunked, so streamed responses are
+// not held back.
+static list<HttpRequest*> unframed;
+static ev_prepare framing_watcher;
+
+static void
+on_framing (EV_P_ ev_prepare *watcher, int revents)
+{
+  while (!unframed.empty()) {
+    HttpRequest *request = unframed.front();
+    request->StartBody(false);
+    request->connection.Write();
+  }
+  ev_prepare_stop(EV_A_ watcher);
+}
+
+void
+HttpRequest::RespondHeaders (int status, Handle<Value> headers_value)
+{
+  bool framed;
+  oi_buf *buf = FormatHeaders(status, headers_value, -1, true, &framed);
+  if (buf == NULL) return;
+
+  bool bodiless = (status >= 100 && status < 200) || status == 204 
+               || status == 304 || parser_info.method == EBB_HEAD;
+
+  if (framed || bodiless || framing != FRAMING_NONE) {
+    Output(buf);
+    oi_buf *end = framing_buf("\r\n");
+    if (end == NULL) {
+      connection.Close();
+      return;
+    }
+    Output(end);
+    connection.Write();
+    return;
+  }
+
+  framing = FRAMING_PENDING;
+  response_head = buf;
+  unframed_it = unframed.insert(unframed.end(), this);
+  if (!ev_is_active(&framing_watcher))
+    ev_prepare_start(node_loop(), &framing_watcher);
+}
+
+/* Ends a FRAMING_PENDING head, now that the body is either complete
+ * (respond(null) came after at most one chunk) or known to come in
+ * pieces, and outputs the head and first chunk.
+ */
+void
+HttpRequest::StartBody (bool complete)
+{
+  assert(framing == FRAMING_PENDING);
+  unframed.erase(unframed_it);
+
+  oi_buf *head = response_head;
+  oi_buf *chunk = first_chunk;
+  response_head = first_chunk = NULL;
+
+  Output(head);
+
+  oi_buf *line;
+  if (complete) {
+    line = framing_buf("Content-Length: %llu\r\n\r\n", chunk ? chunk->len : 0);
+    framing = FRAMING_NONE;
+  } else if (parser_info.version_major > 1 || 
+      (parser_info.version_major == 1 && parser_info.version_minor >= 1)) {
+    line = framing_buf("Transfer-Encoding: chunked\r\n\r\n");
+    framing = FRAMING_CHUNKED;
+  } else {
+    // HTTP/1.0 has no chunked encoding. The body ends with the connection.
+    line = framing_buf("Connection: close\r\n\r\n");
+    framing = FRAMING_NONE;
+    force_close = true;
+  }
+  if (line == NULL) {
+    if (chunk && chunk->release) chunk->release(chunk);
+    connection.Close();
+    return;
+  }
+  Output(line);
+
+  if (chunk) {
+    if (framing == FRAMING_CHUNKED)
+      OutputChunk(chunk);
+    else
+      Output(chunk);
+  }
+}
+
+// Surrounds buf with a chunk size line and the CRLF ending the chunk. An
+// empty chunk would end the body and is dropped instead.
+void
+HttpRequest::OutputChunk (oi_buf *buf)
+{
+  if (buf->len == 0) {
+    if (buf->release) buf->release(buf);
+    return;
+  }
+  oi_buf *size_line = framing_buf("%llx\r\n", buf->len);
+  oi_buf *end = framing_buf("\r\n");
+  if (size_line == NULL || end == NULL) {
+    if (size_line) size_line->release(size_line);
+    if (end) end->release(end);
+    if (buf->release) buf->release(buf);
+    connection.Close();
+    return;
+  }
+  Output(size_line);
+  Output(buf);
+  Output(end);
+}
+
 void
 HttpRequest::Respond (Handle<Value> data)
 {
   if(data == Null()) {
+    if (framing == FRAMING_PENDING) {
+      StartBody(true);
+    } else if (framing == FRAMING_CHUNKED) {
+      oi_buf *last = framing_buf("0\r\n\r\n");
+      framing = FRAMING_NONE;
+      if (last == NULL) {
+        done = true;
+        connection.Close();
+        return;
+      }
+      Output(last);
+    }
     done = true;
+    connection.Write();
+    return;
+  }
+
+  oi_buf *buf;
+
+  if (Buffer::HasInstance(data)) {
+    Buffer *buffer = Buffer::Unwrap(data->ToObject());
+    buf = buffer->NewOiBuf();
+    if (buf == NULL) {
+      ThrowException(String::New("Out of memory"));
+      return;
+    }
+  } else if (framing == FRAMING_CHUNKED) {
+    // The chunk size line and ending go in the same buffer as the data.
+    Handle<String> s = data->ToString();
+    size_t l1 = s->Utf8Length(), l2;
+    if (l1 == 0) return;
+    char size_line[32];
+    int n = snprintf(size_line, sizeof size_line, "%llx\r\n", (unsigned long long)l1);
+    buf = new_response_buf(n + l1 + 2);
+    if (buf == NULL) {
+      ThrowException(String::New("Out of memory"));
+      return;
+    }
+    memcpy(buf->base, size_line, n);
+    l2 = s->WriteUtf8(buf->base + n, l1);
+    assert(l1 == l2);
+    buf->base[n + l1] = '\r';
+    buf->base[n + l1 + 1] = '\n';
+    Output(buf);
+    connection.Write();
+    return;
   } else {
     Handle<String> s = data->ToString();
-
     size_t l1 = s->Utf8Length(), l2;
-    oi_buf *buf = oi_buf_new2(l1);
+    buf = new_response_buf(l1);
+    if (buf == NULL) {
+      ThrowException(String::New("Out of memory"));
+      return;
+    }
     l2 = s->WriteUtf8(buf->base, l1);
     assert(l1 == l2);
+  }
+
+  if (framing == FRAMING_PENDING) {
+    if (first_chunk == NULL) {
+      first_chunk = buf;
+      return;
+    }
+    StartBody(false);
+  }
+
+  if (framing == FRAMING_CHUNKED)
+    OutputChunk(buf);
+  else
+    Output(buf);
+  connection.Write();
+}
+
+void
+HttpRequest::Output (oi_buf *buf)
+{
+  output.push_back(buf);
+  connection.Buffered(buf->len);
+}
+
+/* A file queued by request.sendFile(). Its buf sits in the request's
+ * output list like any other chunk, but has no bytes of its own (base is
+ * NULL). Connection::Write stops when it reaches one. Once everything
+ * before it has left the socket, the file is sent with eio_sendfile, one
+ * SENDFILE_CHUNK at a time.
+ *
+ * sendfile writes to a dup of the socket. If the connection closes in the
+ * middle of a transfer, the fd number cannot be handed to a new
+ * connection while the thread pool is still writing to it. The dup is
+ * never given to the loop though: write_watcher waits on the socket's own
+ * fd. epoll keeps a registration for as long as the file is open, so one
+ * on the dup would outlive close(out_fd) and make libev rebuild its
+ * whole epoll set when the stale event comes in.
+ */
+class FileSegment {
+public:
+  FileSegment (HttpRequest *request);
+  ~FileSegment ();
+
+  static FileSegment* FromBuf (oi_buf *buf)
+  {
+    return buf->base == NULL ? static_cast<FileSegment*>(buf->data) : NULL;
+  }
+
+  // Called from Connection::Write when this is the next thing to go out.
+  void Continue ();
+
+  oi_buf buf;
+  HttpRequest *request; // NULL once the request is gone
+  off_t offset;
+  off_t length; // -1 for the rest of the file
+  int status; // 0 if the caller writes the headers itself
+  bool chunked; // goes out as one chunk of a chunked body
+  Persistent<Value> headers;
+  Persistent<Function> callback;
+
+private:
+  static void AfterOpen (int errorno, CachedFile *file, void *data);
+  static int AfterSendfile (eio_req *req);
+  static void OnWritable (EV_P_ ev_io *watcher, int revents);
+  static void Release (oi_buf *buf);
+
+  void Send ();
+  void Finish (int errorno);
+
+  friend class HttpRequest;
+
+  CachedFile *file;
+  int out_fd;
+  bool opening;
+  bool sending; // an eio_sendfile is in flight
+  ev_io write_watcher;
+};
+
+FileSegment::FileSegment (HttpRequest *request_)
+{
+  request = request_;
+  offset = 0;
+  length = -1;
+  status = 0;
+  chunked = false;
+  file = NULL;
+  out_fd = -1;
+  opening = false;
+  sending = false;
+
+  buf.base = NULL;
+  buf.len = 0;
+  buf.data = this;
+  buf.release = FileSegment::Release;
+
+  ev_init(&write_watcher, FileSegment::OnWritable);
+  write_watcher.data = this;
+}
+
+FileSegment::~FileSegment ()
+{
+  ev_io_stop(node_loop(), &write_watcher);
+  if (out_fd >= 0) close(out_fd);
+  if (file) file->Unref();
+  headers.Dispose();
+  callback.Dispose();
+}
+
+// The request is going away before the file was sent. Callbacks from the
+// thread pool may still be on their way; they clean up.
+void
+FileSegment::Release (oi_buf *buf)
+{
+  FileSegment *segment = static_cast<FileSegment*>(buf->data);
+  segment->request = NULL;
+  if (!segment->opening && !segment->sending)
+    delete segment;
+}
+
+void
+HttpRequest::SendFile (Handle<String> path, Handle<Value> options, Handle<Value> callback)
+{
+  HandleScope scope;
+
+  FileSegment *segment = new FileSegment(this);
+
+  if (options->IsObject()) {
+    Local<Object> o = options->ToObject();
+    Local<Value> offset_value = o->Get(String::NewSymbol("offset"));
+    Local<Value> length_value = o->Get(String::NewSymbol("length"));
+    Local<Value> status_value = o->Get(String::NewSymbol("status"));
+    Local<Value> headers_value = o->Get(String::NewSymbol("headers"));
+
+    if (offset_value->IsNumber()) segment->offset = offset_value->IntegerValue();
+    if (length_value->IsNumber()) segment->length = length_value->IntegerValue();
+    if (status_value->IsNumber()) segment->status = status_value->Int32Value();
+    if (headers_value->IsObject()) 
+      segment->headers = Persistent<Value>::New(headers_value);
+  }
+  if (segment->offset < 0) segment->offset = 0;
+
+  if (callback->IsFunction())
+    segment->callback = Persistent<Function>::New(Handle<Function>::Cast(callback));
+
+  // The file's length is only known once it is open, then AfterOpen
+  // frames it as one chunk.
+  if (segment->status == 0) {
+    if (framing == FRAMING_PENDING) StartBody(false);
+    segment->chunked = framing == FRAMING_CHUNKED;
+  }
+
+  Output(&segment->buf);
+
+  String::Utf8Value path_s(path);
+  segment->opening = true;
+  node_open_cached(*path_s, FileSegment::AfterOpen, segment);
+}
+
+void
+FileSegment::AfterOpen (int errorno, CachedFile *file, void *data)
+{
+  FileSegment *segment = static_cast<FileSegment*>(data);
+  segment->opening = false;
+  segment->file = file;
+
+  if (segment->request == NULL) {
+    delete segment;
+    return;
+  }
+
+  if (errorno) {
+    segment->Finish(errorno);
+    return;
+  }
+
+  off_t size = file->st.st_size;
+  if (segment->offset > size) segment->offset = size;
+  if (segment->length < 0 || segment->offset + segment->length > size)
+    segment->length = size - segment->offset;
+
+  HttpRequest *request = segment->request;
+
+  if (segment->status) {
+    HandleScope scope;
+    oi_buf *head = request->FormatHeaders( segment->status
+                                         , segment->headers
+                                         , segment->length
+                                         );
+    if (head == NULL) {
+      Connection &connection = request->connection;
+      segment->Finish(ENOMEM);
+      connection.Close();
+      return;
+    }
+    list<oi_buf*>::iterator it = request->output.begin();
+    while (*it != &segment->buf) it++;
+    request->output.insert(it, head);
+    request->connection.Buffered(head->len);
+  } else if (segment->chunked && segment->length > 0) {
+    oi_buf *size_line = framing_buf("%llx\r\n", segment->length);
+    oi_buf *end = framing_buf("\r\n");
+    if (size_line == NULL || end == NULL) {
+      if (size_line) size_line->release(size_line);
+      if (end) end->release(end);
+      Connection &connection = request->connection;
+      segment->Finish(ENOMEM);
+      connection.Close();
+      return;
+    }
+    list<oi_buf*>::iterator it = request->output.begin();
+    while (*it != &segment->buf) it++;
+    request->output.insert(it, size_line);
+    request->output.insert(++it, end);
+    request->connection.Buffered(size_line->len + end->len);
+  }
+
+  request->connection.Write();
+}
+
+void
+FileSegment::Continue ()
+{
+  if (opening || sending || ev_is_active(&write_watcher))
+    return;
+  // Headers and earlier responses must be on the wire first.
+  if (!oi_queue_empty(&request->connection.socket.out_stream))
+    return;
+  Send();
+}
+
+void
+FileSegment::Send ()
+{
+  if (length == 0) {
+    Finish(0);
+    return;
+  }
+
+  if (out_fd < 0) {
+    out_fd = dup(request->connection.socket.fd);
+    if (out_fd < 0) {
+      Finish(errno);
+      return;
+    }
+  }
+
+  size_t chunk = length < SENDFILE_CHUNK ? length : SENDFILE_CHUNK;
+  sending = true;
+  node_eio_warmup();
+  eio_sendfile(out_fd, file->fd, offset, chunk, EIO_PRI_DEFAULT, FileSegment::AfterSendfile, this);
+}
+
+static bool
+Writable (int fd)
+{
+  struct pollfd pfd = { fd, POLLOUT, 0 };
+  return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT);
+}
+
+int
+FileSegment::AfterSendfile (eio_req *req)
+{
+  FileSegment *segment = static_cast<FileSegment*>(req->data);
+  segment->sending = false;
+
+  if (segment->request == NULL) {
+    delete segment;
+    return 0;
+  }
+
+  ssize_t sent = req->result;
+
+  if (sent < 0 && req->errorno != EAGAIN) {
+    segment->Finish(req->errorno);
+    return 0;
+  }
+
+  if (sent > 0) {
+    segment->offset += sent;
+    segment->length -= sent;
+    oi_socket_reset_timeout(&segment->request->connection.socket);
+  } else if (sent == 0 && segment->length > 0) {
+    // The file shrank underneath us.
+    segment->Finish(EIO);
+    return 0;
+  }
+
+  if (segment->length == 0) {
+    segment->Finish(0);
+  } else if (sent < 0 || static_cast<size_t>(sent) < req->size) {
+    // The socket buffer is full. 
+    ev_io_set(&segment->write_watcher, segment->request->connection.socket.fd, EV_WRITE);
+    ev_io_start(node_loop(), &segment->write_watcher);
+    // It may have drained since the pool thread saw it full, and an
+    // edge-triggered loop reported that while nobody was watching. A
+    // socket that is still full gets a new edge when it drains.
+    if (ev_edge_triggered(node_loop()) && Writable(segment->write_watcher.fd))
+      ev_feed_event(node_loop(), &segment->write_watcher, EV_WRITE);
+  } else {
+    segment->Send();
+  }
+  return 0;
+}
+
+void
+FileSegment::OnWritable (EV_P_ ev_io *watcher, int revents)
+{
+  FileSegment *segment = static_cast<FileSegment*>(watcher->data);
+  ev_io_stop(node_loop(), watcher);
+  segment->Send();
+}
+
+/* Takes the segment out of the request's output and tells javascript.
+ * If the file failed part way the response is unusable; the connection
+ * is closed. */
+void
+FileSegment::Finish (int errorno)
+{
+  HttpRequest *request = this->request;
+  Connection &connection = request->connection;
+  bool started = out_fd >= 0;
+
+  request->output.remove(&buf);
+
+  if (!callback.IsEmpty()) {
+    HandleScope scope;
+    TryCatch try_catch;
+    const int argc = 1;
+    Local<Value> argv[argc] = { Integer::New(errorno) };
+    callback->Call(request->js_object, argc, argv);
+    if(try_catch.HasCaught())
+      node_fatal_exception(try_catch);
+  }
+
+  delete this;
 
-    output.push_back(buf);
-  }
-  connection.Write();
+  if (errorno && started)
+    connection.Close();
+  else
+    connection.Write();
 }
 
 
+static inline void
+ExtendSpan (HttpRequest *request, HttpRequest::Span &span, const char *buf, size_t len)
+{
+  if (len == 0) return;
+  size_t offset = request->connection.Keep(buf);
+  if (span.length == 0) span.offset = offset;
+  span.length += len;
+}
+
 static void
 on_path (ebb_request *req, const char *buf, size_t len)
 {
   HttpRequest *request = static_cast<HttpRequest*> (req->data);
-  request->path.append(buf, len);
+  ExtendSpan(request, request->path, buf, len);
 }
 
 static void
 on_uri (ebb_request *req, const char *buf, size_t len)
 {
   HttpRequest *request = static_cast<HttpRequest*> (req->data);
-  request->uri.append(buf, len);
+  ExtendSpan(request, request->uri, buf, len);
 }
 
 static void
 on_query_string (ebb_request *req, const char *buf, size_t len)
 {
   HttpRequest *request = static_cast<HttpRequest*> (req->data);
-  request->query_string.append(buf, len);
+  ExtendSpan(request, request->query_string, buf, len);
 }
 
 static void
 on_fragment (ebb_request *req, const char *buf, size_t len)
 {
   HttpRequest *request = static_cast<HttpRequest*> (req->data);
-  request->fragment.append(buf, len);
+  ExtendSpan(request, request->fragment, buf, len);
 }
 
-static const char upcase[] =
-  "\0______________________________"
-  "_________________0123456789_____"
-  "__ABCDEFGHIJKLMNOPQRSTUVWXYZ____"
-  "__ABCDEFGHIJKLMNOPQRSTUVWXYZ____"
-  "________________________________"
-  "________________________________"
-  "________________________________"
-  "________________________________";
-
+// A header name or value which straddles two reads arrives in two
+// callbacks with the same header_index. The second read lands right
+// behind the first in the read buffer, so continuing extends the span.
 static void
 on_header_field (ebb_request *req, const char *buf, size_t len, int header_index)
 {
   HttpRequest *request = static_cast<HttpRequest*> (req->data);
+  if (len == 0) return;
 
-  char upbuf[len];
+  if (request->headers.size() != static_cast<size_t>(header_index) + 1) {
+    HttpRequest::HeaderSpan span = { 0, 0, 0, 0 };
+    request->headers.push_back(span);
+  }
+  HttpRequest::HeaderSpan &span = request->headers.back();
 
-  for(int i = 0; i < len; i++) 
-    upbuf[i] = upcase[buf[i]];
+  // The parser is done with these bytes; upcase them where they are.
+  char *name = const_cast<char*>(buf);
+  ebb_header_upcase(name, name, len);
 
-  if( request->header_fields.size() == header_index - 1) {
-    request->header_fields.back().append(upbuf, len);
-  } else { 
-    request->header_fields.push_back( string(upbuf, len) );
-  }
+  size_t offset = request->connection.Keep(buf);
+  if (span.field_length == 0) span.field_offset = offset;
+  span.field_length += len;
 }
 
 static void
 on_header_value (ebb_request *req, const char *buf, size_t len, int header_index)
 {
   HttpRequest *request = static_cast<HttpRequest*> (req->data);
+  if (len == 0) return;
 
-  if( request->header_values.size() == header_index - 1) {
-    request->header_values.back().append(buf, len);
-  } else { 
-    request->header_values.push_back( string(buf, len) );
-  }
+  if (request->headers.size() != static_cast<size_t>(header_index) + 1)
+    return; // value without a field?
+  HttpRequest::HeaderSpan &span = request->headers.back();
+
+  size_t offset = request->connection.Keep(buf);
+  if (span.value_length == 0) span.value_offset = offset;
+  span.value_length += len;
 }
 
 static void
@@ -259,6 +1468,9 @@ on_headers_complete (ebb_request *req)
   Handle<Value> argv[argc] = { js_request };
   Handle<Value> r = request->connection.js_onrequest->Call(Context::GetCurrent()->Global(), argc, argv);
 
+  // The read buffer is about to be reused.
+  request->Detach();
+
   if(try_catch.HasCaught())
     node_fatal_exception(try_catch);
 }
@@ -267,7 +1479,11 @@ static void
 on_request_complete (ebb_request *req)
 {
   HttpRequest *request = static_cast<HttpRequest*> (req->data);
-  request->MakeBodyCallback(NULL, 0); // EOF
+  Connection &connection = request->connection;
+  request->complete = true;
+  request->OnComplete();
+  // The response may have finished before the request did.
+  connection.Write();
 }
 
 static void
@@ -276,7 +1492,7 @@ on_body (ebb_request *req, const char *base, size_t length)
   HttpRequest *request = static_cast<HttpRequest*> (req->data);
 
   if(length)
-    request->MakeBodyCallback(base, length);
+    request->OnBody(base, length);
 }
 
 static ebb_request * on_request
@@ -285,8 +1501,7 @@ static ebb_request * on_request
 {
   Connection *connection = static_cast<Connection*> (data);
 
-  HttpRequest *request = new HttpRequest(*connection);
-  connection->AddRequest(request);
+  HttpRequest *request = connection->NewRequest();
   
   return &request->parser_info;
 }
@@ -316,17 +1531,65 @@ static void on_close
 
 HttpRequest::~HttpRequest ()
 {
-  HandleScope scope; // needed?
-  // delete a reference c++ HttpRequest
-  js_object->SetInternalField(0, Undefined());
-  js_object->Delete(respond_str);
-  // dispose of Persistent handle so that 
-  // it can be GC'd normally.
-  js_object.Dispose();
+  Reset();
 }
 
 HttpRequest::HttpRequest (Connection &c) : connection(c)
 {
+  framing = FRAMING_NONE;
+  Reset();
+}
+
+/* Returns the request to the state of a freshly constructed one. The
+ * string members keep their capacity which is the point of reusing. */
+void
+HttpRequest::Reset ()
+{
+  if (!js_object.IsEmpty()) {
+    HandleScope scope; // needed?
+    // Javascript may hold on to the request after the response, say to
+    // log it, so it keeps whatever it has not read yet.
+    KeepUnread();
+    // delete a reference c++ HttpRequest
+    js_object->SetInternalField(0, Undefined());
+    js_object->Delete(respond_str);
+    // dispose of Persistent handle so that 
+    // it can be GC'd normally.
+    js_object.Dispose();
+    js_object.Clear();
+  }
+
+  while (!output.empty()) {
+    oi_buf *buf = output.front();
+    output.pop_front();
+    if (buf->release) buf->release(buf);
+  }
+
+  if (framing == FRAMING_PENDING) {
+    unframed.erase(unframed_it);
+    if (response_head && response_head->release) 
+      response_head->release(response_head);
+    if (first_chunk && first_chunk->release) 
+      first_chunk->release(first_chunk);
+  }
+  framing = FRAMING_NONE;
+  response_head = first_chunk = NULL;
+  force_close = false;
+
+  Span empty = { 0, 0 };
+  path = query_string = fragment = uri = empty;
+  headers.clear();
+  head.clear();
+  detached = false;
+  materialized = 0;
+
+  if (body.capacity() > MAX_KEPT_BODY_CAPACITY)
+    string().swap(body);
+  else
+    body.clear();
+  body_limit = 0;
+  raw_body = false;
+
   ebb_request_init(&parser_info); 
   parser_info.on_path             = on_path;
   parser_info.on_query_string     = on_query_string;
@@ -340,6 +1603,95 @@ HttpRequest::HttpRequest (Connection &c) : connection(c)
   parser_info.data                = this;
 
   done = false;
+  complete = false;
+}
+
+/* Keeps a copy of a body chunk outside of the V8 heap. V8 frees it along
+ * with the string. */
+class ExternalBody : public String::ExternalAsciiStringResource {
+public:
+  ExternalBody (char *data, size_t length) : data_(data), length_(length) { }
+  ~ExternalBody () { free(data_); }
+  const char* data () const { return data_; }
+  size_t length () const { return length_; }
+private:
+  char *data_;
+  size_t length_;
+};
+
+static bool
+IsAscii (const char *base, size_t length)
+{
+  const unsigned char *p = reinterpret_cast<const unsigned char*>(base);
+  for (size_t i = 0; i < length; i++)
+    if (p[i] & 0x80) return false;
+  return true;
+}
+
+Local<Value>
+HttpRequest::BodyChunk (const char *base, size_t length)
+{
+  HandleScope scope;
+
+  if (raw_body) {
+    Buffer *buffer = Buffer::New(base, length);
+    if (buffer == NULL) 
+      return Local<Value>::New(Null());
+    return scope.Close(buffer->handle());
+  }
+
+  if (IsAscii(base, length)) {
+    if (length < EXTERNAL_BODY_THRESHOLD)
+      return scope.Close(String::New(base, length));
+
+    char *copy = static_cast<char*>(malloc(length));
+    if (copy == NULL) 
+      return Local<Value>::New(Null());
+    memcpy(copy, base, length);
+    return scope.Close(String::NewExternal(new ExternalBody(copy, length)));
+  }
+
+  // V8 only takes 7-bit data as one byte per character, so anything else
+  // is widened to keep bytes and characters one to one.
+  uint16_t *chars = static_cast<uint16_t*>(malloc(length * sizeof(uint16_t)));
+  if (chars == NULL) 
+    return Local<Value>::New(Null());
+  const unsigned char *bytes = reinterpret_cast<const unsigned char*>(base);
+  for (size_t i = 0; i < length; i++)
+    chars[i] = bytes[i];
+  Local<String> chunk = String::New(chars, length);
+  free(chars);
+  return scope.Close(chunk);
+}
+
+void
+HttpRequest::OnBody (const char *base, size_t length)
+{
+  if (body_limit == 0) {
+    MakeBodyCallback(base, length);
+    return;
+  }
+
+  if (body.length() + length <= body_limit) {
+    body.append(base, length);
+    return;
+  }
+
+  // Too big to collect. Stream from here on.
+  body_limit = 0;
+  if (!body.empty()) {
+    MakeBodyCallback(body.data(), body.length());
+    string().swap(body);
+  }
+  MakeBodyCallback(base, length);
+}
+
+void
+HttpRequest::OnComplete ()
+{
+  if (body_limit && !body.empty())
+    MakeBodyCallback(body.data(), body.length());
+  MakeBodyCallback(NULL, 0); // EOF
 }
 
 void
@@ -356,16 +1708,7 @@ HttpRequest::MakeBodyCallback (const char *base, size_t length)
   Handle<Value> argv[argc];
   
   if(length) {
-    // TODO ByteArray?
-    //
-    
-    uint16_t expanded_base[length];
-    for(int i = 0; i < length; i++) {
-      expanded_base[i] = base[i];
-    }
-
-    Handle<String> chunk = String::New(expanded_base, length);
-    argv[0] = chunk;
+    argv[0] = BodyChunk(base, length);
   } else {
     argv[0] = Null();
   }
@@ -376,76 +1719,153 @@ HttpRequest::MakeBodyCallback (const char *base, size_t length)
     node_fatal_exception(try_catch);
 }
 
-Local<Object>
-HttpRequest::CreateJSObject ()
+// The properties which are spans of the request head.
+#define HEAD_PROPERTIES ( (1 << PATH_PROPERTY)         \
+                        | (1 << URI_PROPERTY)          \
+                        | (1 << QUERY_STRING_PROPERTY) \
+                        | (1 << FRAGMENT_PROPERTY)     \
+                        | (1 << HEADERS_PROPERTY)      \
+                        )
+#define ALL_PROPERTIES ((1 << (HEADERS_PROPERTY + 1)) - 1)
+
+const char*
+HttpRequest::HeadBase ()
 {
-  HandleScope scope;
+  return detached ? head.data() : connection.read_buffer;
+}
 
-  if (request_template.IsEmpty()) {
-    Handle<ObjectTemplate> raw_template = ObjectTemplate::New();
-    raw_template->SetInternalFieldCount(1);
-    raw_template->Set(respond_str, FunctionTemplate::New(RespondCallback));
+// Moves every span shift bytes towards the front.
+void
+HttpRequest::Rebase (size_t shift)
+{
+  Span *spans[] = { &path, &query_string, &fragment, &uri };
+  for (int i = 0; i < 4; i++)
+    if (spans[i]->length) spans[i]->offset -= shift;
 
-    request_template = Persistent<ObjectTemplate>::New(raw_template);
+  for (size_t i = 0; i < headers.size(); i++) {
+    if (headers[i].field_length) headers[i].field_offset -= shift;
+    if (headers[i].value_length) headers[i].value_offset -= shift;
   }
+}
 
-  // Create an empty http request wrapper.
-  Handle<Object> result = request_template->NewInstance();
+/* Called once the request head is complete and javascript has had its
+ * first look at the request. Anything it did not read yet is copied out
+ * of the connection's read buffer, which is reused for the next read.
+ */
+void
+HttpRequest::Detach ()
+{
+  size_t from = connection.keep_from;
+  connection.keep_from = NO_SPAN;
+  detached = true;
 
-  // Wrap the raw C++ pointer in an External so it can be referenced
-  // from within JavaScript.
-  Handle<External> request_ptr = External::New(this);
+  if (from == NO_SPAN || (materialized & HEAD_PROPERTIES) == HEAD_PROPERTIES)
+    return;
 
-  // Store the request pointer in the JavaScript wrapper.
-  result->SetInternalField(0, request_ptr);
+  size_t end = from;
+  Span *spans[] = { &path, &query_string, &fragment, &uri };
+  for (int i = 0; i < 4; i++)
+    end = max(end, spans[i]->offset + spans[i]->length);
+  for (size_t i = 0; i < headers.size(); i++) {
+    end = max(end, headers[i].field_offset + headers[i].field_length);
+    end = max(end, headers[i].value_offset + headers[i].value_length);
+  }
+
+  head.assign(connection.read_buffer + from, end - from);
+  Rebase(from);
+}
 
-  result->Set ( path_str
-              , String::New(path.c_str(), path.length())
-              );
+// Takes over a request parsed on an HttpWorker. Its spans already point
+// into its own head.
+void
+HttpRequest::Adopt (ParsedRequest *parsed)
+{
+  head.swap(parsed->head);
+  headers.swap(parsed->headers);
+  path = parsed->path;
+  query_string = parsed->query_string;
+  fragment = parsed->fragment;
+  uri = parsed->uri;
+  detached = true;
+
+  parser_info.method            = parsed->info.method;
+  parser_info.transfer_encoding = parsed->info.transfer_encoding;
+  parser_info.expect_continue   = parsed->info.expect_continue;
+  parser_info.version_major     = parsed->info.version_major;
+  parser_info.version_minor     = parsed->info.version_minor;
+  parser_info.number_of_headers = parsed->info.number_of_headers;
+  parser_info.keep_alive        = parsed->info.keep_alive;
+  parser_info.content_length    = parsed->info.content_length;
+  parser_info.body_read         = parsed->info.body_read;
+}
 
-  result->Set ( uri_str
-              , String::New(uri.c_str(), uri.length())
-              );
+Local<Value>
+HttpRequest::MaterializeProperty (int property)
+{
+  HttpSpan line[] = { path, uri, query_string, fragment };
+  materialized |= 1 << property;
+  return NewRequestProperty(property, HeadBase(), line, headers, parser_info);
+}
 
-  result->Set ( query_string_str
-              , String::New(query_string.c_str(), query_string.length())
-              );
+// Hands what javascript has not read yet over to a DetachedHead, unless
+// it has read everything.
+void
+HttpRequest::KeepUnread ()
+{
+  if ((materialized & ALL_PROPERTIES) == ALL_PROPERTIES)
+    return;
 
-  result->Set ( fragment_str
-              , String::New(fragment.c_str(), fragment.length())
-              );
+  if (!detached)
+    Detach();
 
-  result->Set ( method_str
-              , GetMethodString(parser_info.method)
-              );
+  HandleScope scope;
+  new DetachedHead(this, js_object);
+}
 
-  char version[10];
-  snprintf ( version
-           , 10 // big enough? :)
-           , "%d.%d"
-           , parser_info.version_major
-           , parser_info.version_minor
-           ); 
-  result->Set ( http_version_str
-              , String::New(version)
-              );
+DetachedHead::DetachedHead (HttpRequest *request, Handle<Object> object)
+{
+  head.swap(request->head);
+  headers.swap(request->headers);
+  line[0] = request->path;
+  line[1] = request->uri;
+  line[2] = request->query_string;
+  line[3] = request->fragment;
+  info = request->parser_info;
+
+  object->SetInternalField(1, External::New(this));
+  handle_ = Persistent<Object>::New(object);
+  handle_.MakeWeak(this, DetachedHead::MakeWeak);
+}
 
-  
-  Handle<Object> headers = Object::New();
-  list<string>::iterator field_iterator = header_fields.begin();
-  list<string>::iterator value_iterator = header_values.begin();
-  while( value_iterator != header_values.end() ) {
-    string &f = *field_iterator;
-    string &v = *value_iterator;
-    
-    headers->Set( String::NewSymbol(f.c_str(), f.length())
-                , String::New(v.c_str(), v.length() ) 
-                );
-
-    field_iterator++;
-    value_iterator++;
-  }
-  result->Set(headers_str, headers);
+void
+DetachedHead::MakeWeak (Persistent<Value> _, void *data)
+{
+  DetachedHead *rest = static_cast<DetachedHead*> (data);
+  rest->handle_.Dispose();
+  rest->handle_.Clear();
+  delete rest;
+}
+
+Local<Value>
+DetachedHead::MaterializeProperty (int property)
+{
+  return NewRequestProperty(property, head.data(), line, headers, info);
+}
+
+Local<Object>
+HttpRequest::CreateJSObject ()
+{
+  HandleScope scope;
+
+  // Create an empty http request wrapper.
+  Handle<Object> result = request_template->NewInstance();
+
+  // Wrap the raw C++ pointer in an External so it can be referenced
+  // from within JavaScript.
+  Handle<External> request_ptr = External::New(this);
+
+  // Store the request pointer in the JavaScript wrapper.
+  result->SetInternalField(0, request_ptr);
 
   js_object = Persistent<Object>::New(result);
   // XXX does the request's js_object need a MakeWeak callback?
@@ -456,34 +1876,58 @@ HttpRequest::CreateJSObject ()
 }
 
 
-static oi_socket*
-on_connection (oi_server *_server, struct sockaddr *addr, socklen_t len)
+Connection*
+HttpServer::NewConnection ()
 {
   HandleScope scope;
 
-  HttpServer *server = static_cast<HttpServer*> (_server->data);
-
-  Handle<Value> callback_v = server->Callback();
+  Handle<Value> callback_v = Callback();
 
   if(callback_v == Undefined())
     return NULL;
 
-  Connection *connection = new Connection();
+  Connection *connection = new Connection( response_buffer_limit
+                                         , idle_timeout
+                                         );
 
   Handle<Function> f = Handle<Function>::Cast(callback_v);
   connection->js_onrequest = Persistent<Function>::New(f);
 
-  return &connection->socket;
+  return connection;
+}
+
+static oi_socket*
+on_connection (oi_server *_server, struct sockaddr *addr, socklen_t len)
+{
+  HttpServer *server = static_cast<HttpServer*> (_server->data);
+  Connection *connection = server->NewConnection();
+  return connection ? &connection->socket : NULL;
 }
 
-Connection::Connection ()
+Connection::Connection (size_t response_buffer_limit_, double idle_timeout)
 {
-  oi_socket_init (&socket, 30.0); // TODO make timeout adjustable
+  response_buffer_limit = response_buffer_limit_;
+  buffered_bytes = 0;
+  socket_bytes = 0;
+  reading_paused = false;
+  close_on_drain = false;
+  writing = false;
+  write_again = false;
+  remote = NULL;
+
+  read_buffer = NULL;
+  read_buffer_size = 0;
+  read_used = 0;
+  keep_from = NO_SPAN;
+
+  oi_socket_init (&socket, idle_timeout);
+  socket.wheel      = node_idle_wheel();
+  socket.read_buffer = Connection::ReadBuffer;
   socket.on_read    = on_read;
   socket.on_error   = NULL;
   socket.on_close   = on_close;
   socket.on_timeout = NULL;
-  socket.on_drain   = NULL;
+  socket.on_drain   = Connection::OnDrain;
   socket.data       = this;
 
   ebb_request_parser_init (&parser);
@@ -500,61 +1944,276 @@ Connection::~Connection ()
   for(it = requests.begin(); it != requests.end(); it++)
     delete *it;
 
-  for(it = finished_requests.begin(); it != finished_requests.end(); it++)
+  for(it = free_requests.begin(); it != free_requests.end(); it++)
     delete *it;
+
+  ReleaseReadBuffer();
+}
+
+void*
+Connection::ReadBuffer (oi_socket *socket, size_t *size)
+{
+  Connection *connection = static_cast<Connection*> (socket->data);
+  if (!connection->Reserve(MIN_READ_SPACE))
+    return NULL;
+  *size = connection->read_buffer_size - connection->read_used;
+  return connection->read_buffer + connection->read_used;
+}
+
+// Makes room for want more bytes after read_used. Bytes in front of
+// keep_from are no longer referenced and are dropped first; if that is
+// not enough the buffer grows. Fails when out of memory or when the head
+// being parsed is longer than MAX_HEAD_SIZE.
+bool
+Connection::Reserve (size_t want)
+{
+  if (read_buffer == NULL) {
+    read_buffer = static_cast<char*>(read_buffer_pool.Alloc());
+    if (read_buffer == NULL) return false;
+    read_buffer_size = READ_BUFFER_SIZE;
+    read_used = 0;
+  }
+
+  if (keep_from == NO_SPAN) {
+    read_used = 0;
+  } else {
+    if (read_used - keep_from > MAX_HEAD_SIZE)
+      return false;
+
+    if (read_buffer_size - read_used < want && keep_from > 0) {
+      assert(parser.current_request);
+      HttpRequest *request = static_cast<HttpRequest*>(parser.current_request->data);
+      memmove(read_buffer, read_buffer + keep_from, read_used - keep_from);
+      read_used -= keep_from;
+      request->Rebase(keep_from);
+      keep_from = 0;
+    }
+  }
+
+  if (read_buffer_size - read_used < want) {
+    size_t size = read_buffer_size;
+    while (size - read_used < want) size *= 2;
+    char *bigger = static_cast<char*>(malloc(size));
+    if (bigger == NULL) return false;
+    memcpy(bigger, read_buffer, read_used);
+    size_t used = read_used;
+    ReleaseReadBuffer();
+    read_buffer = bigger;
+    read_buffer_size = size;
+    read_used = used;
+  }
+
+  return true;
+}
+
+void
+Connection::ReleaseReadBuffer ()
+{
+  if (read_buffer == NULL) return;
+  if (read_buffer_size == READ_BUFFER_SIZE)
+    read_buffer_pool.Free(read_buffer);
+  else
+    free(read_buffer);
+  read_buffer = NULL;
+  read_buffer_size = 0;
+  read_used = 0;
+}
+
+size_t
+Connection::Keep (const char *p)
+{
+  size_t offset = p - read_buffer;
+  if (keep_from == NO_SPAN) keep_from = offset;
+  return offset;
 }
 
 void
 Connection::Parse(const void *buf, size_t count)
 {
-  // FIXME change ebb_request_parser to have void* arg
-  ebb_request_parser_execute ( &parser
-                             , static_cast<const char*> (buf) 
-                             , count
-                             );
+  const char *data = static_cast<const char*> (buf);
+
+  // Secure sockets (or a failed ReadBuffer) still read onto the stack.
+  if (read_buffer == NULL || data != read_buffer + read_used) {
+    if (!Reserve(count)) {
+      fprintf(stderr, "request head too large, closing connection\n");
+      oi_socket_close(&socket);
+      return;
+    }
+    memcpy(read_buffer + read_used, data, count);
+  }
+  data = read_buffer + read_used;
+  read_used += count;
+
+  ebb_request_parser_execute(&parser, data, count);
 
   if(ebb_request_parser_has_error(&parser)) {
     fprintf(stderr, "parse error closing connection\n");
     oi_socket_close(&socket);
   }
+
+  // Nothing refers to the buffer until the next read.
+  if (keep_from == NO_SPAN)
+    ReleaseReadBuffer();
+}
+
+// A request an HttpWorker has read in full. It goes through the same
+// callbacks as one parsed here.
+void
+Connection::Deliver (ParsedRequest *parsed)
+{
+  HttpRequest *request = NewRequest();
+  request->Adopt(parsed);
+
+  ebb_request *info = &request->parser_info;
+  info->on_headers_complete(info);
+  if (!parsed->body.empty())
+    info->on_body(info, parsed->body.data(), parsed->body.length());
+  info->on_complete(info);
+
+  delete parsed;
 }
 
-void 
-Connection::AddRequest(HttpRequest *request)
+HttpRequest*
+Connection::NewRequest ()
 {
+  HttpRequest *request;
+  if (free_requests.empty()) {
+    request = new HttpRequest(*this);
+  } else {
+    request = free_requests.front();
+    free_requests.pop_front();
+  }
   requests.push_back(request);
+  return request;
+}
+
+void
+Connection::Recycle (HttpRequest *request)
+{
+  if (free_requests.size() < MAX_FREE_REQUESTS) {
+    request->Reset();
+    free_requests.push_back(request);
+  } else {
+    delete request;
+  }
+}
+
+// Bytes of response data this connection is holding in memory.
+size_t
+Connection::Backlog ()
+{
+  return buffered_bytes + (socket_bytes - socket.written);
+}
+
+void
+Connection::UpdateReadState ()
+{
+  if (close_on_drain || remote) return;
+
+  size_t backlog = Backlog();
+
+  if (!reading_paused && backlog > response_buffer_limit) {
+    oi_socket_read_stop(&socket);
+    reading_paused = true;
+  } else if (reading_paused && backlog <= response_buffer_limit / 2) {
+    oi_socket_read_start(&socket);
+    reading_paused = false;
+  }
+}
+
+void
+Connection::OnDrain (oi_socket *socket)
+{
+  Connection *connection = static_cast<Connection*> (socket->data);
+  if (connection->close_on_drain) {
+    oi_socket_close(socket);
+    return;
+  }
+  // A file may be waiting for the socket to drain.
+  connection->Write();
 }
 
+/* Moves finished output to the socket, in request order. A file being
+ * sent can call back into javascript from in here, which may call Write()
+ * again; that only asks the outer call to go round once more. */
 void
 Connection::Write ( ) 
 {
-  if(requests.size() == 0)
+  if (writing) {
+    write_again = true;
     return;
+  }
+  writing = true;
+
+  do {
+    write_again = false;
+    WriteRequests();
+  } while (write_again);
 
-  HttpRequest *request = requests.front(); 
+  writing = false;
 
-  while(request->output.size() > 0) {
-    oi_buf *buf = request->output.front();
-    oi_socket_write(&socket, buf);
-    request->output.pop_front();
+  if (remote) return;
+
+  if (close_on_drain && oi_queue_empty(&socket.out_stream)) {
+    oi_socket_close(&socket);
+    return;
   }
 
-  if(request->done) {
-    if(!ebb_request_should_keep_alive(&request->parser_info)) {
-      socket.on_drain = oi_socket_close;
+  UpdateReadState();
+}
+
+void
+Connection::WriteRequests ( ) 
+{
+  while (!requests.empty()) {
+    HttpRequest *request = requests.front(); 
+
+    while(!request->output.empty()) {
+      oi_buf *buf = request->output.front();
+      FileSegment *segment = FileSegment::FromBuf(buf);
+      if (segment) {
+        segment->Continue();
+        break;
+      }
+      request->output.pop_front();
+      buffered_bytes -= buf->len;
+      if (remote) {
+        remote->worker->Write(remote, buf);
+      } else {
+        socket_bytes += buf->len;
+        oi_socket_write(&socket, buf);
+      }
+    }
+
+    // A file is still being sent.
+    if (!request->output.empty())
+      break;
+
+    // The parser still points at requests which are not complete.
+    if (!request->done || !request->complete)
+      break;
+
+    if(request->force_close || !ebb_request_should_keep_alive(&request->parser_info)) {
+      if (remote) {
+        if (!close_on_drain) remote->worker->End(remote);
+      } else {
+        oi_socket_read_stop(&socket);
+      }
+      close_on_drain = true;
     } 
 
     requests.pop_front();
-    finished_requests.push_back(request);
-
-    Write();
+    Recycle(request);
   }
 }
 
 void
 Connection::Close ( ) 
 {
-  oi_socket_close(&socket);
+  if (remote)
+    remote->worker->Close(remote);
+  else
+    oi_socket_close(&socket);
 }
 
 static void
@@ -564,11 +2223,22 @@ server_destroy (Persistent<Value> _, void *data)
   delete server;
 }
 
-HttpServer::HttpServer (Handle<Object> _js_server)
+HttpServer::HttpServer (Handle<Object> _js_server, int backlog, int accept_batch)
 {
-  oi_server_init(&server, 1024);
+  oi_server_init(&server, backlog);
+  server.accept_batch = accept_batch;
+  response_buffer_limit = DEFAULT_RESPONSE_BUFFER_LIMIT;
+  request_buffer_limit = DEFAULT_REQUEST_BUFFER_LIMIT;
+  idle_timeout = DEFAULT_IDLE_TIMEOUT;
+  threads = 0;
+  accepting = 0;
+  resolving = false;
+  resolve_async = false;
+  start_error = 0;
   server.on_connection = on_connection;
   server.data = this;
+  ev_async_init(&inbox_watcher, HttpServer::OnMessages);
+  inbox_watcher.data = this;
   HandleScope scope;
   js_server = Persistent<Object>::New (_js_server);
   // are we ever going to need this external?
@@ -583,23 +2253,199 @@ HttpServer::~HttpServer ()
   js_server.Clear(); // necessary? 
 }
 
+void
+HttpServer::Resolve (const char *host, const char *port)
+{
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  // Don't let the server be collected while the lookup is in flight.
+  resolving = true;
+  resolve_async = false;
+  start_error = 0;
+  js_server.ClearWeak();
+  node_resolve(host, port, &hints, HttpServer::AfterResolve, this);
+  if (resolving)
+    resolve_async = true;
+}
+
+void
+HttpServer::AfterResolve (int status, struct addrinfo *servinfo, void *data)
+{
+  HttpServer *server = static_cast<HttpServer*> (data);
+  server->resolving = false;
+  server->js_server.MakeWeak(server, server_destroy);
+
+  HandleScope scope;
+  int r = status == 0 ? server->Start(servinfo) : -1;
+  server->start_error = r;
+  if (r == 0 || !server->resolve_async)
+    return;
+
+  // Too late to throw. Tell onError, if there is one, as Server does.
+  const char *error = status != 0 ? "Error looking up hostname"
+                                  : "Error listening on port";
+  Local<Value> onerror_value = server->js_server->Get(on_error_str);
+  if (!onerror_value->IsFunction()) {
+    fprintf(stderr, "HTTPServer: %s\n", error);
+    return;
+  }
+  Local<Function> onerror = Local<Function>::Cast(onerror_value);
+
+  TryCatch try_catch;
+  const int argc = 1;
+  Local<Value> argv[argc] = { String::New(error) };
+  onerror->Call(server->js_server, argc, argv);
+  if (try_catch.HasCaught())
+    node_fatal_exception(try_catch);
+}
+
 int
 HttpServer::Start(struct addrinfo *servinfo) 
 {
+  // Each worker process binds its own socket to the same port.
+  if (node_worker() > 0)
+    server.reuseport = 1;
+
   int r = oi_server_listen(&server, servinfo);
-  if(r == 0)
-    oi_server_attach(&server, node_loop());
-  return r;
+  if(r != 0)
+    return r;
+
+  if (threads > 0)
+    return StartThreads();
+
+  oi_server_attach(&server, node_loop());
+  return 0;
+}
+
+/* The workers accept from the socket just opened; this thread only runs
+ * javascript. The server object stays alive for good: its connections are
+ * on other threads where V8 cannot see them.
+ */
+int
+HttpServer::StartThreads ()
+{
+  ev_async_start(node_loop(), &inbox_watcher);
+
+  for (int i = 0; i < threads; i++) {
+    HttpWorker *worker = new HttpWorker( server.fd
+                                       , server.accept_batch
+                                       , idle_timeout
+                                       , request_buffer_limit
+                                       , &inbox
+                                       , node_loop()
+                                       , &inbox_watcher
+                                       );
+    if (worker->Start() != 0) {
+      delete worker;
+      break;
+    }
+    http_workers.push_back(worker);
+  }
+
+  if (http_workers.empty()) {
+    perror("HTTPServer: could not start threads");
+    ev_async_stop(node_loop(), &inbox_watcher);
+    oi_server_close(&server);
+    return -1;
+  }
+
+  accepting = http_workers.size();
+  js_server.ClearWeak();
+  return 0;
 }
 
 void
 HttpServer::Stop() 
 {
+  // The listening socket is closed once no worker is watching it.
+  if (!http_workers.empty()) {
+    for (size_t i = 0; i < http_workers.size(); i++)
+      http_workers[i]->Stop();
+    return;
+  }
   oi_server_close (&server);
   oi_server_detach (&server);
 }
 
-/* This constructor takes 2 arguments: host, port. */
+void
+HttpServer::OnMessages (EV_P_ ev_async *watcher, int revents)
+{
+  HttpServer *server = static_cast<HttpServer*> (watcher->data);
+  HttpMessage *message = server->inbox.TakeAll();
+
+  while (message) {
+    HttpMessage *next = message->next;
+    WorkerConnection *remote = message->connection;
+    Connection *connection;
+
+    // A RELEASE may come after the worker has deleted remote, so only
+    // messages about a live connection look at it.
+    switch (message->type) {
+      case HttpMessage::REQUEST:
+        connection = static_cast<Connection*>(remote->local);
+        if (connection == NULL) {
+          connection = server->NewConnection();
+          if (connection) {
+            connection->remote = remote;
+            remote->local = connection;
+          }
+        }
+        if (connection) {
+          connection->Deliver(message->request);
+        } else {
+          delete message->request;
+          message->worker->Close(remote);
+        }
+        message->worker->Taken(message);
+        break;
+
+      case HttpMessage::CLOSED:
+        connection = static_cast<Connection*>(remote->local);
+        if (connection) delete connection;
+        remote->local = NULL;
+        message->worker->Released(remote);
+        delete message;
+        break;
+
+      case HttpMessage::RELEASE:
+        if (message->buf->release) message->buf->release(message->buf);
+        delete message;
+        break;
+
+      case HttpMessage::STOPPED:
+        if (--server->accepting == 0)
+          oi_server_close(&server->server);
+        delete message;
+        break;
+
+      default:
+        assert(0 && "message for a worker");
+        delete message;
+    }
+
+    message = next;
+  }
+}
+
+/* This constructor takes 3 arguments: host, port, onrequest. An optional
+ * fourth argument is an options object:
+ *   { backlog: 1024, threads: 4, acceptBatch: 64,
+ *     responseBufferLimit: 131072, requestBufferLimit: 1048576,
+ *     timeout: 30000 }
+ * timeout is how long, in milliseconds, a connection may be idle.
+ * threads starts that many event loop threads which accept, read, parse
+ * and write; requests reach javascript here once they are complete, body
+ * and all. request.sendFile() is not available then. requestBufferLimit
+ * caps the size of a request, and of the requests a connection has on
+ * their way to javascript; a thread stops reading the connection at the
+ * limit.
+ * A host name is looked up in the thread pool. If that or listening fails
+ * afterwards, server.onError(message) is called, as for a Server.
+ */
 static Handle<Value>
 newHTTPHttpServer (const Arguments& args) 
 {
@@ -608,43 +2454,53 @@ newHTTPHttpServer (const Arguments& args)
 
   HandleScope scope;
 
-  char *host = NULL; 
-  String::AsciiValue host_v(args[0]->ToString());
-  if(args[0]->IsString()) {
-    host = *host_v;
-  }
+  String::AsciiValue host_v(args[0]->IsString() ? args[0] : Handle<Value>());
+  char *host = *host_v; // NULL without a host
   String::AsciiValue port(args[1]->ToString());
 
   Handle<Function> onrequest = Handle<Function>::Cast(args[2]);
   args.This()->Set(on_request_str, onrequest);
 
-  // get addrinfo for localhost, PORT
-  struct addrinfo *servinfo;
-  struct addrinfo hints;
-  memset(&hints, 0, sizeof hints);
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = AI_PASSIVE;
-  // FIXME BLOCKING
-  int r = getaddrinfo(host, *port, &hints, &servinfo);
-  if (r != 0)
-    return Undefined(); // XXX raise error?
-
-  //
-  //
-  //
-  // TODO host is ignored for now assumed localhost
-  //
-  //
-  //
-  //
+  // defaults
+  int backlog = 1024;
+  int threads = 0;
+  int accept_batch = 64;
+  size_t response_buffer_limit = DEFAULT_RESPONSE_BUFFER_LIMIT;
+  size_t request_buffer_limit = DEFAULT_REQUEST_BUFFER_LIMIT;
+  double idle_timeout = DEFAULT_IDLE_TIMEOUT;
+
+  if (args.Length() > 3 && args[3]->IsObject()) {
+    Local<Object> options = args[3]->ToObject();
+    Local<Value> backlog_value = options->Get(String::NewSymbol("backlog"));
+    Local<Value> threads_value = options->Get(String::NewSymbol("threads"));
+    Local<Value> accept_batch_value = options->Get(String::NewSymbol("acceptBatch"));
+    Local<Value> limit_value = options->Get(String::NewSymbol("responseBufferLimit"));
+    Local<Value> request_limit_value = options->Get(String::NewSymbol("requestBufferLimit"));
+    Local<Value> timeout_value = options->Get(String::NewSymbol("timeout"));
+
+    if (backlog_value->IsNumber()) backlog = backlog_value->IntegerValue();
+    if (threads_value->IsNumber()) threads = threads_value->IntegerValue();
+    if (threads < 0) threads = 0;
+    if (accept_batch_value->IsNumber()) accept_batch = accept_batch_value->IntegerValue();
+    if (accept_batch < 1) accept_batch = 1;
+    if (limit_value->IsNumber()) response_buffer_limit = limit_value->IntegerValue();
+    if (request_limit_value->IsNumber()) request_buffer_limit = request_limit_value->IntegerValue();
+    if (timeout_value->IsNumber()) idle_timeout = timeout_value->NumberValue() / 1000;
+  }
 
-  HttpServer *server = new HttpServer(args.This());
+  HttpServer *server = new HttpServer(args.This(), backlog, accept_batch);
   if(server == NULL)
     return Undefined(); // XXX raise error?
-
-  r = server->Start(servinfo);
-  if (r != 0)
+  server->response_buffer_limit = response_buffer_limit;
+  server->request_buffer_limit = request_buffer_limit;
+  server->idle_timeout = idle_timeout;
+  server->threads = threads;
+
+  // Names are looked up in the thread pool and the server starts
+  // listening once that is done. A numeric or empty host is resolved
+  // here and then errors are reported as before.
+  server->Resolve(host, *port);
+  if (server->start_error != 0)
     return Undefined(); // XXX raise error?
 
   return args.This();
@@ -659,6 +2515,7 @@ NodeInit_http (Handle<Object> target)
   server_t->InstanceTemplate()->SetInternalFieldCount(1);
   
   server_t->Set("INVALID_STATE_ERR", Integer::New(INVALID_STATE_ERR));
+  server_t->Set("poolStats", FunctionTemplate::New(PoolStatsCallback));
 
   target->Set(String::New("HTTPServer"), server_t->GetFunction());
 
@@ -672,7 +2529,11 @@ NodeInit_http (Handle<Object> target)
 
   on_request_str = Persistent<String>::New( String::NewSymbol("onrequest") );
   on_body_str    = Persistent<String>::New( String::NewSymbol("onbody") );
+  on_error_str   = Persistent<String>::New( String::NewSymbol("onError") );
   respond_str    = Persistent<String>::New( String::NewSymbol("respond") );
+  set_body_encoding_str = Persistent<String>::New( String::NewSymbol("setBodyEncoding") );
+  collect_body_str = Persistent<String>::New( String::NewSymbol("collectBody") );
+  send_file_str = Persistent<String>::New( String::NewSymbol("sendFile") );
 
   copy_str      = Persistent<String>::New( String::New("COPY") );
   delete_str    = Persistent<String>::New( String::New("DELETE") );
@@ -688,4 +2549,32 @@ NodeInit_http (Handle<Object> target)
   put_str       = Persistent<String>::New( String::New("PUT") );
   trace_str     = Persistent<String>::New( String::New("TRACE") );
   unlock_str    = Persistent<String>::New( String::New("UNLOCK") );
+
+  http_1_0_str  = Persistent<String>::New( String::New("1.0") );
+  http_1_1_str  = Persistent<String>::New( String::New("1.1") );
+
+  for (int i = 0; header_symbols[i].name; i++) {
+    header_symbols[i].symbol = 
+      Persistent<String>::New( String::NewSymbol(header_symbols[i].name) );
+  }
+
+  // The shape of every request object is built once, here.
+  Local<ObjectTemplate> t = ObjectTemplate::New();
+  t->SetInternalFieldCount(2);
+  t->Set(respond_str, FunctionTemplate::New(RespondCallback));
+  t->Set(set_body_encoding_str, FunctionTemplate::New(SetBodyEncodingCallback));
+  t->Set(collect_body_str, FunctionTemplate::New(CollectBodyCallback));
+  t->Set(send_file_str, FunctionTemplate::New(SendFileCallback));
+
+  t->SetAccessor(path_str, RequestPropertyGetter, RequestPropertySetter, Integer::New(PATH_PROPERTY));
+  t->SetAccessor(uri_str, RequestPropertyGetter, RequestPropertySetter, Integer::New(URI_PROPERTY));
+  t->SetAccessor(query_string_str, RequestPropertyGetter, RequestPropertySetter, Integer::New(QUERY_STRING_PROPERTY));
+  t->SetAccessor(fragment_str, RequestPropertyGetter, RequestPropertySetter, Integer::New(FRAGMENT_PROPERTY));
+  t->SetAccessor(method_str, RequestPropertyGetter, RequestPropertySetter, Integer::New(METHOD_PROPERTY));
+  t->SetAccessor(http_version_str, RequestPropertyGetter, RequestPropertySetter, Integer::New(HTTP_VERSION_PROPERTY));
+  t->SetAccessor(headers_str, RequestPropertyGetter, RequestPropertySetter, Integer::New(HEADERS_PROPERTY));
+
+  request_template = Persistent<ObjectTemplate>::New(t);
+
+  ev_prepare_init(&framing_watcher, on_framing);
 }
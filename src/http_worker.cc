@@ -0,0 +1,462 @@
+#include "http_worker.h"
+
+#include <ebb_scan.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+
+enum { PATH_ELEMENT
+     , QUERY_STRING_ELEMENT
+     , FRAGMENT_ELEMENT
+     , URI_ELEMENT
+     };
+
+static inline ParsedRequest*
+Current (ebb_request *req)
+{
+  WorkerConnection *connection = static_cast<WorkerConnection*> (req->data);
+  return connection->current;
+}
+
+static void
+on_path (ebb_request *req, const char *buf, size_t len)
+{
+  Current(req)->elements[PATH_ELEMENT].append(buf, len);
+}
+
+static void
+on_query_string (ebb_request *req, const char *buf, size_t len)
+{
+  Current(req)->elements[QUERY_STRING_ELEMENT].append(buf, len);
+}
+
+static void
+on_fragment (ebb_request *req, const char *buf, size_t len)
+{
+  Current(req)->elements[FRAGMENT_ELEMENT].append(buf, len);
+}
+
+static void
+on_uri (ebb_request *req, const char *buf, size_t len)
+{
+  Current(req)->elements[URI_ELEMENT].append(buf, len);
+}
+
+// Names and values go straight into head, one after the other. A piece
+// that straddles two reads extends the span it belongs to.
+static void
+on_header_field (ebb_request *req, const char *buf, size_t len, int header_index)
+{
+  ParsedRequest *request = Current(req);
+  string &head = request->head;
+
+  if (request->headers.size() != static_cast<size_t>(header_index) + 1) {
+    HttpHeaderSpan span = { head.length(), 0, 0, 0 };
+    request->headers.push_back(span);
+  }
+  HttpHeaderSpan &span = request->headers.back();
+
+  size_t offset = head.length();
+  head.resize(offset + len);
+  ebb_header_upcase(&head[offset], buf, len);
+  span.field_length += len;
+}
+
+static void
+on_header_value (ebb_request *req, const char *buf, size_t len, int header_index)
+{
+  ParsedRequest *request = Current(req);
+
+  if (request->headers.size() != static_cast<size_t>(header_index) + 1)
+    return; // value without a field?
+  HttpHeaderSpan &span = request->headers.back();
+
+  if (span.value_length == 0)
+    span.value_offset = request->head.length();
+  request->head.append(buf, len);
+  span.value_length += len;
+}
+
+static void
+on_headers_complete (ebb_request *req)
+{
+  ParsedRequest *request = Current(req);
+  HttpSpan *spans[] = { &request->path
+                      , &request->query_string
+                      , &request->fragment
+                      , &request->uri
+                      };
+  for (int i = 0; i < 4; i++) {
+    string &element = request->elements[i];
+    spans[i]->offset = request->head.length();
+    spans[i]->length = element.length();
+    request->head.append(element);
+    element.clear();
+  }
+}
+
+static void
+on_body (ebb_request *req, const char *base, size_t length)
+{
+  Current(req)->body.append(base, length);
+}
+
+static size_t
+request_size (ParsedRequest *request)
+{
+  size_t size = request->head.length() + request->body.length();
+  for (int i = 0; i < 4; i++)
+    size += request->elements[i].length();
+  return size;
+}
+
+static void
+on_request_complete (ebb_request *req)
+{
+  WorkerConnection *connection = static_cast<WorkerConnection*> (req->data);
+
+  HttpMessage *message = new HttpMessage;
+  message->type = HttpMessage::REQUEST;
+  message->worker = connection->worker;
+  message->connection = connection;
+  message->request = connection->current;
+  message->bytes = request_size(connection->current);
+  connection->current = NULL;
+
+  connection->in_flight += message->bytes;
+  if (!connection->reading_paused
+      && connection->in_flight >= connection->worker->request_buffer_limit) {
+    oi_socket_read_stop(&connection->socket);
+    connection->reading_paused = true;
+  }
+
+  connection->worker->Send(message);
+}
+
+static ebb_request*
+on_request (void *data)
+{
+  WorkerConnection *connection = static_cast<WorkerConnection*> (data);
+
+  ParsedRequest *request = new ParsedRequest;
+  HttpSpan empty = { 0, 0 };
+  request->path = request->query_string = request->fragment = request->uri = empty;
+
+  ebb_request_init(&request->info);
+  request->info.on_path             = on_path;
+  request->info.on_query_string     = on_query_string;
+  request->info.on_uri              = on_uri;
+  request->info.on_fragment         = on_fragment;
+  request->info.on_header_field     = on_header_field;
+  request->info.on_header_value     = on_header_value;
+  request->info.on_headers_complete = on_headers_complete;
+  request->info.on_body             = on_body;
+  request->info.on_complete         = on_request_complete;
+  request->info.data                = connection;
+
+  assert(connection->current == NULL);
+  connection->current = request;
+  return &request->info;
+}
+
+static void
+close_connection (WorkerConnection *connection)
+{
+  if (connection->closing) return;
+  connection->closing = true;
+  oi_socket_close(&connection->socket);
+}
+
+static void
+on_read (oi_socket *socket, const void *buf, size_t count)
+{
+  WorkerConnection *connection = static_cast<WorkerConnection*> (socket->data);
+
+  if (count == 0) {
+    close_connection(connection);
+    return;
+  }
+
+  ebb_request_parser_execute( &connection->parser
+                            , static_cast<const char*> (buf)
+                            , count
+                            );
+
+  if (ebb_request_parser_has_error(&connection->parser)) {
+    fprintf(stderr, "parse error closing connection\n");
+    close_connection(connection);
+    return;
+  }
+
+  if (connection->current
+      && request_size(connection->current) > connection->worker->request_buffer_limit) {
+    fprintf(stderr, "request too large closing connection\n");
+    close_connection(connection);
+  }
+}
+
+static void
+on_drain (oi_socket *socket)
+{
+  WorkerConnection *connection = static_cast<WorkerConnection*> (socket->data);
+  if (connection->close_on_drain)
+    close_connection(connection);
+}
+
+// The connection lives on until the javascript thread answers with
+// RELEASED; there may still be messages about it on the way.
+static void
+on_close (oi_socket *socket)
+{
+  WorkerConnection *connection = static_cast<WorkerConnection*> (socket->data);
+  connection->closing = true;
+  connection->closed = true;
+
+  HttpMessage *message = new HttpMessage;
+  message->type = HttpMessage::CLOSED;
+  message->worker = connection->worker;
+  message->connection = connection;
+  connection->worker->Send(message);
+}
+
+WorkerConnection::WorkerConnection (HttpWorker *worker_, double idle_timeout)
+{
+  worker = worker_;
+  current = NULL;
+  closing = false;
+  closed = false;
+  close_on_drain = false;
+  reading_paused = false;
+  in_flight = 0;
+  local = NULL;
+
+  oi_socket_init(&socket, idle_timeout);
+  socket.on_read  = on_read;
+  socket.on_drain = on_drain;
+  socket.on_close = on_close;
+  socket.data     = this;
+
+  ebb_request_parser_init(&parser);
+  parser.new_request = on_request;
+  parser.data        = this;
+}
+
+WorkerConnection::~WorkerConnection ()
+{
+  delete current;
+}
+
+HttpWorker::HttpWorker ( int listen_fd
+                       , int accept_batch
+                       , double idle_timeout_
+                       , size_t request_buffer_limit_
+                       , Mailbox<HttpMessage> *outbox_
+                       , struct ev_loop *main_loop_
+                       , ev_async *main_watcher_
+                       )
+{
+  loop = NULL;
+  idle_timeout = idle_timeout_;
+  request_buffer_limit = request_buffer_limit_;
+  outbox = outbox_;
+  main_loop = main_loop_;
+  main_watcher = main_watcher_;
+
+  oi_server_init(&server, 0);
+  oi_server_listen_fd(&server, listen_fd);
+  server.accept_batch = accept_batch;
+  server.on_connection = HttpWorker::OnConnection;
+  server.data = this;
+
+  ev_async_init(&wakeup, HttpWorker::OnMessages);
+  wakeup.data = this;
+}
+
+// Everything is set up on the loop before the thread exists.
+int
+HttpWorker::Start ()
+{
+  loop = ev_loop_new(ev_edge_triggered(main_loop) ? EVFLAG_EDGE : EVFLAG_AUTO);
+  if (loop == NULL) return -1;
+
+  ev_async_start(loop, &wakeup);
+  oi_server_attach(&server, loop);
+
+  int r = pthread_create(&thread, NULL, HttpWorker::Run, this);
+  if (r != 0) {
+    oi_server_detach(&server);
+    ev_async_stop(loop, &wakeup);
+    ev_loop_destroy(loop);
+    loop = NULL;
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+void*
+HttpWorker::Run (void *data)
+{
+  HttpWorker *worker = static_cast<HttpWorker*> (data);
+  ev_loop(worker->loop, 0);
+  return NULL;
+}
+
+oi_socket*
+HttpWorker::OnConnection (oi_server *server, struct sockaddr *addr, socklen_t len)
+{
+  HttpWorker *worker = static_cast<HttpWorker*> (server->data);
+  WorkerConnection *connection = new WorkerConnection(worker, worker->idle_timeout);
+  return &connection->socket;
+}
+
+void
+HttpWorker::Post (HttpMessage *message)
+{
+  message->worker = this;
+  if (inbox.Push(message))
+    ev_async_send(loop, &wakeup);
+}
+
+void
+HttpWorker::Send (HttpMessage *message)
+{
+  if (outbox->Push(message))
+    ev_async_send(main_loop, main_watcher);
+}
+
+// The socket sends out, which points at the javascript thread's buffer.
+static void
+release_carrier (oi_buf *out)
+{
+  HttpMessage *message = static_cast<HttpMessage*> (out->data);
+  message->type = HttpMessage::RELEASE;
+  message->worker->Send(message);
+}
+
+void
+HttpWorker::Write (WorkerConnection *connection, oi_buf *buf)
+{
+  HttpMessage *message = new HttpMessage;
+  message->type = HttpMessage::WRITE;
+  message->connection = connection;
+  message->buf = buf;
+  message->out.base = buf->base;
+  message->out.len = buf->len;
+  message->out.release = release_carrier;
+  message->out.data = message;
+  Post(message);
+}
+
+void
+HttpWorker::End (WorkerConnection *connection)
+{
+  HttpMessage *message = new HttpMessage;
+  message->type = HttpMessage::END;
+  message->connection = connection;
+  Post(message);
+}
+
+void
+HttpWorker::Close (WorkerConnection *connection)
+{
+  HttpMessage *message = new HttpMessage;
+  message->type = HttpMessage::CLOSE;
+  message->connection = connection;
+  Post(message);
+}
+
+void
+HttpWorker::Released (WorkerConnection *connection)
+{
+  HttpMessage *message = new HttpMessage;
+  message->type = HttpMessage::RELEASED;
+  message->connection = connection;
+  Post(message);
+}
+
+// Hands a REQUEST back, once javascript has had it.
+void
+HttpWorker::Taken (HttpMessage *request)
+{
+  request->type = HttpMessage::TAKEN;
+  request->request = NULL;
+  Post(request);
+}
+
+// Stops accepting. The thread stays around for the connections it has;
+// it is never joined.
+void
+HttpWorker::Stop ()
+{
+  HttpMessage *message = new HttpMessage;
+  message->type = HttpMessage::STOP;
+  message->connection = NULL;
+  Post(message);
+}
+
+void
+HttpWorker::OnMessages (EV_P_ ev_async *watcher, int revents)
+{
+  HttpWorker *worker = static_cast<HttpWorker*> (watcher->data);
+  HttpMessage *message = worker->inbox.TakeAll();
+
+  while (message) {
+    HttpMessage *next = message->next;
+    WorkerConnection *connection = message->connection;
+
+    switch (message->type) {
+      case HttpMessage::WRITE:
+        // A closed socket releases it right away.
+        oi_socket_write(&connection->socket, &message->out);
+        break;
+
+      case HttpMessage::END:
+        if (!connection->closing) {
+          connection->close_on_drain = true;
+          oi_socket_read_stop(&connection->socket);
+          if (oi_queue_empty(&connection->socket.out_stream))
+            close_connection(connection);
+        }
+        delete message;
+        break;
+
+      case HttpMessage::CLOSE:
+        close_connection(connection);
+        delete message;
+        break;
+
+      case HttpMessage::TAKEN:
+        connection->in_flight -= message->bytes;
+        if (connection->reading_paused && !connection->closing
+            && !connection->close_on_drain
+            && connection->in_flight <= worker->request_buffer_limit / 2) {
+          oi_socket_read_start(&connection->socket);
+          connection->reading_paused = false;
+        }
+        delete message;
+        break;
+
+      case HttpMessage::RELEASED:
+        assert(connection->closed);
+        delete connection;
+        delete message;
+        break;
+
+      case HttpMessage::STOP:
+        oi_server_detach(&worker->server);
+        message->type = HttpMessage::STOPPED;
+        worker->Send(message);
+        break;
+
+      default:
+        assert(0 && "message for the javascript thread");
+        delete message;
+    }
+
+    message = next;
+  }
+}
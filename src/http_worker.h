@@ -0,0 +1,150 @@
+#ifndef node_http_worker_h
+#define node_http_worker_h
+
+#include "mailbox.h"
+
+#include <ev.h>
+#include <oi_socket.h>
+#include <ebb_request_parser.h>
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+/* HTTPServer's threads mode. Each HttpWorker runs a libev loop of its own
+ * on its own thread and accepts from the server's listening socket. It
+ * reads and parses requests there, and writes the responses. A request is
+ * handed to the javascript thread only once it is complete, with its head
+ * and body copied out. Nothing on a worker touches V8.
+ *
+ * The two sides talk through Mailboxes: REQUEST and CLOSED go to the
+ * javascript thread, WRITE, END, CLOSE, TAKEN and RELEASED to a worker. A
+ * WRITE carries a buffer of the javascript thread's; it comes back in a
+ * RELEASE once the socket is done with it, so it is always freed where it
+ * was made.
+ *
+ * A REQUEST comes back as TAKEN once javascript has had it. Until then its
+ * bytes count against the connection's request_buffer_limit. A request
+ * bigger than the limit closes the connection, and reading stops while
+ * the requests in flight add up to the limit, until javascript has taken
+ * them down to half of it.
+ */
+
+struct HttpSpan {
+  size_t offset;
+  size_t length;
+};
+
+struct HttpHeaderSpan {
+  size_t field_offset;
+  size_t field_length;
+  size_t value_offset;
+  size_t value_length;
+};
+
+// A request read and parsed on a worker. Spans are offsets into head.
+struct ParsedRequest {
+  ebb_request info;
+  std::string head;
+  HttpSpan path;
+  HttpSpan query_string;
+  HttpSpan fragment;
+  HttpSpan uri;
+  std::vector<HttpHeaderSpan> headers;
+  std::string body;
+
+  // request line parts while parsing, moved into head afterwards
+  std::string elements[4];
+};
+
+class HttpWorker;
+class WorkerConnection;
+
+struct HttpMessage {
+  enum Type { REQUEST  // worker -> js: request is complete
+            , CLOSED   // worker -> js: the socket has closed
+            , RELEASE  // worker -> js: the socket is done with buf
+            , WRITE    // js -> worker: send buf
+            , STOPPED  // worker -> js: reply to STOP
+            , END      // js -> worker: close once everything is written
+            , CLOSE    // js -> worker: close the connection
+            , RELEASED // js -> worker: reply to CLOSED
+            , TAKEN    // js -> worker: reply to REQUEST
+            , STOP     // js -> worker: stop accepting
+            };
+
+  HttpMessage *next;
+  Type type;
+  HttpWorker *worker;
+  WorkerConnection *connection;
+  ParsedRequest *request; // REQUEST, owned by the receiver
+  size_t bytes; // REQUEST, TAKEN: the request's size
+  oi_buf *buf; // WRITE, RELEASE
+  oi_buf out; // what the worker's socket sends for a WRITE
+};
+
+// One accepted socket, owned by its worker.
+class WorkerConnection {
+public:
+  WorkerConnection (HttpWorker *worker, double idle_timeout);
+  ~WorkerConnection ();
+
+  oi_socket socket;
+  ebb_request_parser parser;
+  ParsedRequest *current;
+  HttpWorker *worker;
+  bool closing; // oi_socket_close has been called
+  bool closed; // on_close has happened
+  bool close_on_drain;
+  bool reading_paused;
+  size_t in_flight; // bytes of REQUESTs not yet TAKEN
+
+  // The javascript thread's side of the connection. Only that thread
+  // reads or writes it.
+  void *local;
+};
+
+class HttpWorker {
+public:
+  HttpWorker ( int listen_fd
+             , int accept_batch
+             , double idle_timeout
+             , size_t request_buffer_limit
+             , Mailbox<HttpMessage> *outbox
+             , struct ev_loop *main_loop
+             , ev_async *main_watcher
+             );
+
+  int Start ();
+
+  // Called on the javascript thread.
+  void Post (HttpMessage *message);
+  void Write (WorkerConnection *connection, oi_buf *buf);
+  void End (WorkerConnection *connection);
+  void Close (WorkerConnection *connection);
+  void Released (WorkerConnection *connection);
+  void Taken (HttpMessage *request);
+  void Stop ();
+
+  // Called on the worker thread.
+  void Send (HttpMessage *message);
+
+  struct ev_loop *loop;
+  double idle_timeout;
+  size_t request_buffer_limit;
+
+private:
+  static void* Run (void *data);
+  static void OnMessages (EV_P_ ev_async *watcher, int revents);
+  static oi_socket* OnConnection (oi_server *server, struct sockaddr *addr, socklen_t len);
+
+  oi_server server;
+  pthread_t thread;
+  ev_async wakeup;
+  Mailbox<HttpMessage> inbox;
+  Mailbox<HttpMessage> *outbox;
+  struct ev_loop *main_loop;
+  ev_async *main_watcher;
+};
+
+#endif // node_http_worker_h
@@ -0,0 +1,47 @@
+#ifndef node_mailbox_h
+#define node_mailbox_h
+
+#include <stddef.h>
+
+/* A lock-free queue of messages for one consumer thread. Any thread may
+ * Push(); the consumer takes everything pushed so far at once with
+ * TakeAll(), oldest first. T needs a "T *next" member.
+ *
+ * Push() returns true when the box was empty. Only that push has to wake
+ * the consumer (e.g. with ev_async_send); the ones after it will be taken
+ * by the same TakeAll().
+ */
+template <class T>
+class Mailbox {
+public:
+  Mailbox () : head_(NULL) { }
+
+  bool Push (T *message)
+  {
+    T *head;
+    do {
+      head = head_;
+      message->next = head;
+    } while (!__sync_bool_compare_and_swap(&head_, head, message));
+    return head == NULL;
+  }
+
+  T* TakeAll ()
+  {
+    T *stack = __sync_lock_test_and_set(&head_, static_cast<T*>(NULL));
+    // The stack is newest first.
+    T *list = NULL;
+    while (stack) {
+      T *next = stack->next;
+      stack->next = list;
+      list = stack;
+      stack = next;
+    }
+    return list;
+  }
+
+private:
+  T * volatile head_;
+};
+
+#endif // node_mailbox_h
@@ -34,33 +34,80 @@ node.path = new function () {
 
 // Namespace for module loading functionality
 (function () {
-  function findScript(base_directory, name, callback) {
+  function findScript(base_directory, name) {
     // in the future this function will be more complicated
     if (name.charAt(0) == "/")
       throw "absolute module paths are not yet supported.";
 
+    // Without "." and "dir/.." segments, so that the same module required
+    // from different directories has the same name in modules.
     var filename = node.path.join(base_directory, name) + ".js";
+    var normalized;
+    for (;;) {
+      normalized = filename.replace(/(^|\/)\.\//g, "$1")
+                           .replace(/(^|\/)(?!\.\.\/)[^\/]+\/\.\.\//, "$1");
+      if (normalized == filename) return filename;
+      filename = normalized;
+    }
+  }
 
-    File.exists(filename, function (status) {
-      callback(status ? filename : null);
-    });
+  // Every script which has been require()'d, by filename, so that a module
+  // needed from several places is read and run only once. Each entry is
+  // { target: exports, loaded: bool, waiting: [callbacks] }.
+  var modules = {};
+
+  // What each script still waits for while its submodules load:
+  // awaiting[filename][sub_filename] counts the unfinished loads.
+  var awaiting = {};
+
+  // Whether filename is one of chain, or waits for one of them, directly
+  // or through the scripts it waits for.
+  function waitsFor (filename, chain, seen) {
+    if (chain.indexOf(filename) >= 0) return true;
+    if (seen[filename]) return false;
+    seen[filename] = true;
+    var subs = awaiting[filename];
+    for (var sub in subs) {
+      if (subs.hasOwnProperty(sub) && waitsFor(sub, chain, seen))
+        return true;
+    }
+    return false;
   }
 
   // Constructor for submodule.
   // "name" is like a path but without .js. e.g. "database/mysql"
   // "target" is an object into which the submodule will be loaded.
-  function Sub (name, target) {
+  // "shared" is the modules entry when the submodule was require()'d.
+  function Sub (name, filename, target, shared) {
     this.name = name;
+    this.filename = filename;
     this.target = target;
 
-    this.load = function (base_directory, callback) {
-      //node.debug("sub.load from <" + base_directory + ">  " + this.toString());
-      findScript(base_directory, name, function (filename) {
-        if (filename === null) {
-          stderr.puts("Cannot find a script matching: " + name);
-          process.exit(1);
-        }
-        loadScript(filename, target, callback);
+    this.load = function (parents, callback) {
+      //node.debug("sub.load " + this.toString());
+      if (!shared) {
+        loadScript(filename, target, parents, callback);
+        return;
+      }
+
+      // A module requiring one of its own ancestors gets the ancestor's
+      // exports as they are now; waiting for it would never end. So does
+      // one requiring a module which is being loaded elsewhere but waits
+      // for this chain itself, as B and C do when A requires both and
+      // they require each other.
+      if (shared.loaded || waitsFor(filename, parents, {})) {
+        callback();
+        return;
+      }
+      shared.waiting.push(callback);
+      if (shared.waiting.length > 1) return; // already being loaded
+
+      loadScript(filename, target, parents, function () {
+        shared.loaded = true;
+        var waiting = shared.waiting;
+        shared.waiting = [];
+        for (var i = 0; i < waiting.length; i++)
+          waiting[i]();
       });
     };
 
@@ -87,14 +134,22 @@ node.path = new function () {
       //node.debug("<"+ filename+"> has onload! this is bad");
     }
 
+    var base_directory = node.path.dirname(filename);
+
     module.__subs = [];
     module.__require = function (name) {
-      var target = {};
-      module.__subs.push(new Sub(name, target));
-      return target;
+      var sub_filename = findScript(base_directory, name);
+      var shared = modules[sub_filename];
+      if (!shared) {
+        shared = { target: {}, loaded: false, waiting: [] };
+        modules[sub_filename] = shared;
+      }
+      module.__subs.push(new Sub(name, sub_filename, shared.target, shared));
+      return shared.target;
     }
     module.__include = function (name) {
-      module.__subs.push(new Sub(name, module));
+      var sub_filename = findScript(base_directory, name);
+      module.__subs.push(new Sub(name, sub_filename, module, null));
     }
     // execute the script of interest
     compiled.apply(module, [filename]);
@@ -112,13 +167,19 @@ node.path = new function () {
     delete module.__include;
   }
 
-  function loadScript (filename, target, callback) {
-    File.cat(filename, function (status, content) {
+  // Reads go straight to the thread pool, so the submodules of a script
+  // are all read concurrently.
+  function loadScript (filename, target, parents, callback) {
+    node.readScript(filename, function (status, content) {
+      if (status == File.ENOENT) {
+        stderr.puts("Cannot find a script matching: " + filename);
+        process.exit(1);
+      }
       if (status != 0) {
         stderr.puts("Error reading " + filename + ": " + File.strerror(status));
         process.exit(1);
       }
-      
+
       var scaffold = new Scaffold(content, filename, target);
 
       //node.debug("after scaffold <" + filename + ">");
@@ -142,19 +203,28 @@ node.path = new function () {
         finish(); 
       } else {
         var ncomplete = 0;
+        var sub_parents = parents.concat([filename]);
+        var subs = awaiting[filename] = awaiting[filename] || {};
+        for (var i = 0; i < scaffold.subs.length; i++) {
+          var sub_filename = scaffold.subs[i].filename;
+          subs[sub_filename] = (subs[sub_filename] || 0) + 1;
+        }
         for (var i = 0; i < scaffold.subs.length; i++) {
           var sub = scaffold.subs[i];
-          sub.load(node.path.dirname(filename), function () {
-            ncomplete += 1;
-            //node.debug("<" + filename + "> ncomplete = " + ncomplete.toString() + " scaffold.subs.length = " + scaffold.subs.length.toString());
-            if (ncomplete === scaffold.subs.length)
-              finish();
-          });
+          sub.load(sub_parents, (function (sub_filename) {
+            return function () {
+              if (--subs[sub_filename] == 0) delete subs[sub_filename];
+              ncomplete += 1;
+              //node.debug("<" + filename + "> ncomplete = " + ncomplete.toString() + " scaffold.subs.length = " + scaffold.subs.length.toString());
+              if (ncomplete === scaffold.subs.length)
+                finish();
+            };
+          })(sub.filename));
         }
       }
     });
   }
 
-  loadScript(ARGV[1], this);
+  loadScript(ARGV[1], this, []);
 })();
 
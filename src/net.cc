@@ -1,10 +1,13 @@
 #include "net.h"
 #include "node.h"
+#include "buffer.h"
+#include "dns.h"
 
 #include <oi_socket.h>
 #include <oi_buf.h>
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
@@ -20,6 +23,7 @@ static Persistent<FunctionTemplate> socket_template;
 #define ON_CONNECT_SYMBOL String::NewSymbol("onConnect")
 #define ON_CONNECTION_SYMBOL String::NewSymbol("onConnection")
 #define ON_READ_SYMBOL String::NewSymbol("onRead")
+#define ON_ERROR_SYMBOL String::NewSymbol("onError")
 
 static const struct addrinfo tcp_hints = 
 /* ai_flags      */ { AI_PASSIVE
@@ -34,7 +38,7 @@ static const struct addrinfo tcp_hints =
 
 class Server {
 public:
-  Server (Handle<Object> handle, int backlog);
+  Server (Handle<Object> handle, int backlog, int accept_batch, double timeout);
   ~Server ();
 
   static Handle<Value> New (const Arguments& args);
@@ -43,9 +47,15 @@ public:
 
 private:
   static oi_socket* OnConnection (oi_server *, struct sockaddr *, socklen_t);
+  static void AfterResolve (int status, struct addrinfo *address, void *data);
+  int Listen (struct addrinfo *address);
   static Server* Unwrap (Handle<Object> handle);
   static void MakeWeak (Persistent<Value> _, void *data);
   oi_server server_;
+  double timeout_; // for accepted sockets, in seconds
+  bool resolving_;
+  bool resolve_async_; // ListenTCP returned before the lookup finished
+  const char *listen_error_;
   Persistent<Object> handle_;
 };
 
@@ -71,8 +81,7 @@ private:
   static void OnClose (oi_socket *s);
   static void OnTimeout (oi_socket *s);
 
-  static int Resolve (eio_req *req);
-  static int AfterResolve (eio_req *req);
+  static void AfterResolve (int status, struct addrinfo *address, void *data);
 
   static Socket* Unwrap (Handle<Object> handle);
   static void MakeWeak (Persistent<Value> _, void *data);
@@ -81,15 +90,14 @@ private:
   oi_socket socket_;
   Persistent<Object> handle_;
 
-  char *host_;
-  char *port_;
-
   friend class Server;
 };
 
-Server::Server (Handle<Object> handle, int backlog)
+Server::Server (Handle<Object> handle, int backlog, int accept_batch, double timeout)
 {
   oi_server_init(&server_, backlog);
+  server_.accept_batch = accept_batch;
+  timeout_ = timeout;
   server_.on_connection = Server::OnConnection;
 //  server_.on_error      = Server::OnError;
   server_.data = this;
@@ -114,11 +122,29 @@ Server::New (const Arguments& args)
 {
   HandleScope scope;
 
-  int backlog = 1024; // default
-  if (args.Length() > 0 && args[0]->IsNumber()) 
+  // defaults
+  int backlog = 1024;
+  int accept_batch = 64;
+  double timeout = 60.0; // in seconds
+
+  if (args.Length() > 0 && args[0]->IsNumber()) {
     backlog = args[0]->IntegerValue();
 
-  Server *server = new Server(args.Holder(), backlog);
+  } else if (args.Length() > 0 && args[0]->IsObject()) {
+    // new Server({ backlog: 1024, acceptBatch: 64, timeout: 60000 })
+    Local<Object> options = args[0]->ToObject();
+    Local<Value> backlog_value = options->Get(String::NewSymbol("backlog"));
+    Local<Value> accept_batch_value = options->Get(String::NewSymbol("acceptBatch"));
+    Local<Value> timeout_value = options->Get(String::NewSymbol("timeout"));
+
+    if (backlog_value->IsNumber()) backlog = backlog_value->IntegerValue();
+    if (accept_batch_value->IsNumber()) accept_batch = accept_batch_value->IntegerValue();
+    if (accept_batch < 1) accept_batch = 1;
+    // milliseconds, like the Socket option
+    if (timeout_value->IsNumber()) timeout = timeout_value->NumberValue() / 1000;
+  }
+
+  Server *server = new Server(args.Holder(), backlog, accept_batch, timeout);
   if(server == NULL)
     return Undefined(); // XXX raise error?
 
@@ -135,37 +161,82 @@ Server::ListenTCP (const Arguments& args)
 
   String::AsciiValue port(args[0]);
 
-  int callback_index = 1;
-  char *host = NULL; 
-  if (args[1]->IsString()) {
-    callback_index = 2;
-    String::AsciiValue host_v(args[1]->ToString());
-    if(args[1]->IsString()) host = *host_v;
-  }
-
-  // For servers call getaddrinfo inline. This is blocking but it shouldn't
-  // matter--ever. If someone actually complains then simply swap it out
-  // with a libeio call.
-  struct addrinfo *address = NULL;
-  int r = getaddrinfo(host, *port, &tcp_hints, &address);
-  if (r != 0)
-    return ThrowException(String::New("Error looking up hostname"));
+  // Without a host the callback comes second. An empty handle gives a
+  // NULL host rather than "undefined".
+  bool has_host = args[1]->IsString();
+  int callback_index = has_host ? 2 : 1;
+  String::AsciiValue host_v(has_host ? args[1] : Handle<Value>());
+  char *host = *host_v;
 
   if (!args[callback_index]->IsFunction())
     return ThrowException(String::New("Must supply onConnection callback"));
 
   server->handle_->Set(ON_CONNECTION_SYMBOL, args[callback_index]);
 
-  r = oi_server_listen(&server->server_, address);
-  if (r != 0)
-    return ThrowException(String::New("Error listening on port"));
-  oi_server_attach(&server->server_, node_loop());
+  // A numeric or empty host is answered right here, so errors can still
+  // be thrown. For names the server is kept alive until the lookup is done.
+  server->listen_error_ = NULL;
+  server->resolving_ = true;
+  server->resolve_async_ = false;
+  server->handle_.ClearWeak();
+  node_resolve(host, *port, &tcp_hints, Server::AfterResolve, server);
 
-  freeaddrinfo(address);
+  if (server->resolving_)
+    server->resolve_async_ = true;
+  else if (server->listen_error_)
+    return ThrowException(String::New(server->listen_error_));
 
   return Undefined();
 }
 
+int
+Server::Listen (struct addrinfo *address)
+{
+  // With --workers each process binds its own socket to the same port
+  // and the kernel balances connections between them.
+  if (node_worker() > 0)
+    server_.reuseport = 1;
+
+  int r = oi_server_listen(&server_, address);
+  if (r != 0)
+    return r;
+  oi_server_attach(&server_, node_loop());
+  return 0;
+}
+
+void
+Server::AfterResolve (int status, struct addrinfo *address, void *data)
+{
+  Server *server = static_cast<Server*> (data);
+  HandleScope scope;
+
+  server->resolving_ = false;
+  server->handle_.MakeWeak(server, Server::MakeWeak);
+
+  if (status != 0)
+    server->listen_error_ = "Error looking up hostname";
+  else if (server->Listen(address) != 0)
+    server->listen_error_ = "Error listening on port";
+
+  if (!server->resolve_async_ || server->listen_error_ == NULL)
+    return;
+
+  // Too late to throw. Tell onError, if there is one.
+  Local<Value> onerror_value = server->handle_->Get(ON_ERROR_SYMBOL);
+  if (!onerror_value->IsFunction()) {
+    fprintf(stderr, "%s\n", server->listen_error_);
+    return;
+  }
+  Local<Function> onerror = Local<Function>::Cast(onerror_value);
+
+  TryCatch try_catch;
+  const int argc = 1;
+  Local<Value> argv[argc] = { String::New(server->listen_error_) };
+  onerror->Call(server->handle_, argc, argv);
+  if(try_catch.HasCaught())
+    node_fatal_exception(try_catch);
+}
+
 Handle<Value>
 Server::Close (const Arguments& args)
 {
@@ -182,7 +253,7 @@ Server::OnConnection (oi_server *s, struct sockaddr *remote_addr, socklen_t remo
   HandleScope scope;
 
   Local<Object> socket_handle = socket_template->GetFunction()->NewInstance();
-  Socket *socket = new Socket(socket_handle, 60.0);
+  Socket *socket = new Socket(socket_handle, server->timeout_);
   socket->handle_->Delete(String::NewSymbol("connectTCP"));
 
   Local<Value> callback_v = server->handle_->Get(ON_CONNECTION_SYMBOL);
@@ -289,85 +360,52 @@ Socket::ConnectTCP (const Arguments& args)
   Socket *socket = Socket::Unwrap(args.Holder());
 
   String::AsciiValue port(args[0]);
-  socket->port_ = strdup(*port);
 
-  assert(socket->host_ == NULL);
-  String::AsciiValue host_v(args[1]->ToString());
-  if(args[1]->IsString()) {
-    socket->host_ = strdup(*host_v);
-  }
+  String::AsciiValue host_v(args[1]->IsString() ? args[1] : Handle<Value>());
+  char *host = *host_v; // NULL without a host
 
   if(args[2]->IsFunction()) {
     socket->handle_->Set(ON_CONNECT_SYMBOL , args[2]);
   }
 
-  /* For the moment I will do DNS lookups in the thread pool. This is
-   * sub-optimal and cannot handle massive numbers of requests but it is 
-   * quite portable. 
-   * In the future I will move to a system using adns or udns: 
-   * http://lists.schmorp.de/pipermail/libev/2009q1/000632.html
-   */
-  node_eio_warmup();
-  eio_req *req = eio_custom (Socket::Resolve, EIO_PRI_DEFAULT, Socket::AfterResolve, socket);
+  // Lookups go through the resolver cache; names not in it are looked up
+  // in the thread pool. Keep the socket alive until then.
+  socket->handle_.ClearWeak();
+  node_resolve(host, *port, &tcp_hints, Socket::AfterResolve, socket);
 
   return Undefined();
 }
 
-/* This function is executed in the thread pool. It cannot touch anything! */
-int
-Socket::Resolve (eio_req *req) 
-{
-  Socket *socket = static_cast<Socket*> (req->data);
-  struct addrinfo *address = NULL;
-
-  req->result = getaddrinfo(socket->host_, socket->port_, &tcp_hints, &address);
-
-  req->ptr2 = address;
-
-  free(socket->host_);
-  socket->host_ = NULL;
-
-  free(socket->port_);
-  socket->port_ = NULL;
-
-  return 0;
-}
-
-int
-Socket::AfterResolve (eio_req *req) 
+void
+Socket::AfterResolve (int status, struct addrinfo *address, void *data) 
 {
-  Socket *socket = static_cast<Socket*> (req->data);
-  struct addrinfo *address = static_cast<struct addrinfo *>(req->ptr2);
-  req->ptr2 = NULL;
+  Socket *socket = static_cast<Socket*> (data);
+  socket->handle_.MakeWeak(socket, Socket::MakeWeak);
 
   int r = 0;
-  if (req->result == 0) {
+  if (status == 0) {
     r = oi_socket_connect (&socket->socket_, address);
   }
-  if (address)
-    freeaddrinfo(address); 
 
   // no error. return.
-  if(r == 0 && req->result == 0) {
+  if(r == 0 && status == 0) {
     oi_socket_attach (&socket->socket_, node_loop());
-    return 0;
+    return;
   }
 
   HandleScope scope;
   Handle<Value> onconnect_value = socket->handle_->Get(ON_CONNECT_SYMBOL);
-  if (!onconnect_value->IsFunction()) return 0; 
+  if (!onconnect_value->IsFunction()) return; 
   Handle<Function> onconnect = Handle<Function>::Cast(onconnect_value);
 
   TryCatch try_catch;
   const int argc = 1;
   Local<Value> argv[argc];
-  argv[0] = Integer::New(r | req->result); // FIXME very stupid error code.
+  argv[0] = Integer::New(r | status); // FIXME very stupid error code.
 
   onconnect->Call(socket->handle_, argc, argv);
   if(try_catch.HasCaught())
     node_fatal_exception(try_catch);
-
-  return 0;
 }
 
 Handle<Value>
@@ -389,9 +427,10 @@ Socket::MakeWeak (Persistent<Value> _, void *data)
 Socket::Socket(Handle<Object> handle, double timeout)
 {
   oi_socket_init(&socket_, timeout);
+  socket_.wheel = node_idle_wheel();
   socket_.on_connect = Socket::OnConnect;
   socket_.on_read    = Socket::OnRead;
-//  socket_.on_drain   = Socket::OnDrain;
+  socket_.on_drain   = Socket::OnDrain;
 //  socket_.on_error   = Socket::OnError;
   socket_.on_close   = Socket::OnClose;
   socket_.on_timeout = Socket::OnTimeout;
@@ -403,8 +442,6 @@ Socket::Socket(Handle<Object> handle, double timeout)
   handle_.MakeWeak(this, Socket::MakeWeak);
 
   encoding_ = UTF8; // default encoding.
-  host_ = NULL;
-  port_ = NULL;
 }
 
 Socket::~Socket ()
@@ -412,8 +449,6 @@ Socket::~Socket ()
   HandleScope scope;
   oi_socket_close(&socket_);
   oi_socket_detach(&socket_);
-  free(host_);
-  free(port_);
 
   handle_->SetInternalField(0, Undefined());
   handle_->Delete(String::NewSymbol("write"));
@@ -452,8 +487,16 @@ Socket::Write (const Arguments& args)
     s->WriteUtf8(buf->base, length);
     oi_socket_write(&socket->socket_, buf);
 
+  } else if (Buffer::HasInstance(args[0])) {
+    // raw encoding. the oi_buf points into the buffer; no copy.
+    Buffer *buffer = Buffer::Unwrap(args[0]->ToObject());
+    oi_buf *buf = buffer->NewOiBuf();
+    if (buf == NULL)
+      return ThrowException(String::New("Out of memory"));
+    oi_socket_write(&socket->socket_, buf);
+
   } else if (args[0]->IsArray()) {
-    // raw encoding
+    // raw encoding, old style. Prefer Buffer.
     Handle<Array> array = Handle<Array>::Cast(args[0]);
     size_t length = array->Length();
     oi_buf *buf = oi_buf_new2(length);
@@ -511,12 +554,8 @@ Socket::OnRead (oi_socket *s, const void *buf, size_t count)
       argv[0] = chunk;
     } else {
       // raw encoding
-      Local<Array> array = Array::New(count);
-      for (int i = 0; i < count; i++) {
-        char val = static_cast<const char*>(buf)[i];
-        array->Set(Integer::New(i), Integer::New(val));
-      }
-      argv[0] = array;
+      Buffer *buffer = Buffer::New(static_cast<const char*>(buf), count);
+      argv[0] = buffer->handle();
     }
   } else {
     argv[0] = Local<Value>::New(Null());
@@ -1,15 +1,27 @@
 #include "node.h"
 
+#include "buffer.h"
 #include "net.h"
 #include "file.h"
+#include "file_uring.h"
 #include "process.h"
 #include "http.h"
 #include "timers.h"
+#include "script_cache.h"
 
 #include "natives.h" 
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <math.h>
+#ifdef __linux
+# include <sys/prctl.h>
+#endif
 
 #include <string>
 #include <list>
@@ -67,12 +79,14 @@ ReportException(v8::TryCatch* try_catch)
 // Executes a string within the current v8 context.
 Handle<Value>
 ExecuteString(v8::Handle<v8::String> source,
-              v8::Handle<v8::Value> filename)
+              v8::Handle<v8::Value> filename,
+              v8::ScriptData *pre_data = NULL)
 {
   HandleScope scope;
   TryCatch try_catch;
 
-  Handle<Script> script = Script::Compile(source, filename);
+  ScriptOrigin origin(filename);
+  Handle<Script> script = Script::Compile(source, &origin, pre_data);
   if (script.IsEmpty()) {
     ReportException(&try_catch);
     exit(1);
@@ -97,8 +111,10 @@ NODE_METHOD(compile)
   Local<String> source = args[0]->ToString();
   Local<String> filename = args[1]->ToString();
 
-  Handle<Value> result = ExecuteString(source, filename);
-  
+  ScriptData *pre_data = node_script_data(source, filename);
+  Handle<Value> result = ExecuteString(source, filename, pre_data);
+  delete pre_data;
+
   return scope.Close(result);
 }
 
@@ -142,17 +158,90 @@ void node_exit (int code)
 
 static ev_async thread_pool_watcher;
 
+// Thread pool sizing. While requests are in flight the tuner looks at the
+// last interval: by Little's law arrival rate times mean service time is
+// how many threads were busy on average. It keeps half as many again,
+// grows at once if requests are waiting for a thread and shrinks a thread
+// per tick, always within --eio-min-threads and --eio-max-threads. Threads
+// above the floor which have nothing to do also exit on their own after
+// --eio-idle-timeout seconds.
+#define POOL_TUNER_INTERVAL 0.1
+#define POOL_HEADROOM 1.5
+
+static bool use_io_uring = true;
+static bool edge_triggered = false;
+
+static unsigned int pool_min_threads = 4;
+static unsigned int pool_max_threads = 32;
+static unsigned int pool_size;
+
+static ev_timer pool_tuner;
+static unsigned int pool_last_count;
+static double pool_last_service;
+
+static void
+pool_totals (unsigned int *count, double *service)
+{
+  *count = 0;
+  *service = 0.;
+  for (int type = 0; type < EIO_NUM_TYPES; type++) {
+    const eio_type_stats *stats = eio_stats(type);
+    *count += stats->count;
+    *service += stats->service;
+  }
+}
+
+static void
+pool_tuner_cb (EV_P_ ev_timer *w, int revents)
+{
+  unsigned int count;
+  double service;
+  pool_totals(&count, &service);
+
+  unsigned int completed = count - pool_last_count;
+  double busy = (service - pool_last_service) / POOL_TUNER_INTERVAL;
+  pool_last_count = count;
+  pool_last_service = service;
+
+  unsigned int backlog = eio_nready();
+  unsigned int target = completed ? (unsigned int) ceil(busy * POOL_HEADROOM) : 0;
+
+  if (backlog > 0) {
+    unsigned int grown = pool_size + (backlog < pool_size ? backlog : pool_size);
+    if (target < grown) target = grown;
+  }
+
+  if (target < pool_min_threads) target = pool_min_threads;
+  if (target > pool_max_threads) target = pool_max_threads;
+
+  if (target > pool_size) {
+    pool_size = target;
+    eio_set_min_parallel(pool_size);
+  } else if (target < pool_size && backlog == 0) {
+    pool_size--;
+    eio_set_max_parallel(pool_size);
+  }
+
+  if (eio_nreqs() == 0)
+    ev_timer_stop(EV_A_ w);
+}
+
 static void 
 thread_pool_cb (EV_P_ ev_async *w, int revents)
 {
   int r = eio_poll();
   /* returns 0 if all requests were handled, -1 if not, or the value of EIO_FINISH if != 0 */
 
-  // XXX is this check too heavy? 
-  //  it require three locks in eio
-  //  what's the better way?
-  if (eio_nreqs () == 0 && eio_nready() == 0 && eio_npending() == 0) 
-    ev_async_stop(EV_DEFAULT_ w);
+  if (r == -1) {
+    // Stopped early by --eio-max-poll-reqs or --eio-max-poll-time. Come
+    // back after the other watchers have had their turn.
+    ev_async_send(EV_A_ w);
+    return;
+  }
+
+  // Nothing in flight. On x86 eio_nreqs() is a plain read, no lock.
+  if (eio_nreqs() == 0)
+    ev_async_stop(EV_A_ w);
 }
 
 static void
@@ -165,6 +254,220 @@ void
 node_eio_warmup (void)
 {
   ev_async_start(EV_DEFAULT_ &thread_pool_watcher);
+  if (!ev_is_active(&pool_tuner)) {
+    pool_totals(&pool_last_count, &pool_last_service);
+    ev_timer_again(EV_DEFAULT_ &pool_tuner);
+  }
+}
+
+static oi_wheel idle_wheel;
+
+oi_wheel*
+node_idle_wheel (void)
+{
+  return &idle_wheel;
+}
+
+/* --workers=N. The original process only supervises: it forks N workers
+ * before any javascript runs and each of them runs the script. Servers in
+ * a worker bind with SO_REUSEPORT so that they can share their ports. The
+ * supervisor reaps workers and forks a replacement for one which was
+ * killed or exited with an error, unless it died within its first second,
+ * which looks like a script that cannot start. SIGINT and SIGTERM are
+ * passed on to the workers; the supervisor exits after the last one.
+ */
+#define WORKER_MIN_LIFETIME 1.
+
+struct worker {
+  pid_t pid;
+  ev_tstamp started;
+  ev_child watcher;
+};
+
+static int nworkers = 1;
+static int worker_id = 0;
+static struct worker *workers;
+static int nrunning = 0;
+static bool stopping = false;
+static ev_signal sigint_watcher;
+static ev_signal sigterm_watcher;
+
+int
+node_worker (void)
+{
+  return worker_id;
+}
+
+static void on_worker_exit (EV_P_ ev_child *w, int revents);
+
+// Returns in the new worker with worker_id set, like fork().
+static void
+spawn_worker (int i)
+{
+  pid_t supervisor = getpid();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork()");
+    return;
+  }
+
+  if (pid == 0) {
+    worker_id = i + 1;
+    for (int j = 0; j < nworkers; j++) {
+      if (ev_is_active(&workers[j].watcher))
+        ev_child_stop(EV_DEFAULT_ &workers[j].watcher);
+    }
+    if (ev_is_active(&sigint_watcher)) {
+      ev_signal_stop(EV_DEFAULT_ &sigint_watcher);
+      ev_signal_stop(EV_DEFAULT_ &sigterm_watcher);
+    }
+    ev_default_fork();
+    // Leaves the supervisor's ev_loop if it was running.
+    ev_unloop(EV_DEFAULT_ EVUNLOOP_ALL);
+#ifdef __linux
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != supervisor) exit(1);
+#endif
+    return;
+  }
+
+  workers[i].pid = pid;
+  workers[i].started = ev_now(EV_DEFAULT);
+  ev_child_set(&workers[i].watcher, pid, 0);
+  ev_child_start(EV_DEFAULT_ &workers[i].watcher);
+  nrunning++;
+}
+
+static void
+on_worker_exit (EV_P_ ev_child *w, int revents)
+{
+  struct worker *worker = static_cast<struct worker*> (w->data);
+  int i = worker - workers;
+  int status = w->rstatus;
+
+  ev_child_stop(EV_A_ w);
+  worker->pid = 0;
+  nrunning--;
+
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+    // finished
+  } else if (stopping) {
+    // told to stop
+  } else if (ev_now(EV_A) - worker->started < WORKER_MIN_LIFETIME) {
+    fprintf(stderr, "worker %d failed to start\n", i + 1);
+    exit_code = 1;
+  } else {
+    fprintf(stderr, "worker %d died, starting another\n", i + 1);
+    spawn_worker(i);
+    if (worker_id) return; // in the new worker
+  }
+
+  if (nrunning == 0)
+    ev_unloop(EV_A_ EVUNLOOP_ALL);
+}
+
+static void
+on_stop_signal (EV_P_ ev_signal *w, int revents)
+{
+  stopping = true;
+  for (int i = 0; i < nworkers; i++) {
+    if (workers[i].pid > 0)
+      kill(workers[i].pid, w->signum);
+  }
+}
+
+// Returns 0 in the supervisor once all workers are gone and the worker
+// number in a worker.
+static int
+run_workers (void)
+{
+  workers = new struct worker[nworkers];
+  for (int i = 0; i < nworkers; i++) {
+    workers[i].pid = 0;
+    ev_init(&workers[i].watcher, on_worker_exit);
+    workers[i].watcher.data = &workers[i];
+  }
+  ev_signal_init(&sigint_watcher, on_stop_signal, SIGINT);
+  ev_signal_init(&sigterm_watcher, on_stop_signal, SIGTERM);
+
+  for (int i = 0; i < nworkers; i++) {
+    spawn_worker(i);
+    if (worker_id) return worker_id;
+  }
+  if (nrunning == 0) {
+    exit_code = 1;
+    return 0;
+  }
+
+  ev_signal_start(EV_DEFAULT_ &sigint_watcher);
+  ev_signal_start(EV_DEFAULT_ &sigterm_watcher);
+  ev_loop(EV_DEFAULT_ 0);
+  return worker_id;
+}
+
+static void
+PrintUsage (void)
+{
+  fprintf(stderr, "Usage: node [options] [v8 options] script.js [arguments]\n"
+                  "  --eio-max-poll-reqs=N   handle at most N thread pool completions\n"
+                  "                          per loop iteration (default: no limit)\n"
+                  "  --eio-max-poll-time=MS  spend at most MS milliseconds handling\n"
+                  "                          completions per loop iteration\n"
+                  "  --eio-min-threads=N     keep at least N thread pool threads (default: 4)\n"
+                  "  --eio-max-threads=N     never grow the thread pool past N threads\n"
+                  "                          (default: 32)\n"
+                  "  --eio-idle-timeout=S    seconds before a thread above the minimum\n"
+                  "                          with nothing to do exits (default: 10)\n"
+                  "  --no-io-uring           run file operations in the thread pool even\n"
+                  "                          if the kernel supports io_uring\n"
+                  "  --edge-triggered        use epoll edge-triggered, which saves an\n"
+                  "                          epoll_ctl each time a socket starts or stops\n"
+                  "                          waiting to write\n"
+                  "  --workers=N             run the script in N processes, restarting\n"
+                  "                          those which die; servers share their ports\n");
+}
+
+// Takes node's own options out of argv, leaving V8's options and the
+// script with its arguments.
+static void
+ParseArgs (int *argc, char *argv[])
+{
+  int out = 1;
+  int i;
+  for (i = 1; i < *argc; i++) {
+    const char *arg = argv[i];
+    if (strncmp(arg, "--", 2) != 0) break; // the script
+
+    if (strncmp(arg, "--eio-max-poll-reqs=", 20) == 0) {
+      eio_set_max_poll_reqs(atoi(arg + 20));
+    } else if (strncmp(arg, "--eio-max-poll-time=", 20) == 0) {
+      eio_set_max_poll_time(atof(arg + 20) / 1000.);
+    } else if (strncmp(arg, "--eio-min-threads=", 18) == 0) {
+      pool_min_threads = atoi(arg + 18);
+    } else if (strncmp(arg, "--eio-max-threads=", 18) == 0) {
+      pool_max_threads = atoi(arg + 18);
+    } else if (strncmp(arg, "--eio-idle-timeout=", 19) == 0) {
+      eio_set_idle_timeout(atoi(arg + 19));
+    } else if (strcmp(arg, "--no-io-uring") == 0) {
+      use_io_uring = false;
+    } else if (strcmp(arg, "--edge-triggered") == 0) {
+      edge_triggered = true;
+    } else if (strncmp(arg, "--workers=", 10) == 0) {
+      nworkers = atoi(arg + 10);
+    } else if (strcmp(arg, "--help") == 0) {
+      PrintUsage();
+      exit(0);
+    } else {
+      argv[out++] = argv[i]; // for V8
+    }
+  }
+  for (; i < *argc; i++)
+    argv[out++] = argv[i];
+  *argc = out;
+
+  if (nworkers < 1) nworkers = 1;
+  if (pool_min_threads < 1) pool_min_threads = 1;
+  if (pool_max_threads < pool_min_threads) pool_max_threads = pool_min_threads;
 }
 
 int
@@ -173,11 +476,35 @@ main (int argc, char *argv[])
   // start eio thread pool
   ev_async_init(&thread_pool_watcher, thread_pool_cb);
   eio_init(thread_pool_want_poll, NULL);
+  ParseArgs(&argc, argv);
+
+  // The first call creates the loop; node_loop() passes no flags.
+  ev_default_loop(edge_triggered ? EVFLAG_EDGE : EVFLAG_AUTO);
+
+  // Only workers go on from here.
+  if (nworkers > 1 && run_workers() == 0)
+    return exit_code;
+
+  pool_size = pool_min_threads;
+  eio_set_max_parallel(pool_size);
+  eio_set_min_parallel(pool_size);
+  eio_set_max_idle(pool_size);
+  ev_init(&pool_tuner, pool_tuner_cb);
+  pool_tuner.repeat = POOL_TUNER_INTERVAL;
+
+  // Falls back to the thread pool if the kernel has no io_uring. Each
+  // worker sets up its own ring here; the supervisor never has one.
+  if (use_io_uring)
+    node_uring_init(node_loop(), 256);
+
+  oi_wheel_init(&idle_wheel, 1.0);
+  oi_wheel_attach(&idle_wheel, node_loop());
 
   V8::SetFlagsFromCommandLine(&argc, argv, true);
 
   if(argc < 2)  {
     fprintf(stderr, "No script was specified.\n");
+    PrintUsage();
     return 1;
   }
 
@@ -196,6 +523,7 @@ main (int argc, char *argv[])
 
   NODE_SET_METHOD(node, "compile", compile);
   NODE_SET_METHOD(node, "debug", debug);
+  NodeInit_script_cache(node);
 
   Local<Array> arguments = Array::New(argc);
   for (int i = 0; i < argc; i++) {
@@ -205,6 +533,7 @@ main (int argc, char *argv[])
   g->Set(String::New("ARGV"), arguments);
 
   // BUILT-IN MODULES
+  NodeInit_buffer(g);
   NodeInit_net(g);
   NodeInit_timers(g);
   NodeInit_process(g);
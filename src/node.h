@@ -3,6 +3,7 @@
 
 #include <ev.h>
 #include <eio.h>
+#include <oi_wheel.h>
 #include <v8.h>
 
 #define NODE_SYMBOL(name) v8::String::NewSymbol(name)
@@ -19,5 +20,13 @@ void node_exit (int code);
 // call this after creating a new eio event.
 void node_eio_warmup (void);
 
+// Sockets keep their idle timeouts on this wheel rather than each
+// running its own ev_timer. It ticks once a second.
+oi_wheel* node_idle_wheel (void);
+
+// The worker number, 1 ... N, when run with --workers=N, otherwise 0.
+// Servers in workers listen with SO_REUSEPORT.
+int node_worker (void);
+
 #endif // node_h
 
@@ -0,0 +1,68 @@
+#ifndef node_pool_h
+#define node_pool_h
+
+#include <stdlib.h>
+#include <stddef.h>
+
+/* A free list of equally sized memory blocks. Freed blocks are kept, up to
+ * max_free of them, and handed out again before malloc is asked. hits and
+ * misses count how often Alloc() was served from the list or not.
+ *
+ * Classes use it by overriding operator new and delete:
+ *
+ *   static FreeList foo_pool(sizeof(Foo), 64);
+ *   void* Foo::operator new (size_t size) throw() { return foo_pool.Alloc(); }
+ *   void Foo::operator delete (void *p) { foo_pool.Free(p); }
+ */
+class FreeList {
+public:
+  FreeList (size_t block_size, size_t max_free)
+  {
+    block_size_ = block_size < sizeof(Node) ? sizeof(Node) : block_size;
+    max_free_ = max_free;
+    head_ = NULL;
+    nfree = 0;
+    hits = 0;
+    misses = 0;
+  }
+
+  void* Alloc ()
+  {
+    if (head_ == NULL) {
+      misses++;
+      return malloc(block_size_);
+    }
+    hits++;
+    Node *node = head_;
+    head_ = node->next;
+    nfree--;
+    return node;
+  }
+
+  void Free (void *block)
+  {
+    if (block == NULL) return;
+    if (nfree >= max_free_) {
+      free(block);
+      return;
+    }
+    Node *node = static_cast<Node*>(block);
+    node->next = head_;
+    head_ = node;
+    nfree++;
+  }
+
+  size_t block_size () const { return block_size_; }
+
+  size_t nfree;
+  double hits;
+  double misses;
+
+private:
+  struct Node { Node *next; };
+  Node *head_;
+  size_t block_size_;
+  size_t max_free_;
+};
+
+#endif
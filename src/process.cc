@@ -5,6 +5,26 @@
 
 using namespace v8;
 
+// Indexed by libeio request type; see the enum in eio.h.
+static const char *eio_type_names[EIO_NUM_TYPES] = {
+  "custom",
+  "open", "close", "dup2",
+  "read", "write",
+  "readahead", "sendfile",
+  "stat", "lstat", "fstat",
+  "truncate", "ftruncate",
+  "utime", "futime",
+  "chmod", "fchmod",
+  "chown", "fchown",
+  "sync", "fsync", "fdatasync",
+  "msync", "mtouch", "sync_file_range",
+  "unlink", "rmdir", "mkdir", "rename",
+  "mknod", "readdir",
+  "link", "symlink", "readlink",
+  "group", "nop",
+  "busy"
+};
+
 static Handle<Value>
 ExitCallback (const Arguments& args)
 {
@@ -20,6 +40,87 @@ OnCallback (const Arguments& args)
   return Undefined(); 
 }
 
+// process.threadPoolStats()
+//
+// Returns { nreqs, nready, npending, nthreads, types } where types has an
+// entry for each kind of request which has completed so far:
+//
+//   { count, latency, service, histogram }
+//
+// latency is the mean time in milliseconds from submission until the
+// callback ran, service the mean part of that spent in a thread.
+// histogram[i] counts requests with a latency under 2^i microseconds.
+static Handle<Value>
+ThreadPoolStatsCallback (const Arguments& args)
+{
+  HandleScope scope;
+
+  Local<Object> stats = Object::New();
+  stats->Set(String::NewSymbol("nreqs"), Integer::New(eio_nreqs()));
+  stats->Set(String::NewSymbol("nready"), Integer::New(eio_nready()));
+  stats->Set(String::NewSymbol("npending"), Integer::New(eio_npending()));
+  stats->Set(String::NewSymbol("nthreads"), Integer::New(eio_nthreads()));
+
+  Local<Object> types = Object::New();
+  for (int type = 0; type < EIO_NUM_TYPES; type++) {
+    const eio_type_stats *s = eio_stats(type);
+    if (s->count == 0) continue;
+
+    Local<Object> t = Object::New();
+    t->Set(String::NewSymbol("count"), Integer::New(s->count));
+    t->Set(String::NewSymbol("latency"), Number::New(s->latency * 1000. / s->count));
+    t->Set(String::NewSymbol("service"), Number::New(s->service * 1000. / s->count));
+
+    Local<Array> histogram = Array::New(EIO_HIST_BUCKETS);
+    for (int i = 0; i < EIO_HIST_BUCKETS; i++)
+      histogram->Set(Integer::New(i), Integer::New(s->hist[i]));
+    t->Set(String::NewSymbol("histogram"), histogram);
+
+    types->Set(String::NewSymbol(eio_type_names[type]), t);
+  }
+  stats->Set(String::NewSymbol("types"), types);
+
+  return scope.Close(stats);
+}
+
+static const char*
+BackendName (unsigned int backend)
+{
+  switch (backend) {
+    case EVBACKEND_SELECT: return "select";
+    case EVBACKEND_POLL:   return "poll";
+    case EVBACKEND_EPOLL:  return "epoll";
+    case EVBACKEND_KQUEUE: return "kqueue";
+    case EVBACKEND_PORT:   return "port";
+  }
+  return "unknown";
+}
+
+// process.loopStats()
+//
+// Returns { backend, edgeTriggered, iterations, epollCtl, epollSkipped,
+// epollWait, epollEvents } for the main event loop. epollSkipped counts
+// watcher changes which needed no epoll_ctl; the epoll numbers are 0 with
+// other backends.
+static Handle<Value>
+LoopStatsCallback (const Arguments& args)
+{
+  HandleScope scope;
+
+  struct ev_epoll_stats epoll;
+  ev_epoll_stats(node_loop(), &epoll);
+
+  Local<Object> stats = Object::New();
+  stats->Set(String::NewSymbol("backend"), String::New(BackendName(ev_backend(node_loop()))));
+  stats->Set(String::NewSymbol("edgeTriggered"), Boolean::New(ev_edge_triggered(node_loop())));
+  stats->Set(String::NewSymbol("iterations"), Number::New(ev_loop_count(node_loop())));
+  stats->Set(String::NewSymbol("epollCtl"), Number::New(epoll.ctl));
+  stats->Set(String::NewSymbol("epollSkipped"), Number::New(epoll.skip));
+  stats->Set(String::NewSymbol("epollWait"), Number::New(epoll.wait));
+  stats->Set(String::NewSymbol("epollEvents"), Number::New(epoll.events));
+  return scope.Close(stats);
+}
+
 void
 NodeInit_process (Handle<Object> target)
 {
@@ -36,4 +137,10 @@ NodeInit_process (Handle<Object> target)
   // process.on()
   Local<FunctionTemplate> process_on = FunctionTemplate::New(OnCallback);
   process->Set(String::NewSymbol("on"), process_exit->GetFunction());
+
+  // 1 ... N with --workers=N, otherwise 0
+  process->Set(String::NewSymbol("worker"), Integer::New(node_worker()));
+
+  NODE_SET_METHOD(process, "threadPoolStats", ThreadPoolStatsCallback);
+  NODE_SET_METHOD(process, "loopStats", LoopStatsCallback);
 }
@@ -0,0 +1,364 @@
+#include "node.h"
+#include "file.h"
+#include "script_cache.h"
+
+#include <string>
+#include <map>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace v8;
+using namespace std;
+
+// Bump when the layout of cache files changes.
+#define SCRIPT_CACHE_MAGIC 0x6e6f6401
+
+// Layout of a cache file: this header, the script's path, then the
+// pre-parse data.
+struct CacheHeader {
+  uint32_t magic;
+  uint32_t hash;        // of the source which was pre-parsed
+  int64_t mtime;        // of the script file when it was read
+  int64_t size;
+  uint32_t path_length;
+  uint32_t data_length; // in unsigned ints
+};
+
+// Pre-parse data found next to a script read by node.readScript(), kept
+// until the script is compiled.
+struct PendingScript {
+  int64_t mtime;
+  int64_t size;
+  uint32_t hash;
+  unsigned *data; // NULL if nothing usable was cached
+  int data_length;
+};
+
+typedef map<string, PendingScript> PendingScripts;
+static PendingScripts pending;
+
+static string cache_dir; // empty when the cache is off
+
+static uint32_t
+Hash (const char *data, size_t length)
+{
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/* The directory has to be ours and closed to everybody else. Otherwise
+ * another user could have made it first, say under /tmp, to hand V8
+ * crafted pre-parse data or to plant symlinks. Checked in the thread pool
+ * before every read and write; the cache is off while it fails. */
+static bool
+CacheDirIsSafe ()
+{
+  struct stat st;
+  if (lstat(cache_dir.c_str(), &st) != 0)
+    return false;
+  return S_ISDIR(st.st_mode)
+      && st.st_uid == geteuid()
+      && (st.st_mode & 077) == 0;
+}
+
+static string
+CachePath (const string &path)
+{
+  char name[32];
+  snprintf(name, sizeof name, "/%08x.pre", Hash(path.data(), path.length()));
+  return cache_dir + name;
+}
+
+static bool
+ReadFully (int fd, void *buf, size_t length)
+{
+  char *p = static_cast<char*>(buf);
+  while (length > 0) {
+    ssize_t r = read(fd, p, length);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return false;
+    p += r;
+    length -= r;
+  }
+  return true;
+}
+
+struct ReadScriptRequest {
+  string path;
+  Persistent<Function> callback;
+
+  // filled in by the thread pool
+  int errorno;
+  char *source;
+  size_t length;
+  PendingScript script;
+};
+
+/* This function is executed in the thread pool. A cache file for another
+ * path which happens to hash the same, or one for an older version of the
+ * script, is ignored. */
+static void
+ReadCache (ReadScriptRequest *rs, const struct stat &st)
+{
+  rs->script.mtime = st.st_mtime;
+  rs->script.size = st.st_size;
+  rs->script.hash = 0;
+  rs->script.data = NULL;
+  rs->script.data_length = 0;
+
+  if (cache_dir.empty() || !CacheDirIsSafe()) return;
+
+  int fd = open(CachePath(rs->path).c_str(), O_RDONLY | O_NOFOLLOW);
+  if (fd < 0) return;
+
+  CacheHeader header;
+  if (!ReadFully(fd, &header, sizeof header)
+      || header.magic != SCRIPT_CACHE_MAGIC
+      || header.mtime != rs->script.mtime
+      || header.size != rs->script.size
+      || header.path_length != rs->path.length()
+      || header.data_length == 0) {
+    close(fd);
+    return;
+  }
+
+  string path(header.path_length, '\0');
+  // V8 frees pre-parse data with delete [].
+  unsigned *data = new unsigned[header.data_length];
+
+  if (ReadFully(fd, &path[0], header.path_length)
+      && path == rs->path
+      && ReadFully(fd, data, header.data_length * sizeof(unsigned))) {
+    rs->script.hash = header.hash;
+    rs->script.data = data;
+    rs->script.data_length = header.data_length;
+  } else {
+    delete [] data;
+  }
+  close(fd);
+}
+
+static int
+ExecuteReadScript (eio_req *req)
+{
+  ReadScriptRequest *rs = static_cast<ReadScriptRequest*>(req->data);
+  struct stat st;
+  rs->errorno = node_read_file(rs->path.c_str(), &st,
+                               &rs->source, &rs->length, 0);
+  if (rs->errorno == 0)
+    ReadCache(rs, st);
+  return 0;
+}
+
+static int
+AfterReadScript (eio_req *req)
+{
+  ReadScriptRequest *rs = static_cast<ReadScriptRequest*>(req->data);
+  HandleScope scope;
+
+  const int argc = 2;
+  Local<Value> argv[argc];
+  argv[0] = Integer::New(rs->errorno);
+  argv[1] = Local<Value>::New(Null());
+
+  if (rs->errorno == 0) {
+    PendingScripts::iterator it = pending.find(rs->path);
+    if (it != pending.end())
+      delete [] it->second.data; // read twice before being compiled
+    pending[rs->path] = rs->script;
+
+    argv[1] = node_contents_string(rs->source, rs->length);
+  }
+
+  Local<Function> callback = Local<Function>::New(rs->callback);
+  rs->callback.Dispose();
+  delete rs;
+
+  TryCatch try_catch;
+  callback->Call(Context::GetCurrent()->Global(), argc, argv);
+  if (try_catch.HasCaught())
+    node_fatal_exception(try_catch);
+
+  return 0;
+}
+
+// node.readScript(filename, callback)
+//
+// callback(status, source). Unlike File.readFile() the source is always
+// decoded as utf8, and a missing file is not worth a separate stat first:
+// status is ENOENT.
+static Handle<Value>
+ReadScript (const Arguments& args)
+{
+  if (args.Length() < 2 || !args[1]->IsFunction())
+    return ThrowException(String::New("readScript() needs a filename and a callback"));
+
+  HandleScope scope;
+
+  String::Utf8Value path(args[0]->ToString());
+
+  ReadScriptRequest *rs = new ReadScriptRequest;
+  rs->path = *path;
+  rs->callback = Persistent<Function>::New(Local<Function>::Cast(args[1]));
+  rs->errorno = 0;
+  rs->source = NULL;
+  rs->length = 0;
+
+  node_eio_warmup();
+  eio_custom(ExecuteReadScript, EIO_PRI_DEFAULT, AfterReadScript, rs);
+
+  return Undefined();
+}
+
+struct SaveRequest {
+  string path;
+  char *contents; // header, path and data
+  size_t length;
+};
+
+/* This function is executed in the thread pool. The file is written under
+ * a temporary name and renamed into place so that a concurrent reader
+ * never sees half of it. Errors are ignored; the cache is only a cache. */
+static int
+ExecuteSave (eio_req *req)
+{
+  SaveRequest *save = static_cast<SaveRequest*>(req->data);
+
+  mkdir(cache_dir.c_str(), 0700);
+  if (!CacheDirIsSafe()) return 0;
+
+  // Unique among the saves of this process, which may run concurrently.
+  static int saves = 0;
+  char suffix[48];
+  snprintf( suffix
+          , sizeof suffix
+          , ".%d.%d.tmp"
+          , getpid()
+          , __sync_fetch_and_add(&saves, 1)
+          );
+  string tmp = save->path + suffix;
+
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+  if (fd < 0) return 0;
+
+  size_t written = 0;
+  while (written < save->length) {
+    ssize_t r = write(fd, save->contents + written, save->length - written);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) break;
+    written += r;
+  }
+  close(fd);
+
+  if (written == save->length)
+    rename(tmp.c_str(), save->path.c_str());
+  else
+    unlink(tmp.c_str());
+
+  return 0;
+}
+
+static int
+AfterSave (eio_req *req)
+{
+  SaveRequest *save = static_cast<SaveRequest*>(req->data);
+  free(save->contents);
+  delete save;
+  return 0;
+}
+
+static void
+Save (const string &path, const PendingScript &script, ScriptData *data)
+{
+  CacheHeader header;
+  header.magic = SCRIPT_CACHE_MAGIC;
+  header.hash = script.hash;
+  header.mtime = script.mtime;
+  header.size = script.size;
+  header.path_length = path.length();
+  header.data_length = data->Length();
+
+  size_t data_bytes = data->Length() * sizeof(unsigned);
+
+  SaveRequest *save = new SaveRequest;
+  save->path = CachePath(path);
+  save->length = sizeof header + path.length() + data_bytes;
+  save->contents = static_cast<char*>(malloc(save->length));
+  if (save->contents == NULL) {
+    delete save;
+    return;
+  }
+
+  char *p = save->contents;
+  memcpy(p, &header, sizeof header);
+  p += sizeof header;
+  memcpy(p, path.data(), path.length());
+  p += path.length();
+  memcpy(p, data->Data(), data_bytes);
+
+  node_eio_warmup();
+  eio_custom(ExecuteSave, EIO_PRI_MIN, AfterSave, save);
+}
+
+ScriptData*
+node_script_data (Handle<String> source, Handle<String> filename)
+{
+  String::Utf8Value path(filename);
+  PendingScripts::iterator it = pending.find(*path);
+  if (it == pending.end())
+    return NULL;
+
+  PendingScript script = it->second;
+  pending.erase(it);
+
+  // Hash what is compiled, not what was read, so that a change to the
+  // module wrapper in main.js cannot pair old data with new source.
+  String::Utf8Value utf8(source);
+  uint32_t hash = Hash(*utf8, utf8.length());
+
+  if (script.data && script.hash == hash)
+    return ScriptData::New(script.data, script.data_length);
+
+  delete [] script.data;
+
+  ScriptData *data = ScriptData::PreCompile(*utf8, utf8.length());
+  if (data && !cache_dir.empty()) {
+    script.hash = hash;
+    Save(*path, script, data);
+  }
+  return data;
+}
+
+void
+NodeInit_script_cache (Handle<Object> node)
+{
+  HandleScope scope;
+
+  const char *dir = getenv("NODE_SCRIPT_CACHE");
+  const char *home = getenv("HOME");
+  if (dir) {
+    cache_dir = dir;
+  } else if (home && home[0] == '/') {
+    cache_dir = string(home) + "/.node-script-cache";
+  } else {
+    char default_dir[64];
+    snprintf(default_dir, sizeof default_dir, "/tmp/node-script-cache-%d", (int)getuid());
+    cache_dir = default_dir;
+  }
+
+  NODE_SET_METHOD(node, "readScript", ReadScript);
+}
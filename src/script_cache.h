@@ -0,0 +1,25 @@
+#ifndef node_script_cache_h
+#define node_script_cache_h
+
+#include <v8.h>
+
+/* Adds node.readScript(filename, callback) to the node object. It reads a
+ * module's source in the thread pool and, alongside it, any pre-parse data
+ * saved on disk by an earlier run for the same path, size and mtime.
+ *
+ * The data is kept until node.compile() is called for that filename; see
+ * node_script_data(). The directory is ~/.node-script-cache unless
+ * NODE_SCRIPT_CACHE names another one; an empty string turns the cache
+ * off. A directory which is not the user's own, or which others may
+ * read or write, is not used.
+ */
+void NodeInit_script_cache (v8::Handle<v8::Object> node);
+
+/* Returns pre-parse data for compiling source as filename, or NULL if the
+ * script was not read with node.readScript(). Data read from disk is used
+ * only if it was made from the same source; otherwise source is pre-parsed
+ * now and the result saved for next time. The caller owns the result. */
+v8::ScriptData* node_script_data (v8::Handle<v8::String> source,
+                                  v8::Handle<v8::String> filename);
+
+#endif // node_script_cache_h
@@ -1,120 +1,284 @@
 #include "node.h"
 #include "timers.h"
+
+#include <oi_queue.h>
+
+#include <map>
 #include <assert.h>
 
 using namespace v8;
+using namespace std;
 
 static Persistent<ObjectTemplate> timer_template;
 
+#define CALLBACK_SYMBOL String::NewSymbol("callback")
+#define ARGS_SYMBOL String::NewSymbol("args")
+
+class TimerList;
+
 class Timer {
  public:
-  Timer(Handle<Function> callback, ev_tstamp after, ev_tstamp repeat);
+  Timer(Handle<Function> callback, Handle<Array> args, ev_tstamp repeat);
   ~Timer();
 
   static Handle<Value> setTimeout (const Arguments& args);
   static Handle<Value> setInterval (const Arguments& args);
   static Handle<Value> clearTimeout (const Arguments& args);
 
+  static void Call (Handle<Object> handle);
+  void Stop ();
+
   Persistent<Object> handle_;
+  ev_tstamp repeat_;
+  ev_tstamp when_; // time the timer expires
+  TimerList *list_; // NULL when not started
+  oi_queue queue_;
 
  private:
-  static Timer* Unwrap (Handle<Object> handle);
+  static Timer* Unwrap (Handle<Value> handle);
+  static Handle<Value> Schedule (const Arguments& args, bool repeat);
+};
+
+/* Timers with the same duration expire in the order they were started.
+ * They are kept in one list per duration, newest at the head, and the list
+ * has a single ev_timer set for its oldest timer. Starting or clearing a
+ * timer is then a list insert or remove. A list is deleted, and its
+ * ev_timer stopped, once its last timer is gone, so that cleared timers
+ * do not keep the loop alive.
+ */
+class TimerList {
+ public:
+  static TimerList* Get (int64_t duration_ms);
+  void Append (Timer *timer);
+  void Remove (Timer *timer);
+
+ private:
+  TimerList (int64_t duration_ms);
+  ~TimerList ();
   static void OnTimeout (EV_P_ ev_timer *watcher, int revents);
+
+  int64_t duration_ms_;
+  ev_tstamp duration_;
+  oi_queue timers_;
   ev_timer watcher_;
+  bool firing_; // inside OnTimeout, which deletes the list itself
 };
 
-Timer* 
-Timer::Unwrap (Handle<Object> handle)
+typedef map<int64_t, TimerList*> TimerListMap;
+static TimerListMap timer_lists;
+
+TimerList::TimerList (int64_t duration_ms)
+{
+  duration_ms_ = duration_ms;
+  duration_ = (double)duration_ms / 1000.0;
+  oi_queue_init(&timers_);
+  ev_init(&watcher_, TimerList::OnTimeout);
+  watcher_.data = this;
+  firing_ = false;
+}
+
+TimerList::~TimerList ()
+{
+  assert(oi_queue_empty(&timers_));
+  ev_timer_stop(node_loop(), &watcher_);
+}
+
+TimerList*
+TimerList::Get (int64_t duration_ms)
+{
+  TimerListMap::iterator it = timer_lists.find(duration_ms);
+  if (it != timer_lists.end())
+    return it->second;
+
+  TimerList *list = new TimerList(duration_ms);
+  timer_lists[duration_ms] = list;
+  return list;
+}
+
+void
+TimerList::Append (Timer *timer)
+{
+  assert(timer->list_ == NULL);
+  timer->list_ = this;
+  timer->when_ = ev_now(node_loop()) + duration_;
+  oi_queue_insert_head(&timers_, &timer->queue_);
+
+  // Otherwise it is already set for an older timer.
+  if (!ev_is_active(&watcher_)) {
+    ev_timer_set(&watcher_, duration_, 0.);
+    ev_timer_start(node_loop(), &watcher_);
+  }
+}
+
+void
+TimerList::Remove (Timer *timer)
+{
+  assert(timer->list_ == this);
+  oi_queue_remove(&timer->queue_);
+  timer->list_ = NULL;
+
+  if (!firing_ && oi_queue_empty(&timers_)) {
+    timer_lists.erase(duration_ms_);
+    delete this;
+  }
+}
+
+void
+TimerList::OnTimeout (EV_P_ ev_timer *watcher, int revents)
+{
+  TimerList *list = static_cast<TimerList*>(watcher->data);
+  ev_tstamp now = ev_now(node_loop());
+
+  list->firing_ = true;
+
+  // Callbacks can start and clear timers in this list, so look at the
+  // oldest timer afresh each time round.
+  while (!oi_queue_empty(&list->timers_)) {
+    oi_queue *q = oi_queue_last(&list->timers_);
+    Timer *timer = oi_queue_data(q, Timer, queue_);
+
+    // Zero delay timers started from a callback wait for the next loop
+    // iteration instead of running here and now.
+    bool expired = list->duration_ > 0. ? timer->when_ <= now
+                                        : timer->when_ < now;
+    if (!expired) {
+      ev_timer_stop(node_loop(), watcher);
+      ev_timer_set(watcher, timer->when_ - now, 0.);
+      ev_timer_start(node_loop(), watcher);
+      list->firing_ = false;
+      return;
+    }
+
+    HandleScope scope;
+    Local<Object> handle = Local<Object>::New(timer->handle_);
+
+    timer->Stop();
+    if (timer->repeat_ > 0.)
+      list->Append(timer);
+    else
+      delete timer;
+
+    Timer::Call(handle);
+  }
+
+  timer_lists.erase(list->duration_ms_);
+  delete list;
+}
+
+Timer*
+Timer::Unwrap (Handle<Value> value)
 {
   HandleScope scope;
-  Handle<External> field = Handle<External>::Cast(handle->GetInternalField(0));
-  Timer* timer = static_cast<Timer*>(field->Value());
+  if (!value->IsObject())
+    return NULL;
+  Handle<Object> handle = value->ToObject();
+  if (handle->InternalFieldCount() != 1)
+    return NULL;
+  Handle<Value> field = handle->GetInternalField(0);
+  if (!field->IsExternal())
+    return NULL; // already fired or cleared
+  Timer* timer = static_cast<Timer*>(Handle<External>::Cast(field)->Value());
   return timer;
 }
 
 void
-Timer::OnTimeout (EV_P_ ev_timer *watcher, int revents)
+Timer::Call (Handle<Object> handle)
 {
-  Timer *timer = static_cast<Timer*>(watcher->data);
-
   HandleScope scope;
 
-  Local<Value> callback_value = timer->handle_->Get(String::NewSymbol("callback"));
-  if (!callback_value->IsFunction()) 
+  Local<Value> callback_value = handle->Get(CALLBACK_SYMBOL);
+  if (!callback_value->IsFunction())
     return;
-
   Local<Function> callback = Local<Function>::Cast(callback_value);
 
+  int argc = 0;
+  Local<Value> *argv = NULL;
+
+  Local<Value> args_value = handle->Get(ARGS_SYMBOL);
+  if (args_value->IsArray()) {
+    Local<Array> args = Local<Array>::Cast(args_value);
+    argc = args->Length();
+    argv = new Local<Value>[argc];
+    for (int i = 0; i < argc; i++)
+      argv[i] = args->Get(Integer::New(i));
+  }
+
   TryCatch try_catch;
-  callback->Call (Context::GetCurrent()->Global(), 0, NULL);
+  callback->Call (Context::GetCurrent()->Global(), argc, argv);
+  delete [] argv;
   if(try_catch.HasCaught())
     node_fatal_exception(try_catch);
-
-  // use ev_is_active instead?
-  if(watcher->repeat == 0.) 
-    delete timer;
 }
 
-Timer::Timer (Handle<Function> callback, ev_tstamp after, ev_tstamp repeat)
+Timer::Timer (Handle<Function> callback, Handle<Array> args, ev_tstamp repeat)
 {
   HandleScope scope;
 
   handle_ = Persistent<Object>::New(timer_template->NewInstance());
-  handle_->Set(String::NewSymbol("callback"), callback);
+  handle_->Set(CALLBACK_SYMBOL, callback);
+  if (!args.IsEmpty())
+    handle_->Set(ARGS_SYMBOL, args);
 
   Local<External> external = External::New(this);
   handle_->SetInternalField(0, external);
 
-  ev_timer_init(&watcher_, Timer::OnTimeout, after, repeat);
-  watcher_.data = this;
-
-  ev_timer_start(node_loop(), &watcher_);
+  repeat_ = repeat;
+  when_ = 0.;
+  list_ = NULL;
 }
 
 Timer::~Timer ()
 {
-  ev_timer_stop (node_loop(), &watcher_);
+  Stop();
   handle_->SetInternalField(0, Undefined());
   handle_.Dispose();
 }
 
+void
+Timer::Stop ()
+{
+  if (list_) list_->Remove(this);
+}
+
+// setTimeout(callback, delay, arg1, arg2, ...)
+// setInterval(callback, delay, arg1, arg2, ...)
 Handle<Value>
-Timer::setTimeout (const Arguments& args)
+Timer::Schedule (const Arguments& args, bool repeat)
 {
-  if (args.Length() < 2)
+  if (args.Length() < 2 || !args[0]->IsFunction())
     return Undefined();
 
   HandleScope scope;
 
   Local<Function> callback = Local<Function>::Cast(args[0]);
-  int delay = args[1]->IntegerValue();
+  int64_t delay = args[1]->IntegerValue();
+  if (delay < 0) delay = 0;
 
-  ev_tstamp after = (double)delay / 1000.0;
+  Local<Array> extra_args;
+  if (args.Length() > 2) {
+    extra_args = Array::New(args.Length() - 2);
+    for (int i = 2; i < args.Length(); i++)
+      extra_args->Set(Integer::New(i - 2), args[i]);
+  }
 
-  if (args.Length() > 2)
-    assert(0 && "extra params to setTimeout not yet implemented.");
+  ev_tstamp after = (double)delay / 1000.0;
 
-  Timer *timer = new Timer(callback, after, 0.0);
+  Timer *timer = new Timer(callback, extra_args, repeat ? after : 0.0);
+  TimerList::Get(delay)->Append(timer);
 
   return scope.Close(timer->handle_);
 }
 
 Handle<Value>
-Timer::setInterval (const Arguments& args)
+Timer::setTimeout (const Arguments& args)
 {
-  if (args.Length() < 2)
-    return Undefined();
-
-  HandleScope scope;
-
-  Local<Function> callback = Local<Function>::Cast(args[0]);
-  int delay = args[1]->IntegerValue();
-
-  ev_tstamp after = (double)delay / 1000.0;
-
-  Timer *timer = new Timer(callback, after, after);
+  return Schedule(args, false);
+}
 
-  return scope.Close(timer->handle_);
+Handle<Value>
+Timer::setInterval (const Arguments& args)
+{
+  return Schedule(args, true);
 }
 
 Handle<Value>
@@ -124,9 +288,9 @@ Timer::clearTimeout (const Arguments& args)
     return Undefined();
 
   HandleScope scope;
-  Local<Object> handle = Local<Object>::Cast(args[0]);
-  Timer *timer = Timer::Unwrap(handle);
-  delete timer;
+  Timer *timer = Timer::Unwrap(args[0]);
+  if (timer)
+    delete timer;
 
   return Undefined();
 }
@@ -0,0 +1,46 @@
+// Sequential 4kb reads through one File, each issued from the callback of
+// the one before, then sequential stats. Not run by "make test". Run it
+// once as is and once with --no-io-uring to compare the two backends:
+//   build/default/node test/bench-file-read.js
+//   build/default/node --no-io-uring test/bench-file-read.js
+var n = 50000;
+var size = 4*1024;
+
+function report (what, start) {
+  var elapsed = new Date - start;
+  puts(File.backend + " " + what + ": " + (n * 1000 / elapsed).toFixed(0) + " ops/sec");
+}
+
+function onLoad () {
+  var path = node.path.join(node.path.dirname(__filename), "bench-file-read.js");
+  var file = new File;
+  var i = 0;
+  var start;
+
+  function stats () {
+    var j = 0;
+    start = new Date;
+    function next () {
+      if (++j == n) {
+        report("stats", start);
+        return;
+      }
+      File.stat(path, next);
+    }
+    File.stat(path, next);
+  }
+
+  function next (status, chunk) {
+    if (++i == n) {
+      report("4kb reads", start);
+      file.close(stats);
+      return;
+    }
+    file.read(size, 0, next);
+  }
+
+  file.open(path, "r", function (status) {
+    start = new Date;
+    file.read(size, 0, next);
+  });
+}
@@ -0,0 +1,25 @@
+// Cost of a setTimeout/clearTimeout pair. Not run by "make test".
+//   build/default/node test/bench-timers.js
+var n = 200000;
+var noop = function () { };
+
+function bench (name, delay) {
+  var start = new Date;
+  for (var i = 0; i < n; i++)
+    clearTimeout(setTimeout(noop, delay));
+  var elapsed = new Date - start;
+  puts(name + ": " + (elapsed * 1e6 / n).toFixed(0) + " ns per pair");
+}
+
+function onLoad () {
+  bench("same delay", 2000);
+
+  // A second pass with timers left pending, as when every request in
+  // flight holds a deadline.
+  var pending = [];
+  for (var i = 0; i < 10000; i++)
+    pending.push(setTimeout(noop, 2000));
+  bench("same delay, 10000 pending", 2000);
+  for (var i = 0; i < pending.length; i++)
+    clearTimeout(pending[i]);
+}
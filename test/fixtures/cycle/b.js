@@ -0,0 +1,3 @@
+var c = require("c");
+exports.name = "B";
+exports.other = function () { return c.name; };
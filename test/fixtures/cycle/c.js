@@ -0,0 +1,3 @@
+var b = require("b");
+exports.name = "C";
+exports.other = function () { return b.name; };
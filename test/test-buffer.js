@@ -0,0 +1,31 @@
+include("mjsunit");
+
+function onLoad () {
+  var b = new Buffer(4);
+  assertEquals(4, b.length);
+
+  b[0] = 104; // h
+  b[1] = 105; // i
+  b[2] = 0x1ff; // truncated to a byte
+  b[3] = 33;  // !
+  assertEquals(104, b[0]);
+  assertEquals(0xff, b[2]);
+  assertEquals(undefined, b[4]);
+
+  b[2] = 32;
+  assertEquals("hi !", b.toString());
+  assertEquals("hi !", b.encodeUtf8());
+
+  var dirname = node.path.dirname(__filename);
+  var x = node.path.join(dirname, "fixtures", "x.txt");
+
+  var file = new File;
+  file.open(x, "r");
+  file.read(3, 0, function (status, chunk) {
+    assertEquals(0, status);
+    assertInstanceof(chunk, Buffer);
+    assertEquals(3, chunk.length);
+    assertEquals("xyz", chunk.toString());
+  });
+  file.close();
+}
@@ -0,0 +1,25 @@
+include("mjsunit");
+
+// Cleared timers must not keep the process alive. If they did, this test
+// would only exit after an hour.
+var hour = 60 * 60 * 1000;
+
+function onLoad () {
+  // the only timer of its duration
+  clearTimeout(setTimeout(function () { assertTrue(false); }, hour));
+
+  // the older of two with the same duration, then the newer one later
+  var older = setTimeout(function () { assertTrue(false); }, hour + 1);
+  var newer = setTimeout(function () { assertTrue(false); }, hour + 1);
+  clearTimeout(older);
+
+  // an interval which clears itself while its list is firing
+  var count = 0;
+  var interval = setInterval(function () {
+    if (++count == 2) {
+      clearInterval(interval);
+      clearTimeout(newer);
+    }
+    assertTrue(count <= 2);
+  }, 10);
+}
@@ -0,0 +1,23 @@
+include("mjsunit");
+
+// File operations go through io_uring when the build and the kernel have
+// it. Then the ring must really be used, not just reported.
+var done = false;
+
+setTimeout(function () {
+  assertTrue(done, "stat never called back");
+}, 1000);
+
+function onLoad () {
+  puts("file backend: " + File.backend);
+  var before = File.uringCompletions();
+
+  File.stat(__filename, function (status, stats) {
+    assertEquals(0, status);
+    if (File.backend == "io_uring")
+      assertTrue(File.uringCompletions() > before);
+    else
+      assertEquals(0, File.uringCompletions());
+    done = true;
+  });
+}
@@ -0,0 +1,22 @@
+include("mjsunit");
+
+function onLoad () {
+  var dirname = node.path.dirname(__filename);
+  var fixtures = node.path.join(dirname, "fixtures");
+
+  File.cat(node.path.join(fixtures, "x.txt"), function (status, content) {
+    assertEquals(0, status);
+    assertEquals("xyz\n", content);
+  });
+
+  File.readFile(node.path.join(fixtures, "x.txt"), "raw", function (status, content) {
+    assertEquals(0, status);
+    assertInstanceof(content, Buffer);
+    assertEquals(4, content.length);
+  });
+
+  File.readFile(node.path.join(fixtures, "does-not-exist"), function (status, content) {
+    assertTrue(status != 0);
+    assertEquals(null, content);
+  });
+}
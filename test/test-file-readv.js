@@ -0,0 +1,50 @@
+include("mjsunit");
+
+var tmp = "/tmp/node-test-writev-" + Math.floor(Math.random() * 1000000000);
+var removed = false;
+
+setTimeout(function () {
+  assertTrue(removed, "the temp file was never removed");
+}, 1000);
+
+function onLoad () {
+  var dirname = node.path.dirname(__filename);
+  var x = node.path.join(dirname, "fixtures", "x.txt");
+
+  var file = new File;
+  file.open(x, "r", function (status) {
+    assertEquals(0, status);
+    file.readv([[2, 2], [0, 2], [4, 10]], function (status, buffers) {
+      assertEquals(0, status);
+      assertEquals(3, buffers.length);
+      assertEquals("z\n", buffers[0].toString());
+      assertEquals("xy", buffers[1].toString());
+      assertEquals(null, buffers[2]); // past the end
+
+      file.close();
+    });
+  });
+
+  var out = new File;
+  out.open(tmp, "w+", function (status) {
+    assertEquals(0, status);
+    var b = new Buffer(2);
+    b[0] = 97; // a
+    b[1] = 98; // b
+    out.writev([[3, "def"], [0, b], [2, "c"]], function (status, written) {
+      assertEquals(0, status);
+      assertEquals([3, 2, 1], written);
+
+      out.readv([[0, 6]], function (status, buffers) {
+        assertEquals("abcdef", buffers[0].toString());
+        out.close(function (status) {
+          assertEquals(0, status);
+          File.unlink(tmp, function (status) {
+            assertEquals(0, status);
+            removed = true;
+          });
+        });
+      });
+    });
+  });
+}
@@ -0,0 +1,69 @@
+include("mjsunit");
+
+var suffix = Math.floor(Math.random() * 1000000000);
+var tmp = "/tmp/node-test-file-stream-" + suffix;
+var copy = "/tmp/node-test-file-stream-copy-" + suffix;
+var finished = false;
+
+setTimeout(function () {
+  assertTrue(finished, "the copy never completed");
+}, 1000);
+
+function onLoad () {
+  var out = File.createWriteStream(tmp, {highWaterMark: 8});
+  assertTrue(out.write("hello "));
+  assertFalse(out.write("world\n"));
+  out.onClose = readBack;
+  out.close();
+}
+
+function readBack () {
+  var stream = File.createReadStream(tmp, {chunkSize: 4});
+  var chunks = [];
+  var paused = false;
+
+  stream.onData = function (chunk) {
+    assertFalse(paused);
+    chunks.push(chunk.toString());
+    stream.pause();
+    paused = true;
+    setTimeout(function () {
+      paused = false;
+      stream.resume();
+    }, 1);
+  };
+
+  stream.onEnd = function () {
+    assertEquals(["hell", "o wo", "rld\n"], chunks);
+    copyFile();
+  };
+}
+
+function copyFile () {
+  var source = File.createReadStream(tmp, {chunkSize: 5, readAhead: 1});
+  var destination = File.createWriteStream(copy);
+
+  source.pipe(destination, function () {
+    destination.onClose = function () {
+      File.cat(copy, function (status, contents) {
+        assertEquals(0, status);
+        assertEquals("hello world\n", contents);
+        cleanUp();
+      });
+    };
+    destination.close();
+  });
+}
+
+function cleanUp () {
+  File.unlink(tmp, function (status) {
+    assertEquals(0, status);
+  });
+  File.unlink(copy, function (status) {
+    assertEquals(0, status);
+    File.exists(copy, function (exists) {
+      assertFalse(exists);
+      finished = true;
+    });
+  });
+}
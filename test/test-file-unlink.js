@@ -0,0 +1,29 @@
+include("mjsunit");
+
+var tmp = "/tmp/node-test-file-unlink-" + Math.floor(Math.random() * 1000000000);
+var removed = false;
+
+setTimeout(function () {
+  assertTrue(removed, "the file was never removed");
+}, 1000);
+
+function onLoad () {
+  var file = new File;
+  file.open(tmp, "w", function (status) {
+    assertEquals(0, status);
+    file.close(function (status) {
+      assertEquals(0, status);
+      File.unlink(tmp, function (status) {
+        assertEquals(0, status);
+        File.exists(tmp, function (exists) {
+          assertFalse(exists);
+          // a second time there is nothing left to remove
+          File.unlink(tmp, function (status) {
+            assertEquals(File.ENOENT, status);
+            removed = true;
+          });
+        });
+      });
+    });
+  });
+}
@@ -0,0 +1,82 @@
+include("mjsunit");
+
+// One connection, pipelined, through every way a response body can be
+// framed. The responses must come back in request order however late
+// each handler answers, and the HTTP/1.0 request at the end closes the
+// connection.
+var port = 12127;
+var closed = false;
+
+setTimeout(function () {
+  assertTrue(closed, "the connection was never closed");
+}, 2000);
+
+function onLoad () {
+  var server = new HTTPServer(null, port, function (req) {
+    if (req.path == "/length") {
+      // Finished before the loop blocks: Content-Length.
+      req.respond(200, {});
+      if (req.method != "HEAD") req.respond("hello");
+      req.respond(null);
+
+    } else if (req.path == "/chunked") {
+      // Still open when the loop blocks: chunked, or the end of the
+      // connection for HTTP/1.0.
+      req.respond(200, {});
+      req.respond("hel");
+      setTimeout(function () {
+        req.respond("lo");
+        req.respond(null);
+      }, 10);
+
+    } else if (req.path == "/lazy") {
+      // The head is only read once later requests have been parsed.
+      setTimeout(function () {
+        assertEquals("/lazy", req.uri);
+        assertEquals("yes", req.headers.X_LAZY);
+        req.respond(200, {});
+        req.respond(req.headers.X_LAZY);
+        req.respond(null);
+      }, 50);
+
+    } else if (req.path == "/status") {
+      req.respond(parseInt(req.query_string), {});
+      req.respond(null);
+    }
+  });
+
+  var received = "";
+  var socket = new Socket;
+  socket.onRead = function (data) {
+    if (data) received += data;
+  };
+
+  socket.onClose = function () {
+    closed = true;
+    assertEquals( "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello"
+                + "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                + "3\r\nhel\r\n2\r\nlo\r\n0\r\n\r\n"
+                + "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nyes"
+                + "HTTP/1.1 204 No Content\r\n\r\n"
+                + "HTTP/1.1 304 Not Modified\r\n\r\n"
+                + "HTTP/1.1 100 Continue\r\n\r\n"
+                + "HTTP/1.1 200 OK\r\n\r\n"
+                + "HTTP/1.0 200 OK\r\nConnection: close\r\n\r\nhello"
+                , received
+                );
+    process.exit(0);
+  };
+
+  socket.connectTCP(port, "localhost", function (status) {
+    assertEquals(0, status);
+    socket.write( "GET /length HTTP/1.1\r\n\r\n"
+                + "GET /chunked HTTP/1.1\r\n\r\n"
+                + "GET /lazy HTTP/1.1\r\nX-Lazy: yes\r\n\r\n"
+                + "GET /status?204 HTTP/1.1\r\n\r\n"
+                + "GET /status?304 HTTP/1.1\r\n\r\n"
+                + "GET /status?100 HTTP/1.1\r\n\r\n"
+                + "HEAD /length HTTP/1.1\r\n\r\n"
+                + "GET /chunked HTTP/1.0\r\n\r\n"
+                );
+  });
+}
@@ -0,0 +1,56 @@
+include("mjsunit");
+
+// Requests stay readable after their response has finished, also the
+// properties nobody looked at while the native request was around. The
+// first request is recycled for the second; the second goes away with
+// the connection.
+var port = 12126;
+var requests = [];
+
+function onLoad () {
+  var server = new HTTPServer(null, port, function (req) {
+    requests.push(req);
+    if (requests.length == 1) assertEquals("GET", req.method);
+    req.respond(200, { "Content-Type": "text/plain" });
+    req.respond("hello\n");
+    req.respond(null);
+  });
+
+  var socket = new Socket;
+  socket.onRead = function (data) { };
+
+  socket.onClose = function () {
+    assertEquals(2, requests.length);
+
+    var a = requests[0];
+    assertEquals("GET", a.method);
+    assertEquals("/one", a.path);
+    assertEquals("a=1", a.query_string);
+    assertEquals("1.1", a.http_version);
+    assertEquals("first", a.headers.X_THING);
+    assertEquals("localhost", a.headers.HOST);
+
+    var b = requests[1];
+    assertEquals("POST", b.method);
+    assertEquals("/two", b.uri);
+    assertEquals("second", b.headers.X_THING);
+    assertEquals("close", b.headers.CONNECTION);
+
+    process.exit(0);
+  };
+
+  socket.connectTCP(port, "localhost", function (status) {
+    assertEquals(0, status);
+    socket.write( "GET /one?a=1 HTTP/1.1\r\n"
+                + "Host: localhost\r\n"
+                + "X-Thing: first\r\n"
+                + "\r\n"
+                + "POST /two HTTP/1.1\r\n"
+                + "Host: localhost\r\n"
+                + "X-Thing: second\r\n"
+                + "Content-Length: 0\r\n"
+                + "Connection: close\r\n"
+                + "\r\n"
+                );
+  });
+}
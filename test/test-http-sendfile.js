@@ -0,0 +1,81 @@
+include("mjsunit");
+
+// request.sendFile() on one pipelined connection: part of a file with
+// its own status line and Content-Length, a whole file as a chunk of a
+// chunked body, and a missing file, after which the connection must
+// still answer the next request.
+var port = 12129;
+var results = {};
+var closed = false;
+
+setTimeout(function () {
+  assertTrue(closed, "the connection was never closed");
+}, 2000);
+
+function onLoad () {
+  var x = node.path.join(node.path.dirname(__filename), "fixtures", "x.txt");
+
+  var server = new HTTPServer(null, port, function (req) {
+    if (req.path == "/range") {
+      req.sendFile(x, { offset: 1
+                      , length: 2
+                      , status: 200
+                      , headers: {"Content-Type": "text/plain"}
+                      }, function (errno) {
+        results.range = errno;
+        req.respond(null);
+      });
+
+    } else if (req.path == "/chunked") {
+      req.respond(200, {});
+      req.sendFile(x, {}, function (errno) {
+        results.chunked = errno;
+        req.respond(null);
+      });
+
+    } else if (req.path == "/missing") {
+      req.sendFile(x + ".missing", {status: 200}, function (errno) {
+        results.missing = errno;
+        req.respond(404, {});
+        req.respond(null);
+      });
+
+    } else if (req.path == "/whole") {
+      req.sendFile(x, {status: 200}, function (errno) {
+        results.whole = errno;
+        req.respond(null);
+      });
+    }
+  });
+
+  var received = "";
+  var socket = new Socket;
+  socket.onRead = function (data) {
+    if (data) received += data;
+  };
+
+  socket.onClose = function () {
+    closed = true;
+    assertEquals(0, results.range);
+    assertEquals(0, results.chunked);
+    assertEquals(File.ENOENT, results.missing);
+    assertEquals(0, results.whole);
+    assertEquals( "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 2\r\n\r\nyz"
+                + "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                + "4\r\nxyz\n\r\n0\r\n\r\n"
+                + "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n"
+                + "HTTP/1.1 200 OK\r\nContent-Length: 4\r\n\r\nxyz\n"
+                , received
+                );
+    process.exit(0);
+  };
+
+  socket.connectTCP(port, "localhost", function (status) {
+    assertEquals(0, status);
+    socket.write( "GET /range HTTP/1.1\r\n\r\n"
+                + "GET /chunked HTTP/1.1\r\n\r\n"
+                + "GET /missing HTTP/1.1\r\n\r\n"
+                + "GET /whole HTTP/1.1\r\nConnection: close\r\n\r\n"
+                );
+  });
+}
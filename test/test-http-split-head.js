@@ -0,0 +1,80 @@
+include("mjsunit");
+
+// A request head which arrives in pieces, cut inside the URI, a field
+// name and a value. It starts right behind a body which fills most of
+// the connection's 64k read buffer, so the unfinished head has to be
+// moved to the front of the buffer before the rest of it can be read.
+var port = 12130;
+var fill = 62000;
+var closed = false;
+var checked = false;
+
+setTimeout(function () {
+  assertTrue(closed, "the connection was never closed");
+}, 2000);
+
+function onLoad () {
+  var server = new HTTPServer(null, port, function (req) {
+    if (req.path == "/fill") {
+      var length = 0;
+      req.onbody = function (chunk) {
+        if (chunk) {
+          length += chunk.length;
+          return;
+        }
+        req.respond(200, {});
+        req.respond(String(length));
+        req.respond(null);
+      };
+
+    } else {
+      assertEquals("/split?a=b&c=d", req.uri);
+      assertEquals("/split", req.path);
+      assertEquals("a=b&c=d", req.query_string);
+      assertEquals("first half", req.headers.X_SPLIT_FIELD);
+      assertEquals("close", req.headers.CONNECTION);
+      checked = true;
+      req.respond(200, {});
+      req.respond("ok");
+      req.respond(null);
+    }
+  });
+
+  var received = "";
+  var socket = new Socket;
+  socket.onRead = function (data) {
+    if (data) received += data;
+  };
+
+  socket.onClose = function () {
+    closed = true;
+    assertTrue(checked);
+    assertEquals( "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n" + fill
+                + "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok"
+                , received
+                );
+    process.exit(0);
+  };
+
+  var body = [];
+  for (var i = 0; i < fill; i++) body.push("x");
+
+  var pieces = [ "it?a=b&c=d HTTP/1.1\r\nX-Sp"
+               , "lit-Field: first ha"
+               , "lf\r\nConnection: close\r\n\r\n"
+               ];
+
+  function writeNext () {
+    socket.write(pieces.shift());
+    if (pieces.length > 0) setTimeout(writeNext, 20);
+  }
+
+  socket.connectTCP(port, "localhost", function (status) {
+    assertEquals(0, status);
+    socket.write( "POST /fill HTTP/1.1\r\nContent-Length: " + fill + "\r\n\r\n"
+                + body.join("")
+                + "GET /spl"
+                );
+    setTimeout(writeNext, 20);
+  });
+}
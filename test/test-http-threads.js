@@ -0,0 +1,80 @@
+include("mjsunit");
+
+// threads mode: requests are read and parsed on other threads. Pipelined
+// requests which add up to more than requestBufferLimit must all arrive,
+// as the reading thread waits for javascript to take them, and in order.
+// A single request over the limit closes its connection unanswered.
+var port = 12128;
+var seen = [];
+var finished = false;
+
+setTimeout(function () {
+  assertTrue(finished, "the connections were never closed");
+}, 2000);
+
+function request (n, length, last) {
+  var s = "";
+  for (var i = 0; i < length; i++) s += "x";
+  return "POST /n/" + n + " HTTP/1.1\r\n"
+       + "X-N: " + n + "\r\n"
+       + "Content-Length: " + length + "\r\n"
+       + (last ? "Connection: close\r\n" : "")
+       + "\r\n"
+       + s;
+}
+
+function onLoad () {
+  var server = new HTTPServer(null, port, function (req) {
+    seen.push(req.headers.X_N);
+    var length = 0;
+    req.onbody = function (chunk) {
+      if (chunk) {
+        length += chunk.length;
+        return;
+      }
+      req.respond(200, {});
+      req.respond(req.headers.X_N + ":" + length);
+      req.respond(null);
+    };
+  }, { threads: 2, requestBufferLimit: 256 });
+
+  var received = "";
+  var socket = new Socket;
+  socket.onRead = function (data) {
+    if (data) received += data;
+  };
+  socket.onClose = function () {
+    var expected = "";
+    for (var n = 1; n <= 5; n++) {
+      var text = n + ":100";
+      expected += "HTTP/1.1 200 OK\r\nContent-Length: " + text.length + "\r\n\r\n" + text;
+    }
+    assertEquals(expected, received);
+    assertEquals(["1", "2", "3", "4", "5"], seen);
+    tooLarge();
+  };
+  socket.connectTCP(port, "localhost", function (status) {
+    assertEquals(0, status);
+    var s = "";
+    for (var n = 1; n <= 5; n++) s += request(n, 100, n == 5);
+    socket.write(s);
+  });
+}
+
+function tooLarge () {
+  var received = "";
+  var socket = new Socket;
+  socket.onRead = function (data) {
+    if (data) received += data;
+  };
+  socket.onClose = function () {
+    assertEquals("", received);
+    assertEquals(5, seen.length);
+    finished = true;
+    process.exit(0);
+  };
+  socket.connectTCP(port, "localhost", function (status) {
+    assertEquals(0, status);
+    socket.write(request(6, 1000, true));
+  });
+}
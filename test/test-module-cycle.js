@@ -0,0 +1,20 @@
+include("mjsunit");
+
+// b and c require each other and this requires both, so each of them is
+// already being loaded when the other asks for it. Neither may wait for
+// the other.
+var b = require("fixtures/cycle/b");
+var c = require("fixtures/cycle/c");
+var loaded = false;
+
+setTimeout(function () {
+  assertTrue(loaded, "onLoad never ran");
+}, 1000);
+
+function onLoad () {
+  loaded = true;
+  assertEquals("B", b.name);
+  assertEquals("C", c.name);
+  assertEquals("C", b.other());
+  assertEquals("B", c.other());
+}
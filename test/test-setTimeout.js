@@ -14,4 +14,21 @@ function onLoad () {
   // this timer shouldn't execute
   var id = setTimeout(function () { assertTrue(false); }, 500);
   clearTimeout(id);
+
+  // extra arguments are passed to the callback
+  setTimeout(function (a, b) {
+    assertEquals("a", a);
+    assertEquals(2, b);
+  }, 10, "a", 2);
+
+  // clearing a timer which already fired does nothing
+  var fired = setTimeout(function () {
+    setTimeout(function () { clearTimeout(fired); }, 0);
+  }, 20);
+
+  var count = 0;
+  var interval = setInterval(function () {
+    if (++count == 3) clearInterval(interval);
+    assertTrue(count <= 3);
+  }, 10);
 }
@@ -0,0 +1,20 @@
+// Flags: --workers=2
+include("mjsunit");
+
+// Each worker runs this. Both bind the same port, which only works with
+// SO_REUSEPORT, and keep it for a while so that they overlap. A worker
+// which throws exits with an error and so does the supervisor.
+var port = 12125;
+
+function onLoad () {
+  assertTrue(process.worker == 1 || process.worker == 2);
+
+  var server = new Server(1024);
+  server.listenTCP(port, function (connection) {
+    connection.close();
+  });
+
+  setTimeout(function () {
+    server.close();
+  }, 500);
+}